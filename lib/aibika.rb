@@ -1,10 +1,22 @@
 # frozen_string_literal: true
 
 require_relative 'aibika/aibika_builder'
+require_relative 'aibika/analysis'
+require_relative 'aibika/bcj_filter'
+require_relative 'aibika/block_dictionary'
+require_relative 'aibika/build_cache'
+require_relative 'aibika/chunk_index'
 require_relative 'aibika/cli'
+require_relative 'aibika/compression_profile'
+require_relative 'aibika/delta'
+require_relative 'aibika/gc_tuning'
 require_relative 'aibika/host'
 require_relative 'aibika/library_detector'
+require_relative 'aibika/lzma_compressor'
+require_relative 'aibika/path_index'
 require_relative 'aibika/pathname'
+require_relative 'aibika/source_archive'
+require_relative 'aibika/vfs_image'
 require_relative 'aibika/version'
 
 module Aibika
@@ -67,13 +79,47 @@ module Aibika
   BINDIR = Pathname.new('bin')
   # Directory for GEMHOME files in temporary directory.
   GEMHOMEDIR = Pathname.new('gemhome')
+  # File system interposer in temporary directory (see --vfs).
+  VFS_LIBRARY = Pathname.new('lib/aibika/libaibikavfs.so')
+  # Feature that installs the prebuilt RubyGems specification index
+  # when the packaged application starts.
+  GEM_INDEX_FEATURE = 'aibika/runtime/gem_index'
+  # Feature that starts the resident server (see --resident), or hands
+  # the program to it.
+  RESIDENT_FEATURE = 'aibika/runtime/resident'
+  # Feature that loads the packed Ruby files (see --pack-sources).
+  PACKED_SOURCES_FEATURE = 'aibika/runtime/packed_sources'
+  # Feature that parses the startup metrics that the stub passes to the
+  # program (AIBIKA_STARTUP_METRICS).
+  STARTUP_METRICS_FEATURE = 'aibika/runtime/startup_metrics'
 
   @ignore_modules = []
 
   @options = {
     lzma_mode: true,
+    lzma_threads: nil,
+    bcj: true,
+    store_incompressible: true,
+    shared_store: nil,
+    resident: nil,
+    vfs: false,
+    extract_cache: false,
+    prefetch: true,
+    payload_file: false,
+    pack_sources: false,
+    analyze: false,
+    delta_from: nil,
+    compression_profile: nil,
+    compression_target: nil,
+    shared_dictionary: false,
+    dedup: false,
+    gc_tuning: false,
+    gc_env: {},
+    build_cache: nil,
+    refresh_dep_cache: false,
     extra_dlls: [],
     files: [],
+    entries: [],
     run_script: true,
     add_all_core: false,
     output_override: nil,
@@ -93,13 +139,14 @@ module Aibika
     arg: [],
     enc: true,
     allow_self: false,
+    gem_index: true,
     gem: []
   }
 
   @options.each_key { |opt| eval("def self.#{opt}; @options[:#{opt}]; end") }
 
   class << self
-    attr_reader :lzmapath, :ediconpath, :stubimage, :stubwimage
+    attr_reader :lzmapath, :ediconpath, :stubimage, :stubwimage, :vfspath
   end
 
   # Returns a binary blob store embedded in the current Ruby script.
@@ -130,13 +177,40 @@ module Aibika
       ediconimage = next_embedded_image
       @ediconpath = Host.tempdir / 'edicon.exe'
       File.open(@ediconpath, 'wb') { |file| file << ediconimage }
-    else
+    elsif Host.windows?
       aibikapath = Pathname(File.dirname(__FILE__))
       @stubimage = File.binread(aibikapath / '../share/aibika/stub.exe')
       @stubwimage = File.binread(aibikapath / '../share/aibika/stubw.exe')
       @lzmapath = (aibikapath / '../share/aibika/lzma.exe').expand
       @ediconpath = (aibikapath / '../share/aibika/edicon.exe').expand
+    else
+      # The POSIX stub has no windowed variant; LZMA blocks are
+      # compressed with xz (see CompressionProfile#lzma_command)
+      aibikapath = Pathname(File.dirname(__FILE__))
+      @stubimage = @stubwimage = File.binread(aibikapath / '../share/aibika/stub')
+      @lzmapath = find_in_path('xz')
+      Aibika.fatal_error 'xz was not found in PATH, use --no-lzma to build without it' if lzma_mode && !@lzmapath
+      @vfspath = (aibikapath / '../share/aibika/libaibikavfs.so').expand
+      Aibika.fatal_error 'The file system interposer (libaibikavfs.so) was not built' if vfs && !@vfspath.exist?
+    end
+  end
+
+  # Ruby files that Ruby loads before any -r feature, which are not
+  # packed (see --pack-sources)
+  def self.boot_features
+    ruby = (Host.bindir / Host.ruby_exe).to_s
+    features = IO.popen({ 'RUBYOPT' => nil }, [ruby, '-e', 'puts $LOADED_FEATURES'], &:read).lines.map(&:chomp)
+    # Evaluated by RubyGems, so missing in $LOADED_FEATURES (see build_exe)
+    kernel_require = features.grep(%r{/rubygems\.rb\z}).map { |path| path.sub(/\.rb\z/, '/core_ext/kernel_require.rb') }
+    (features + kernel_require).map { |path| Pathname(path).expand.to_posix }
+  end
+
+  def self.find_in_path(name)
+    ENV['PATH'].to_s.split(File::PATH_SEPARATOR).each do |dir|
+      path = File.join(dir, name)
+      return Pathname(path) if File.executable?(path) && !File.directory?(path)
     end
+    nil
   end
 
   def self.init(argv)
@@ -182,19 +256,12 @@ module Aibika
 
   # Guess the load path (from 'paths') that was used to load
   # 'path'. This is primarily relevant on Ruby 1.8 which stores
-  # "unqualified" paths in $LOADED_FEATURES.
-  def self.find_load_path(loadpaths, feature)
+  # "unqualified" paths in $LOADED_FEATURES. Callers that look up many
+  # features pass the index of the load paths (see load_path_index).
+  def self.find_load_path(loadpaths, feature, index = nil)
     if feature.absolute?
-      # Choose those loadpaths which contain the feature
-      candidate_loadpaths = loadpaths.select { |loadpath| feature.subpath?(loadpath.expand) }
-      # Guess the require'd feature
-      feature_pairs = candidate_loadpaths.map { |loadpath| [loadpath, feature.relative_path_from(loadpath.expand)] }
-      # Select the shortest possible require-path (longest load-path)
-      if feature_pairs.empty?
-        nil
-      else
-        feature_pairs.min_by { |_loadpath, feature| feature.path.size }[0]
-      end
+      # Select the shortest possible require-path (innermost load-path)
+      (index || load_path_index(loadpaths)).lookup(feature)&.last
     else
       # Select the loadpaths that contain 'feature' and select the shortest
       candidates = loadpaths.select { |loadpath| feature.expand(loadpath).exist? }
@@ -202,6 +269,11 @@ module Aibika
     end
   end
 
+  # Index of the expanded load paths, for find_load_path
+  def self.load_path_index(loadpaths)
+    PathIndex.new(loadpaths.map { |loadpath| [loadpath.expand, loadpath] })
+  end
+
   # Find the root of all files specified on the command line and use
   # it as the "src" of the output.
   def self.find_src_root(files)
@@ -237,7 +309,7 @@ module Aibika
   # included. Ruby 1.8 provides Gem.loaded_specs to detect gems, but
   # this is empty with Ruby 1.9. So instead, we look for any loaded
   # file from a gem path.
-  def self.find_gem_files(features)
+  def self.find_gem_files(features, loaded_specs, load_path)
     features_from_gems = []
     gems = {}
 
@@ -252,9 +324,10 @@ module Aibika
       end
 
       ENV['BUNDLE_GEMFILE'] = Aibika.gemfile
-      Bundler.load.specs.each do |spec|
+      @bundler_specs = Bundler.load.specs.reject { |spec| fence_self?(spec.name) }
+      @bundler_specs.each do |spec|
         Aibika.verbose_msg "From Gemfile, adding gem #{spec.full_name}"
-        gems[spec.name] ||= spec unless fence_self?(spec.name)
+        gems[spec.name] ||= spec
       end
 
       unless gems.any? { |name, _spec| name == 'bundler' }
@@ -268,29 +341,30 @@ module Aibika
 
     if defined?(Gem)
       # Include Gems that are loaded
-      Gem.loaded_specs.each { |gemname, spec| gems[gemname] ||= spec unless fence_self?(gemname) }
+      loaded_specs.each { |gemname, spec| gems[gemname] ||= spec unless fence_self?(gemname) }
       # Fall back to gem detection (loaded_specs are not population on
-      # all Ruby versions)
+      # all Ruby versions). The directories of the gems and the gem
+      # paths are indexed, so each feature is classified in one pass.
+      gem_dirs = PathIndex.new
+      gems.each_value { |spec| gem_dirs.add(spec.gem_dir) }
+      geminstallpaths = PathIndex.new(Pathname(Gem.path).map { |gempath| [gempath / 'gems', gempath] })
       features.each do |feature|
         # Detect load path unless absolute
         unless feature.absolute?
-          feature = find_load_path(Pathname($LOAD_PATH), feature)
+          feature = find_load_path(Pathname(load_path), feature)
           next if feature.nil? # Could be enumerator.so
         end
         # Skip if found in known Gem dir
-        if gems.find { |_gem, spec| feature.subpath?(spec.gem_dir) }
+        if gem_dirs.include?(feature)
           features_from_gems << feature
           next
         end
-        gempaths = Pathname(Gem.path)
-        gempaths.each do |gempath|
-          geminstallpath = Pathname(gempath) / 'gems'
-          next unless feature.subpath?(geminstallpath)
-
+        geminstallpaths.lookup_all(feature).each do |geminstallpath, gempath|
           gemlocalpath = feature.relative_path_from(geminstallpath)
           fullgemname = gemlocalpath.path.split('/').first
           gemspecpath = gempath / 'specifications' / "#{fullgemname}.gemspec"
           if (spec = Gem::Specification.load(gemspecpath))
+            gem_dirs.add(spec.gem_dir) unless gems[spec.name]
             gems[spec.name] ||= spec
             features_from_gems << feature
           else
@@ -299,6 +373,12 @@ module Aibika
         end
       end
 
+      # Loaded features of each gem directory
+      gem_features = Hash.new { |hash, dir| hash[dir] = [] }
+      features_from_gems.each do |feature|
+        gem_dirs.lookup_all(feature).each { |dir, _| gem_features[Pathname(dir).to_posix.downcase] << feature }
+      end
+
       gem_files = []
 
       gems.each do |gemname, spec|
@@ -376,7 +456,7 @@ module Aibika
           when :spec
             files << Pathname(spec.files)
           when :loaded
-            files << features_from_gems.select { |feature| feature.subpath?(gem_root) }
+            files << gem_features[gem_root.to_posix.downcase]
           when :files
             gem_root_files ||= gem_root.find_all_files(//)
             files << gem_root_files.reject { |path| path.relative_path_from(gem_root) =~ GEM_NON_FILE_RE }
@@ -410,10 +490,93 @@ module Aibika
     [gem_files, features_from_gems]
   end
 
-  def self.build_exe
-    all_load_paths = $LOAD_PATH.map { |loadpath| Pathname(loadpath).expand }
-    @added_load_paths = ($LOAD_PATH - @load_path_before).map { |loadpath| Pathname(loadpath).expand }
-    working_directory = Pathname.pwd.expand
+  # Serializes the specifications of the packaged gems for
+  # AibikaRuntime::GemIndex, together with the gem set that Bundler
+  # resolved from the Gemfile. Each specification is paired with the
+  # location of its .gemspec relative to the index file. The fields are
+  # stored as plain values: loading a marshaled Gem::Specification
+  # requires Psych, which costs more than the index saves.
+  def self.build_gem_index(gemspec_targets, index_dir)
+    names = Gem::Specification.attribute_names.map { |name| :"@#{name}" } + %i[@original_platform @new_platform]
+    specs = gemspec_targets.map do |gemspec, target|
+      spec = Gem::Specification.load(gemspec.to_s)
+      next unless spec
+
+      fields = (names & spec.instance_variables).to_h { |name| [name, spec.instance_variable_get(name)] }
+      [target.relative_path_from(index_dir).to_posix, fields]
+    end.compact
+    activate = (@bundler_specs || []).map { |spec| [spec.name, spec.version.to_s] }
+    Marshal.dump({ specs: specs, activate: activate })
+  end
+
+  # What the key of the dependency run results in the build cache is
+  # made of. Covers everything that can change what the script loads:
+  # its source files, the Gemfile and Gemfile.lock, the Ruby
+  # installation and the options and environment it is run with. Taken
+  # before the build adds the detected files to Aibika.files.
+  def self.dependency_key_parts
+    parts = [VERSION, RUBY_DESCRIPTION, Dir.pwd, ENV['RUBYOPT'].to_s, ENV['RUBYLIB'].to_s,
+             Marshal.dump([@load_path_before, defined?(Gem) ? Gem.path : nil]),
+             Marshal.dump([Aibika.load_autoload, Aibika.autodll, Aibika.arg, Aibika.gemfile&.to_s])]
+    files = Aibika.files.dup
+    files.push(Aibika.gemfile, Pathname("#{Aibika.gemfile}.lock")) if Aibika.gemfile
+    parts + file_digests(files)
+  end
+
+  def self.file_digests(files)
+    files.flat_map { |file| [file.to_s, file.file? ? Digest::SHA256.file(file.to_s).hexdigest : ''] }
+  end
+
+  # Key of the dependency run results, with the digests of the sources
+  # that the script loaded from its source directory in the run.
+  def self.dependency_cache_key(cache, sources = [])
+    cache.key(*@dependency_parts, *file_digests(sources))
+  end
+
+  # Restores the results of an earlier dependency run of the same
+  # script from the build cache, unless a refresh was requested.
+  # Returns true if the script does not need to be run. Which sources
+  # the script loads is only known after the run, so the list of them
+  # from the last run is kept under the key without them ('deps-sources'),
+  # and the results under the key with their digests.
+  def self.load_cached_dependencies
+    return false unless Aibika.build_cache && Aibika.run_script
+
+    cache = BuildCache.new(Aibika.build_cache)
+    @dependency_parts = dependency_key_parts
+    @dependency_src_prefix, = find_src_root(Aibika.files)
+    @dependency_key = dependency_cache_key(cache)
+    return false if Aibika.refresh_dep_cache
+
+    sources = cache.fetch('deps-sources', @dependency_key)
+    return false unless sources
+
+    data = cache.fetch('deps', dependency_cache_key(cache, Marshal.load(sources).map { |path| Pathname(path) }))
+    @dependencies = data && Marshal.load(data)
+    !@dependencies.nil?
+  end
+
+  # Stores the results of the dependency run, and the sources that it
+  # loaded from under the directory of the files given on the command
+  # line, whose changes, like a new require, change what it loads.
+  def self.store_cached_dependencies(dependencies)
+    return unless @dependency_key
+
+    cache = BuildCache.new(Aibika.build_cache)
+    sources = dependencies[:features].map { |feature| Pathname(feature) }.select do |feature|
+      feature.absolute? && feature.subpath?(@dependency_src_prefix)
+    end
+    cache.store('deps-sources', @dependency_key, Marshal.dump(sources.map(&:to_s)))
+    cache.store('deps', dependency_cache_key(cache, sources), Marshal.dump(dependencies))
+  end
+
+  # Collects the load path, features and gems that the script loaded
+  # while it was run.
+  def self.detect_dependencies
+    load_path = $LOAD_PATH.dup
+    pwd = Dir.pwd
+    # The heap as the script left it, before the builder allocates more
+    gc = GcTuning.capture if Aibika.run_script
 
     restore_environment
 
@@ -426,20 +589,55 @@ module Aibika
     # Reject own aibika itself, store the currently loaded files (before we require rbconfig for
     # our own use).
     features = $LOADED_FEATURES.reject { |feature| fence_self_dir?(feature) }
-    features.map! { |feature| Pathname(feature) }
+
+    # Find gemspecs to include
+    loaded_specs = []
+    if defined?(Gem)
+      Gem.loaded_specs.each { |name, info| loaded_specs << [name, info.loaded_from] unless fence_self?(name) }
+    end
+
+    { load_path: load_path, pwd: pwd, features: features, feature_load_path: $LOAD_PATH.dup,
+      loaded_specs: loaded_specs, gc: gc }
+  end
+
+  # The RUBY_* variables that the executable sets with --gc-tuning: the
+  # heap size that the dependency run needed, and those given with
+  # --gc-env, which take precedence.
+  def self.gc_environment(stats)
+    return {} unless Aibika.gc_tuning
+
+    if !Aibika.run_script && Aibika.gc_env.empty?
+      Aibika.warn '--gc-tuning has no heap statistics without running the script (--no-dep-run)'
+    end
+    env = GcTuning.environment(stats).merge(Aibika.gc_env)
+    env.each { |name, value| Aibika.msg "Setting #{name}=#{value}" }
+    env
+  end
+
+  def self.build_exe
+    if @dependencies
+      Aibika.msg 'Using dependencies detected by a previous build (use --refresh-dep-cache to detect again)'
+      dependencies = @dependencies
+      restore_environment
+    else
+      dependencies = detect_dependencies
+    end
+
+    all_load_paths = dependencies[:load_path].map { |loadpath| Pathname(loadpath).expand }
+    @added_load_paths = (dependencies[:load_path] - @load_path_before).map { |loadpath| Pathname(loadpath).expand }
+    working_directory = Pathname(dependencies[:pwd]).expand
+
+    features = dependencies[:features].map { |feature| Pathname(feature) }
 
     # Since https://github.com/rubygems/rubygems/commit/cad4cf16cf8fcc637d9da643ef97cf0be2ed63cb
     # rubygems/core_ext/kernel_require.rb is evaled and thus missing in $LOADED_FEATURES,
     # so we can't find it and need to add it manually
     features.push(Pathname('rubygems/core_ext/kernel_require.rb'))
 
-    # Find gemspecs to include
-    if defined?(Gem)
-      loaded_specs = Gem.loaded_specs.reject { |name, _info| fence_self?(name) }
-      @gemspecs = loaded_specs.map { |_name, info| Pathname(info.loaded_from) }
-    else
-      @gemspecs = []
-    end
+    loaded_specs = dependencies[:loaded_specs].to_h do |name, loaded_from|
+      [name, @dependencies ? Gem::Specification.load(loaded_from) : Gem.loaded_specs[name]]
+    end.compact
+    @gemspecs = loaded_specs.map { |_name, info| Pathname(info.loaded_from) }
 
     require 'rbconfig'
     instsitelibdir = Host.sitelibdir.relative_path_from(Host.exec_prefix)
@@ -448,7 +646,7 @@ module Aibika
     src_load_path = []
 
     # Find gems files and remove them from features
-    gem_files, features_from_gems = find_gem_files(features)
+    gem_files, features_from_gems = find_gem_files(features, loaded_specs, dependencies[:feature_load_path])
     features -= features_from_gems
 
     # Find the source root and adjust paths
@@ -471,26 +669,34 @@ module Aibika
     end
 
     # Find features and decide where to put them in the temporary
-    # directory layout.
+    # directory layout, by the roots that contain them: the Ruby
+    # installation, the gem paths (the first one in Gem.path) and the
+    # source root.
+    load_paths = load_path_index(all_load_paths)
+    roots = PathIndex.new(Host.exec_prefix => :exec_prefix)
+    Gem.path.each_with_index { |gempath, index| roots.add(gempath, index) } if defined?(Gem)
+    roots.add(src_prefix, :src_prefix)
     libs = []
     features.each do |feature|
-      path = find_load_path(all_load_paths, feature)
+      path = find_load_path(all_load_paths, feature, load_paths)
       if path.nil? || path.expand == Pathname.pwd
         Aibika.files << feature
       else
         feature = feature.relative_path_from(path.expand) if feature.absolute?
         fullpath = feature.expand(path)
+        containing = roots.lookup_all(fullpath).map(&:last)
+        gemhome = containing.grep(Integer).min&.then { |index| Gem.path[index] }
 
-        if fullpath.subpath?(Host.exec_prefix)
+        if containing.include?(:exec_prefix)
           # Features found in the Ruby installation are put in the
           # temporary Ruby installation.
           libs << [fullpath, fullpath.relative_path_from(Host.exec_prefix)]
-        elsif defined?(Gem) && ((gemhome = Gem.path.find { |pth| fullpath.subpath?(pth) }))
+        elsif gemhome
           # Features found in any other Gem path (e.g. ~/.gems) is put
           # in a special 'gemhome' folder.
           targetpath = GEMHOMEDIR / fullpath.relative_path_from(Pathname(gemhome))
           libs << [fullpath, targetpath]
-        elsif fullpath.subpath?(src_prefix) || path == working_directory
+        elsif containing.include?(:src_prefix) || path == working_directory
           # Any feature found inside the src_prefix automatically gets
           # added as a source file (to go in 'src').
           Aibika.files << fullpath
@@ -523,12 +729,13 @@ module Aibika
 
     # Decide where to put gem files, either the system gem folder, or
     # GEMHOME.
+    gem_libs = []
     gem_files.each do |gemfile|
       if gemfile.subpath?(Host.exec_prefix)
-        libs << [gemfile, gemfile.relative_path_from(Host.exec_prefix)]
+        gem_libs << [gemfile, gemfile.relative_path_from(Host.exec_prefix)]
       elsif defined?(Gem) && ((gemhome = Gem.path.find { |pth| gemfile.subpath?(pth) }))
         targetpath = GEMHOMEDIR / gemfile.relative_path_from(Pathname(gemhome))
-        libs << [gemfile, targetpath]
+        gem_libs << [gemfile, targetpath]
       else
         Aibika.msg "Processing #{gemfile}"
         Aibika.msg "Host.exec_prefix #{Host.exec_prefix}"
@@ -557,7 +764,9 @@ module Aibika
     end
 
     # Detect additional DLLs
-    dlls = Aibika.autodll ? LibraryDetector.detect_dlls : []
+    dependencies[:dlls] ||= Aibika.autodll ? LibraryDetector.detect_dlls.map(&:to_s) : []
+    dlls = dependencies[:dlls].map { |dll| Pathname(dll) }
+    store_cached_dependencies(dependencies) unless @dependencies
 
     # Detect external manifests
     manifests = Host.exec_prefix.find_all_files(/\.manifest$/)
@@ -566,110 +775,239 @@ module Aibika
     if Aibika.output_override
       executable = Aibika.output_override
     else
-      executable = Aibika.files.first.basename.ext('.exe')
+      executable = Aibika.files.first.basename.ext(Host.exeext)
       executable.append_to_filename!('-debug') if Aibika.debug
     end
+    # Without an extension, the executable can have the name of a directory
+    Aibika.fatal_error "#{executable} is a directory. Name the executable with --output." if executable.directory?
 
-    windowed = (Aibika.files.first.ext?('.rbw') || Aibika.force_windows) && !Aibika.force_console
+    windowed = (Aibika.files.first.ext?('.rbw') || Aibika.force_windows) && !Aibika.force_console && Host.windows?
 
     Aibika.msg "Building #{executable}"
     target_script = nil
-    AibikaBuilder.new(executable, windowed) do |sb|
-      # Add explicitly mentioned files
-      Aibika.msg 'Adding user-supplied source files'
-      Aibika.files.each do |file|
-        file = src_prefix / file
-        target = if file.subpath?(Host.exec_prefix)
-                   file.relative_path_from(Host.exec_prefix)
-                 elsif file.subpath?(src_prefix)
-                   SRCDIR / file.relative_path_from(src_prefix)
-                 else
-                   SRCDIR / file.basename
-                 end
-
-        target_script ||= target
-
-        if file.directory?
-          sb.ensuremkdir(target)
-        else
-          begin
-            sb.createfile(file, target)
-          rescue Errno::ENOENT
-            raise unless file =~ IGNORE_MODULE_NAMES
-          end
-        end
-      end
-
-      # Add the ruby executable and DLL
+    entry_targets = {}
+    builder = AibikaBuilder.new(executable, windowed) do |sb|
+      # The Ruby runtime, the gems and the application go into separate
+      # sections, so that their compressed blocks can be reused from the
+      # build cache when only one of them changes.
       rubyexe = if windowed
                   Host.rubyw_exe
                 else
                   Host.ruby_exe
                 end
-      Aibika.msg "Adding ruby executable #{rubyexe}"
-      sb.createfile(Host.bindir / rubyexe, BINDIR / rubyexe)
-      sb.createfile(Host.bindir / Host.libruby_so, BINDIR / Host.libruby_so) if Host.libruby_so
-
-      # Add detected DLLs
-      dlls.each do |dll|
-        Aibika.msg "Adding detected DLL #{dll}"
-        target = if dll.subpath?(Host.exec_prefix)
-                   dll.relative_path_from(Host.exec_prefix)
-                 else
-                   BINDIR / File.basename(dll)
-                 end
-        sb.createfile(dll, target)
+
+      # Ruby files are packed into one archive, except for those that
+      # Ruby loads before the loader and the scripts that the stub runs
+      if Aibika.pack_sources
+        scripts = [(src_prefix / Aibika.files.first).expand, *Aibika.entries.map(&:last)]
+        scripts << (Pathname(__dir__) / "#{PACKED_SOURCES_FEATURE}.rb").expand
+        sb.pack_sources(boot_features + scripts.map(&:to_posix))
+      end
+
+      sb.section(:runtime, shared: true) do
+        # Add the ruby executable and DLL
+        Aibika.msg "Adding ruby executable #{rubyexe}"
+        sb.createfile(Host.bindir / rubyexe, BINDIR / rubyexe)
+        if Host.libruby_so
+          sb.createfile(Host.libruby_dir / Host.libruby_so,
+                        Host.libruby_dir.relative_path_from(Host.exec_prefix) / Host.libruby_so)
+        end
+
+        # Add detected DLLs
+        dlls.each do |dll|
+          Aibika.msg "Adding detected DLL #{dll}"
+          target = if dll.subpath?(Host.exec_prefix)
+                     dll.relative_path_from(Host.exec_prefix)
+                   else
+                     BINDIR / File.basename(dll)
+                   end
+          sb.createfile(dll, target)
+        end
+
+        # Add external manifest files
+        manifests.each do |manifest|
+          Aibika.msg "Adding external manifest #{manifest}"
+          target = manifest.relative_path_from(Host.exec_prefix)
+          sb.createfile(manifest, target)
+        end
+
+        # Add extra DLLs specified on the command line
+        Aibika.extra_dlls.each do |dll|
+          Aibika.msg "Adding supplied DLL #{dll}"
+          sb.createfile(Host.bindir / dll, BINDIR / dll)
+        end
+
+        # Add loaded libraries (features)
+        Aibika.msg 'Adding library files'
+        libs.each do |path, target|
+          sb.createfile(path, target)
+        end
+      end
+
+      # The loader precedes the other features, which may require
+      # packed files
+      ruby_options = Aibika.pack_sources ? " -r#{PACKED_SOURCES_FEATURE}" : ''
+      sb.section(:gems, shared: true) do
+        # Add gemspec files
+        @gemspecs = sort_uniq(@gemspecs)
+        gemspec_targets = []
+        @gemspecs.each do |gemspec|
+          if gemspec.subpath?(Host.exec_prefix)
+            path = gemspec.relative_path_from(Host.exec_prefix)
+            sb.createfile(gemspec, path)
+          elsif defined?(Gem) && ((gemhome = Pathname(Gem.path.find { |pth| gemspec.subpath?(pth) })))
+            path = GEMHOMEDIR / gemspec.relative_path_from(gemhome)
+            sb.createfile(gemspec, path)
+          else
+            Aibika.fatal_error "Gem spec #{gemspec} does not exist in the Ruby installation. " \
+                               "Don't know where to put it."
+          end
+          gemspec_targets << [gemspec, path]
+        end
+
+        # Add the prebuilt specification index, so that the packaged
+        # RubyGems does not evaluate each gemspec on startup
+        if Aibika.gem_index && !Aibika.inno_script && !gemspec_targets.empty?
+          Aibika.msg "Adding specification index for #{gemspec_targets.size} gems"
+          gem_index_script = instsitelibdir / "#{GEM_INDEX_FEATURE}.rb"
+          sb.createfile(Pathname(__dir__) / "#{GEM_INDEX_FEATURE}.rb", gem_index_script)
+          sb.createdata(build_gem_index(gemspec_targets, gem_index_script.dirname),
+                        gem_index_script.dirname / 'gem_index.dat')
+          ruby_options += " -r#{GEM_INDEX_FEATURE}"
+        end
+
+        # Add gem files
+        Aibika.msg 'Adding gem files'
+        gem_libs.each do |path, target|
+          sb.createfile(path, target)
+        end
+
+        # Add the resident server with the list of the features that it
+        # loads before it serves the first request, in the order the
+        # script loaded them
+        if Aibika.resident
+          targets = (libs + gem_libs).to_h { |path, target| [Pathname(path).to_posix, target] }
+          preload = dependencies[:features].map { |feature| targets[feature] }.compact
+          preload.reject! { |target| target.to_posix =~ %r{/enc/} }
+          Aibika.msg "Adding resident server preloading #{preload.size} features"
+          resident_script = instsitelibdir / "#{RESIDENT_FEATURE}.rb"
+          sb.createfile(Pathname(__dir__) / "#{RESIDENT_FEATURE}.rb", resident_script)
+          sb.createdata(Marshal.dump(preload.map(&:to_posix)), resident_script.dirname / 'resident.dat')
+          ruby_options += " -r#{RESIDENT_FEATURE}"
+        end
       end
 
-      # Add external manifest files
-      manifests.each do |manifest|
-        Aibika.msg "Adding external manifest #{manifest}"
-        target = manifest.relative_path_from(Host.exec_prefix)
-        sb.createfile(manifest, target)
+      sb.section(:app) do
+        # Add explicitly mentioned files
+        Aibika.msg 'Adding user-supplied source files'
+        Aibika.files.each do |file|
+          file = src_prefix / file
+          target = if file.subpath?(Host.exec_prefix)
+                     file.relative_path_from(Host.exec_prefix)
+                   elsif file.subpath?(src_prefix)
+                     SRCDIR / file.relative_path_from(src_prefix)
+                   else
+                     SRCDIR / file.basename
+                   end
+
+          target_script ||= target
+          entry_targets[file.to_posix.downcase] = target
+
+          if file.directory?
+            sb.ensuremkdir(target)
+          else
+            begin
+              sb.createfile(file, target)
+            rescue Errno::ENOENT
+              raise unless file =~ IGNORE_MODULE_NAMES
+            end
+          end
+        end
       end
 
-      # Add extra DLLs specified on the command line
-      Aibika.extra_dlls.each do |dll|
-        Aibika.msg "Adding supplied DLL #{dll}"
-        sb.createfile(Host.bindir / dll, BINDIR / dll)
+      # Available to the application, which may report the metrics
+      startup_metrics_script = instsitelibdir / "#{STARTUP_METRICS_FEATURE}.rb"
+      sb.createfile(Pathname(__dir__) / "#{STARTUP_METRICS_FEATURE}.rb", startup_metrics_script)
+
+      if Aibika.pack_sources
+        loader = instsitelibdir / "#{PACKED_SOURCES_FEATURE}.rb"
+        sb.createfile(Pathname(__dir__) / "#{PACKED_SOURCES_FEATURE}.rb", loader)
+        sb.write_source_archive(loader.dirname / 'sources.pak')
       end
 
-      # Add gemspec files
-      @gemspecs = sort_uniq(@gemspecs)
-      @gemspecs.each do |gemspec|
-        if gemspec.subpath?(Host.exec_prefix)
-          path = gemspec.relative_path_from(Host.exec_prefix)
-          sb.createfile(gemspec, path)
-        elsif defined?(Gem) && ((gemhome = Pathname(Gem.path.find { |pth| gemspec.subpath?(pth) })))
-          path = GEMHOMEDIR / gemspec.relative_path_from(gemhome)
-          sb.createfile(gemspec, path)
-        else
-          Aibika.fatal_error "Gem spec #{gemspec} does not exist in the Ruby installation. Don't know where to put it."
+      # A Ruby that is not relocatable looks for its libraries where
+      # it was installed, so it is pointed to the extracted ones
+      gem_path = [TEMPDIR_ROOT / GEMHOMEDIR]
+      unless Host.load_relative?
+        @load_path_before.map { |path| Pathname(path).expand }.each do |path|
+          load_path << (TEMPDIR_ROOT / path.relative_path_from(Host.exec_prefix)) if path.subpath?(Host.exec_prefix)
+        end
+        if defined?(Gem) && Pathname(Gem.default_dir).subpath?(Host.exec_prefix)
+          gem_path << (TEMPDIR_ROOT / Pathname(Gem.default_dir).relative_path_from(Host.exec_prefix))
         end
       end
 
-      # Add loaded libraries (features, gems)
-      Aibika.msg 'Adding library files'
-      libs.each do |path, target|
-        sb.createfile(path, target)
+      # The files that Ruby reads when it starts, in the order the script
+      # loaded them
+      if Aibika.extract_cache && Aibika.prefetch
+        startup = [Host.bindir / rubyexe, Host.libruby_so && (Host.libruby_dir / Host.libruby_so), *dlls,
+                   *dependencies[:features], *(@gemspecs unless Aibika.gem_index), src_prefix / Aibika.files.first]
+        sb.prefetch(startup.compact)
       end
 
       # Set environment variable
-      sb.setenv('RUBYOPT', ENV['RUBYOPT'] || '')
-      sb.setenv('RUBYLIB', load_path.map(&:to_native).uniq.join(';'))
+      # Rubies started by the script load the packed files too
+      rubyopt = ENV['RUBYOPT'] || ''
+      rubyopt = "#{rubyopt} -r#{PACKED_SOURCES_FEATURE}".strip if Aibika.pack_sources
+      sb.setenv('RUBYOPT', rubyopt)
+      sb.setenv('RUBYLIB', load_path.map(&:to_native).uniq.join(File::PATH_SEPARATOR))
+
+      sb.setenv('GEM_PATH', gem_path.map(&:to_native).join(File::PATH_SEPARATOR))
+      gc_environment(dependencies[:gc]).each { |name, value| sb.setenv(name, value) }
+      if Host.libruby_so && !Host.windows?
+        sb.setenv('LD_LIBRARY_PATH', (TEMPDIR_ROOT / Host.libruby_dir.relative_path_from(Host.exec_prefix)).to_native)
+      end
 
-      sb.setenv('GEM_PATH', (TEMPDIR_ROOT / GEMHOMEDIR).to_native)
+      # The interposer is extracted like the native extensions, and
+      # serves the other files to Ruby and the programs it runs
+      if Aibika.vfs
+        sb.createfile(Aibika.vfspath, VFS_LIBRARY)
+        sb.setenv('LD_PRELOAD', (TEMPDIR_ROOT / VFS_LIBRARY).to_native)
+      end
 
       # Add the opcode to launch the script
       extra_arg = Aibika.arg.map { |arg| " \"#{arg.gsub('"', '\"')}\"" }.join
       installed_ruby_exe = TEMPDIR_ROOT / BINDIR / rubyexe
       launch_script = (TEMPDIR_ROOT / target_script).to_native
+      Aibika.entries.each do |name, script|
+        entry_script = (TEMPDIR_ROOT / entry_targets.fetch(script.to_posix.downcase)).to_native
+        sb.entrypoint(name, installed_ruby_exe, "#{rubyexe}#{ruby_options} \"#{entry_script}\"")
+      end
       sb.postcreateprocess(installed_ruby_exe,
-                           "#{rubyexe} \"#{launch_script}\"#{extra_arg}")
+                           "#{rubyexe}#{ruby_options} \"#{launch_script}\"#{extra_arg}")
     end
 
     return if Aibika.inno_script
 
+    File.chmod(0o755, executable.to_s) unless Host.windows?
     Aibika.msg "Finished building #{executable} (#{File.size(executable)} bytes)"
+    if builder.analysis
+      roots = all_load_paths + [src_prefix, Host.exec_prefix]
+      reports = builder.analysis.write(executable, gems: loaded_specs.values, load_paths: roots, dlls: dlls)
+      Aibika.msg "Wrote payload analysis to #{reports.join(' and ')}"
+    end
+    # The payload file changes, not the executable (see --payload-file)
+    old = Aibika.delta_from
+    if Aibika.payload_file
+      executable = AibikaBuilder.payload_file_path(executable)
+      old = AibikaBuilder.payload_file_path(old) if old
+      Aibika.msg "Payload in #{executable} (#{File.size(executable)} bytes)"
+    end
+    return unless old
+
+    delta = Pathname("#{executable}.delta")
+    changed = Delta.generate(old, executable, delta)
+    Aibika.msg "Wrote delta from #{old} to #{delta} " \
+               "(#{changed} bytes changed, #{File.size(delta)} bytes)"
   end
 end
@@ -1,5 +1,7 @@
 # frozen_string_literal: true
 
+require 'digest/sha2'
+
 module Aibika
   # Utility class that produces the actual executable. Opcodes
   # (createfile, mkdir etc) are added by invoking methods on an
@@ -15,10 +17,52 @@ module Aibika
     OP_POST_CREATE_PROCESS = 6
     OP_ENABLE_DEBUG_MODE = 7
     OP_CREATE_INST_DIRECTORY = 8
+    OP_CREATE_FILE_BCJ = 9
+    OP_USE_SHARED_STORE = 10
+    OP_LINK_SHARED_FILES = 11
+    OP_CREATE_SHARED_FILE = 12
+    OP_ENTRY_POINT = 13
+    OP_RESIDENT = 14
+    OP_VFS_IMAGE = 15
+    OP_EXTRACT_CACHE = 16
+    OP_PAYLOAD_FILE = 17
+    OP_PADDING = 18
+    OP_LZMA_DICTIONARY = 19
+    OP_DECOMPRESS_LZMA_PRIMED = 20
+    OP_CREATE_FILE_CHUNKS = 21
+    OP_PREFETCH = 22
+
+    # Scopes of the shared store (see --shared-store), in the order of
+    # their numbers in OP_USE_SHARED_STORE
+    SHARED_STORE_SCOPES = %w[user machine].freeze
+    # Flags of OP_CREATE_SHARED_FILE
+    SHARED_FILE_BCJ = 1
+    # Pieces of OP_CREATE_FILE_CHUNKS: content that follows, or a copy
+    # from a file extracted before
+    CHUNK_DATA = 0
+    CHUNK_COPY = 1
+    # Placeholder for the digest in OP_RESIDENT and OP_EXTRACT_CACHE,
+    # replaced once the executable is complete
+    DIGEST_PLACEHOLDER = '0' * 64
+
+    # Path of the payload file of an executable: <name>.pak next to it
+    def self.payload_file_path(path)
+      path = Aibika.Pathname(path)
+      path.dirname / path.basename.ext('.pak')
+    end
+
+    # Breakdown of the files added (see --analyze)
+    attr_reader :analysis
 
     def initialize(path, windowed)
       @paths = {}
       @files = {}
+      # Targets of the files that the stub extracts, by their source,
+      # and of those generated, for prefetch
+      @extracted = {}
+      @generated = []
+      @analysis = Analysis.new if Aibika.analyze && !Aibika.inno_script
+      @chunks = ChunkIndex.new if Aibika.dedup && !Aibika.inno_script
       File.open(path, 'wb') do |aibikafile|
         image = if windowed
                   Aibika.stubwimage
@@ -32,48 +76,68 @@ module Aibika
 
       system Aibika.ediconpath, path, Aibika.icon_filename if Aibika.icon_filename
 
+      path = write_payload_file_reference(path) if Aibika.payload_file && !Aibika.inno_script
+
       opcode_offset = File.size(path)
+      digest_offsets = []
 
       File.open(path, 'ab') do |aibikafile|
-        tmpinpath = 'tmpin'
-
-        @of = if Aibika.lzma_mode
-                File.open(tmpinpath, 'wb')
-              else
-                aibikafile
-              end
+        @of = aibikafile
 
         if Aibika.debug
           Aibika.msg('Enabling debug mode in executable')
           aibikafile.write([OP_ENABLE_DEBUG_MODE].pack('V'))
         end
 
-        createinstdir Aibika.debug_extract, !Aibika.debug_extract, Aibika.chdir_first
+        if Aibika.resident
+          Aibika.msg "Enabling resident mode (idle timeout #{Aibika.resident} seconds)"
+          aibikafile.flush
+          digest_offsets << (File.size(path) + 4)
+          aibikafile.write([OP_RESIDENT, DIGEST_PLACEHOLDER, Aibika.resident].pack('VZ*V'))
+        end
 
-        yield(self)
+        if Aibika.extract_cache && !Aibika.inno_script
+          Aibika.msg 'Extracting to a persistent installation directory'
+          aibikafile.flush
+          digest_offsets << (File.size(path) + 4)
+          aibikafile.write([OP_EXTRACT_CACHE, DIGEST_PLACEHOLDER].pack('VZ*'))
+        end
+
+        createinstdir Aibika.debug_extract, !Aibika.debug_extract, Aibika.chdir_first
 
-        @of.close if Aibika.lzma_mode
+        if Aibika.shared_store && !Aibika.inno_script
+          Aibika.msg "Using the #{Aibika.shared_store} shared store for runtime files"
+          aibikafile.write([OP_USE_SHARED_STORE, SHARED_STORE_SCOPES.index(Aibika.shared_store)].pack('VV'))
+        end
 
         if Aibika.lzma_mode && !Aibika.inno_script
-          tmpoutpath = 'tmpout'
-          begin
-            data_size = File.size(tmpinpath)
-            Aibika.msg "Compressing #{data_size} bytes"
-            system(Aibika.lzmapath, 'e', tmpinpath, tmpoutpath) or raise
-            compressed_data_size = File.size?(tmpoutpath)
-            aibikafile.write([OP_DECOMPRESS_LZMA, compressed_data_size].pack('VV'))
-            IO.copy_stream(tmpoutpath, aibikafile)
-          ensure
-            File.unlink(@of.path) if File.exist?(@of.path)
-            File.unlink(tmpoutpath) if File.exist?(tmpoutpath)
-          end
+          cache = BuildCache.new(Aibika.build_cache) if Aibika.build_cache
+          @of = LzmaCompressor.new(aibikafile, threads: Aibika.lzma_threads, cache: cache,
+                                               profile: Aibika.compression_profile,
+                                               target: Aibika.compression_target,
+                                               dictionary: Aibika.shared_dictionary)
+        end
+
+        if Aibika.vfs
+          @vfs = VfsImage.new(lzma: Aibika.lzma_mode, profile: Aibika.compression_profile,
+                              target: Aibika.compression_target)
         end
 
+        yield(self)
+
+        write_vfs_image if @vfs
+
+        @of.close if @of != aibikafile
+        Aibika.msg "Deduplicated #{@chunks.shared_size} bytes of files" if @chunks
+        @analysis&.finish(@of.is_a?(LzmaCompressor) ? @of : nil)
+
         aibikafile.write([OP_END].pack('V'))
         aibikafile.write([opcode_offset].pack('V')) # Pointer to start of opcodes
         aibikafile.write(Signature.pack('C*'))
       end
 
+      write_digest(path, digest_offsets) unless digest_offsets.empty?
+
       return unless Aibika.inno_script
 
       begin
@@ -124,6 +188,77 @@ module Aibika
       end
     end
 
+    # Makes the executable process the payload from a file next to it
+    # (see --payload-file), and returns the path of that file, to which
+    # the opcodes are written instead. The opcodes start the file, so
+    # they are page aligned when the stub maps it.
+    def write_payload_file_reference(path)
+      payload = AibikaBuilder.payload_file_path(path)
+      opcode_offset = File.size(path)
+      File.open(path, 'ab') do |aibikafile|
+        aibikafile.write([OP_PAYLOAD_FILE, payload.basename.to_native, OP_END, opcode_offset].pack('VZ*VV'))
+        aibikafile.write(Signature.pack('C*'))
+      end
+      File.binwrite(payload, '')
+      payload
+    end
+
+    # Identifies the executable to the resident server (see
+    # OP_RESIDENT) and names its persistent installation directory (see
+    # OP_EXTRACT_CACHE), so that a rebuilt executable starts a new
+    # server and extracts anew. The digest covers the whole file with
+    # the placeholders in place.
+    def write_digest(path, offsets)
+      digest = Digest::SHA256.file(path.to_s).hexdigest
+      File.open(path, 'r+b') do |file|
+        offsets.each do |offset|
+          file.seek(offset)
+          file.write(digest)
+        end
+      end
+    end
+
+    # Writes an opcode that the stub reads before launching the
+    # program. In resident mode and with a persistent installation
+    # directory, these are stored outside the LZMA blocks, so that a
+    # stub handing over to the resident server, or finding the files
+    # extracted, skips every block.
+    def launch_opcode(data)
+      if (Aibika.resident || Aibika.extract_cache) && @of.is_a?(LzmaCompressor)
+        @of.write_uncompressed(data)
+      else
+        @of << data
+      end
+    end
+
+    # Writes the image of the files that are not extracted (see
+    # --vfs). It is stored outside the LZMA blocks, as the interposer
+    # reads it from the executable.
+    def write_vfs_image
+      image = @vfs.to_s
+      data = [OP_VFS_IMAGE, image.bytesize].pack('VV') + image
+      if @of.is_a?(LzmaCompressor)
+        @of.write_uncompressed(data)
+      else
+        @of << data
+      end
+    end
+
+    # Packs the Ruby files added from now on into one archive (see
+    # --pack-sources), except for the source files in keep.
+    def pack_sources(keep)
+      @sources = SourceArchive.new(keep)
+    end
+
+    # Adds the archive of the files packed since pack_sources
+    def write_source_archive(tgt)
+      sources = @sources
+      @sources = nil
+      Aibika.msg "Packed #{sources.size} Ruby files into #{tgt.basename}"
+      @analysis&.pack_target = tgt.to_posix
+      createdata(sources.to_s(tgt.dirname), tgt)
+    end
+
     def mkdir(path)
       return if @paths[path.path.downcase]
 
@@ -131,7 +266,11 @@ module Aibika
       Aibika.verbose_msg "m #{showtempdir path}"
       return if Aibika.inno_script # The directory will be created by InnoSetup with a [Dirs] statement
 
-      @of << [OP_CREATE_DIRECTORY, path.to_native].pack('VZ*')
+      if @shared && @of.is_a?(LzmaCompressor)
+        @of.store([OP_CREATE_DIRECTORY, path.to_native].pack('VZ*'))
+      else
+        @of << [OP_CREATE_DIRECTORY, path.to_native].pack('VZ*')
+      end
     end
 
     def ensuremkdir(tgt)
@@ -144,6 +283,21 @@ module Aibika
       mkdir(tgt)
     end
 
+    # Groups the opcodes added by the block into blocks of their own,
+    # which are compressed independently of the opcodes around them.
+    # Files of a shared section are extracted through the shared store
+    # when one is used. The stub skips a block whose files are all in
+    # the store, so nothing else goes into it: the directories of the
+    # section follow the block uncompressed.
+    def section(name, shared: false)
+      Aibika.verbose_msg "s #{name}"
+      @of.flush
+      @shared = shared && Aibika.shared_store && !Aibika.inno_script
+      yield
+      @shared = false
+      @of.flush
+    end
+
     def createinstdir(next_to_exe = false, delete_after = false, chdir_before = false)
       return if Aibika.inno_script # Creation of installation directory will be handled by InnoSetup
 
@@ -161,23 +315,140 @@ module Aibika
       Aibika.verbose_msg "a #{showtempdir tgt}"
       return if Aibika.inno_script # InnoSetup will install the file with a [Files] statement
 
-      @of << [OP_CREATE_FILE, tgt.to_native, str.size].pack('VZ*V')
-      @of << str
+      packed = @sources&.pack?(src, tgt)
+      virtual = !packed && @vfs && !VfsImage.materialize?(str)
+      @extracted[src.expand.to_posix] ||= tgt unless packed || virtual
+
+      # Executables are only filtered when compressed, as the stub
+      # reverses the filter in the decompressed data
+      if packed
+        analyze(tgt, src, str, :packed)
+        @sources.add(tgt, str)
+      elsif virtual
+        analyze(tgt, src, str, :vfs)
+        @vfs.add(tgt, str)
+      elsif @shared
+        analyze(tgt, src, str)
+        createsharedfile(str, tgt)
+      elsif Aibika.store_incompressible && @of.is_a?(LzmaCompressor) && LzmaCompressor.incompressible?(str)
+        Aibika.verbose_msg "Storing #{showtempdir tgt} uncompressed"
+        analyze(tgt, src, str, :stored)
+        @of.store([OP_CREATE_FILE, tgt.to_native, str.size].pack('VZ*V'), str)
+      elsif @chunks && (pieces = @chunks.add(tgt, str))
+        createchunkedfile(src, tgt, str, pieces)
+      elsif Aibika.bcj && @of.is_a?(LzmaCompressor) && BcjFilter.x86_executable?(str)
+        analyze(tgt, src, str)
+        @of.write_file([OP_CREATE_FILE_BCJ, tgt.to_native, str.size].pack('VZ*V'), BcjFilter.encode(str))
+      elsif @of.is_a?(LzmaCompressor)
+        analyze(tgt, src, str)
+        @of.write_file([OP_CREATE_FILE, tgt.to_native, str.size].pack('VZ*V'), str)
+      else
+        analyze(tgt, src, str)
+        @of.write([OP_CREATE_FILE, tgt.to_native, str.size].pack('VZ*V'), str)
+      end
+    end
+
+    # Records a file for the analysis, before it is written. Files
+    # written to the opcode stream go into the current LZMA block, with
+    # stored_size bytes of their content.
+    def analyze(tgt, src, data, storage = nil, stored_size = data.bytesize)
+      return unless @analysis
+
+      if storage
+        @analysis.add(tgt, src, data, storage)
+      elsif @of.is_a?(LzmaCompressor)
+        @analysis.add(tgt, src, data, :lzma, @of.block_index, stored_size)
+      else
+        @analysis.add(tgt, src, data, :uncompressed, nil, stored_size)
+      end
+    end
+
+    # Adds a file as the pieces found by ChunkIndex#add: its own content,
+    # and copies of content of files that the stub extracted before.
+    def createchunkedfile(src, tgt, str, pieces)
+      Aibika.verbose_msg "Deduplicated #{showtempdir tgt}"
+      list = pieces.map do |kind, *piece|
+        if kind == :copy
+          source, offset, size = piece
+          [CHUNK_COPY, source.to_native, offset, size].pack('VZ*VV')
+        else
+          offset, size = piece
+          [CHUNK_DATA, size].pack('VV') + str.byteslice(offset, size)
+        end
+      end.join
+      analyze(tgt, src, str, nil, pieces.sum { |kind, *piece| kind == :data ? piece.last : 0 })
+      @of.write([OP_CREATE_FILE_CHUNKS, tgt.to_native, str.bytesize, list.bytesize].pack('VZ*VV'), list)
+    end
+
+    # Adds a file that the stub places in the shared store, named by
+    # the digest of its content, and links into the installation
+    # directory. Blocks of such files are skipped by the stub when all
+    # of their files are in the store already.
+    def createsharedfile(str, tgt)
+      digest = Digest::SHA256.hexdigest(str)
+      flags = 0
+      if Aibika.bcj && @of.is_a?(LzmaCompressor) && BcjFilter.x86_executable?(str)
+        flags |= SHARED_FILE_BCJ
+        data = BcjFilter.encode(str)
+      end
+      @of.link_shared(tgt.to_native, digest) if @of.is_a?(LzmaCompressor)
+      @of.write([OP_CREATE_SHARED_FILE, tgt.to_native, digest, flags, str.size].pack('VZ*Z*VV'), data || str)
+    end
+
+    # Adds a file with generated content (not read from the host).
+    def createdata(data, tgt)
+      tgt = Aibika.Pathname(tgt)
+      ensuremkdir(tgt.dirname)
+      Aibika.verbose_msg "a #{showtempdir tgt}"
+      if @vfs
+        analyze(tgt, nil, data, :vfs)
+        @vfs.add(tgt, data)
+      else
+        @generated << tgt
+        analyze(tgt, nil, data)
+        if @shared
+          createsharedfile(data, tgt)
+        else
+          @of.write([OP_CREATE_FILE, tgt.to_native, data.bytesize].pack('VZ*V'), data)
+        end
+      end
+    end
+
+    # Lists the files that the program reads when it starts, for the
+    # stub to read ahead when they were extracted by an earlier run (see
+    # --extract-cache): the extracted ones of sources, in their order,
+    # and the generated ones.
+    def prefetch(sources)
+      targets = sources.filter_map { |src| @extracted[Aibika.Pathname(src).expand.to_posix] } + @generated
+      targets.uniq!
+      return if targets.empty?
+
+      Aibika.msg "Prefetching #{targets.size} files at startup"
+      list = targets.map { |tgt| "#{tgt.to_native}\0" }.join
+      launch_opcode([OP_PREFETCH, list.bytesize].pack('VV') + list)
     end
 
     def createprocess(image, cmdline)
       Aibika.verbose_msg "l #{showtempdir image} #{showtempdir cmdline}"
-      @of << [OP_CREATE_PROCESS, image.to_native, cmdline].pack('VZ*Z*')
+      launch_opcode([OP_CREATE_PROCESS, image.to_native, cmdline].pack('VZ*Z*'))
+    end
+
+    # Adds a script that the stub runs instead of the one given to
+    # postcreateprocess when invoked by the entry point's name. Must
+    # precede postcreateprocess.
+    def entrypoint(name, image, cmdline)
+      Aibika.verbose_msg "e #{name} #{showtempdir image} #{showtempdir cmdline}"
+      launch_opcode([OP_ENTRY_POINT, name, image.to_native, cmdline].pack('VZ*Z*Z*'))
     end
 
     def postcreateprocess(image, cmdline)
       Aibika.verbose_msg "p #{showtempdir image} #{showtempdir cmdline}"
-      @of << [OP_POST_CREATE_PROCESS, image.to_native, cmdline].pack('VZ*Z*')
+      launch_opcode([OP_POST_CREATE_PROCESS, image.to_native, cmdline].pack('VZ*Z*'))
     end
 
     def setenv(name, value)
       Aibika.verbose_msg "e #{name} #{showtempdir value}"
-      @of << [OP_SETENV, name, value].pack('VZ*Z*')
+      launch_opcode([OP_SETENV, name, value].pack('VZ*Z*'))
     end
 
     def close
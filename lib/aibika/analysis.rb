@@ -0,0 +1,192 @@
+# frozen_string_literal: true
+
+require 'digest/sha2'
+require 'json'
+
+module Aibika
+  # Breakdown of the payload of an executable (see --analyze). The
+  # builder records each file as it is added, with the way it is
+  # stored; once the executable is complete, the compressed size of
+  # each file is estimated from the LZMA block it went into, in
+  # proportion to its share of the block.
+  #
+  # The report groups the files by gem, by load path root and by file
+  # type, lists duplicate content, the encoding support files and the
+  # detected DLLs, and estimates the time the stub needs to extract the
+  # files. It is written as JSON and as text next to the executable.
+  class Analysis
+    # Estimated time to create one file when extracting (seconds),
+    # including the directory entry and, on Windows, the virus scanner
+    EXTRACT_FILE_COST = 0.0005
+    # Number of rows of each table in the text report
+    TEXT_ROWS = 20
+
+    Entry = Struct.new(:target, :source, :storage, :size, :digest, :block, :compressed_size)
+
+    # Target of the archive that the packed files are counted in
+    attr_accessor :pack_target
+
+    def initialize
+      @entries = []
+    end
+
+    # Records a file. storage is how it is stored: :lzma in an LZMA
+    # block (block is the number of the block), :stored uncompressed
+    # between the blocks, :uncompressed without LZMA (--no-lzma), :vfs in
+    # the virtual file system image or :packed in the archive of packed
+    # Ruby files. stored_size is the part of the content that is stored
+    # (see --dedup).
+    def add(tgt, src, data, storage, block = nil, stored_size = data.bytesize)
+      @entries << Entry.new(Aibika.Pathname(tgt).to_posix, src && Aibika.Pathname(src).expand.to_posix,
+                            storage, data.bytesize, Digest::SHA256.digest(data), block, stored_size)
+    end
+
+    # Estimates the compressed sizes once the compressor has written
+    # every block
+    def finish(compressor)
+      @decode_rate = compressor&.profile&.decode_rate
+      block_sizes = compressor ? compressor.block_sizes : []
+      @entries.each do |entry|
+        next unless entry.storage == :lzma
+
+        size, compressed = block_sizes[entry.block]
+        entry.compressed_size = (entry.compressed_size * compressed.fdiv(size)).round if size
+      end
+
+      # The archive is counted as the packed files in it
+      archive = @entries.find { |entry| entry.target == @pack_target }
+      return unless archive
+
+      @entries.delete(archive)
+      @archive_storage = archive.storage
+      @entries.each do |entry|
+        next unless entry.storage == :packed
+
+        entry.compressed_size = (entry.size * archive.compressed_size.fdiv([archive.size, 1].max)).round
+      end
+    end
+
+    # Builds the report. gems are the specifications of the packaged
+    # gems, load_paths the load path of the script and other roots that
+    # files are grouped by, the innermost first.
+    def report(executable, gems:, load_paths:, dlls:)
+      gem_dirs = gems.to_h { |spec| [Aibika.Pathname(spec.full_gem_path).expand.to_posix, spec.full_name] }
+      gemspecs = gems.to_h { |spec| [Aibika.Pathname(spec.loaded_from).expand.to_posix, spec.full_name] }
+      roots = load_paths.map { |path| Aibika.Pathname(path).expand.to_posix }.uniq.sort_by { |path| -path.size }
+
+      files = @entries.map do |entry|
+        gem = gemspecs[entry.source] || gem_dirs.find { |dir, _| within?(entry.source, dir) }&.last
+        root = entry.source ? roots.find { |path| within?(entry.source, path) } || '(other)' : '(generated)'
+        # Versioned shared libraries (libruby.so.3.3) count as .so
+        type = entry.target =~ /\.so(\.\d+)+\z/ ? '.so' : File.extname(entry.target).downcase
+        { path: entry.target, source: entry.source, storage: entry.storage.to_s, bytes: entry.size,
+          compressed_bytes: entry.compressed_size, gem: gem, root: root, type: type.empty? ? '(none)' : type }
+      end
+
+      {
+        executable: executable.to_s,
+        size: File.size(executable.to_s),
+        totals: totals(files),
+        gems: group(files) { |file| file[:gem] || '(none)' },
+        load_path_roots: group(files) { |file| file[:root] },
+        file_types: group(files) { |file| file[:type] },
+        storage: group(files) { |file| file[:storage] },
+        duplicates: duplicates,
+        encodings: totals(files.select { |file| file[:path] =~ %r{/enc/.+\.so\z} }),
+        dlls: dlls.map { |dll| { path: Aibika.Pathname(dll).to_posix, bytes: File.size(dll.to_s) } },
+        extraction_estimate: extraction_estimate(files),
+        files: files.sort_by { |file| [-file[:compressed_bytes], file[:path]] }
+      }
+    end
+
+    # Writes the report as <executable>.analysis.json and
+    # <executable>.analysis.txt, and returns their paths
+    def write(executable, **args)
+      data = report(executable, **args)
+      executable = Aibika.Pathname(executable)
+      json = executable.dirname / executable.basename.ext('.analysis.json')
+      text = executable.dirname / executable.basename.ext('.analysis.txt')
+      File.write(json.to_s, JSON.pretty_generate(data))
+      File.write(text.to_s, to_text(data))
+      [json, text]
+    end
+
+    private
+
+    def within?(path, dir)
+      path && (path == dir || path.start_with?("#{dir}/"))
+    end
+
+    def totals(files)
+      { files: files.size, bytes: files.sum { |file| file[:bytes] },
+        compressed_bytes: files.sum { |file| file[:compressed_bytes] } }
+    end
+
+    def group(files, &block)
+      files.group_by(&block).map { |name, members| { name: name, **totals(members) } }
+           .sort_by { |row| [-row[:compressed_bytes], row[:name]] }
+    end
+
+    # Content that occurs more than once; all but one copy are redundant
+    def duplicates
+      @entries.group_by(&:digest).values.select { |copies| copies.size > 1 && copies.first.size.positive? }
+              .map do |copies|
+        { bytes: copies.first.size, redundant_bytes: copies.first.size * (copies.size - 1),
+          paths: copies.map(&:target).sort }
+      end.sort_by { |row| -row[:redundant_bytes] }
+    end
+
+    # Files in the virtual file system and packed files are not
+    # extracted; the archive of the packed files is, unless it is in
+    # the virtual file system
+    def extraction_estimate(files)
+      extracted = files.count { |file| !%w[vfs packed].include?(file[:storage]) }
+      extracted += 1 if @archive_storage && @archive_storage != :vfs
+      decoded = files.select { |file| file[:storage] == 'lzma' }.sum { |file| file[:bytes] }
+      if @archive_storage == :lzma
+        decoded += files.select { |file| file[:storage] == 'packed' }.sum { |file| file[:bytes] }
+      end
+      rate = @decode_rate || CompressionProfile::NOMINAL_DECODE_RATE
+      { files: extracted, per_file_seconds: EXTRACT_FILE_COST, decoded_bytes: decoded,
+        decode_rate: rate.round, seconds: ((extracted * EXTRACT_FILE_COST) + decoded.fdiv(rate)).round(3) }
+    end
+
+    def to_text(data)
+      out = +"Payload analysis of #{data[:executable]} (#{data[:size]} bytes)\n\n"
+      out << format("%<files>d files, %<bytes>d bytes, %<compressed_bytes>d bytes compressed\n", data[:totals])
+      estimate = data[:extraction_estimate]
+      out << "Estimated extraction: #{estimate[:seconds]} s (#{estimate[:files]} files x " \
+             "#{estimate[:per_file_seconds]} s + #{estimate[:decoded_bytes]} bytes / " \
+             "#{estimate[:decode_rate]} bytes/s)\n"
+      out << format("Encoding support files: %<files>d files, %<bytes>d bytes, " \
+                    "%<compressed_bytes>d bytes compressed\n", data[:encodings])
+      %i[gems load_path_roots file_types storage].each do |key|
+        out << "\n#{key.to_s.tr('_', ' ').capitalize}:\n"
+        rows = data[key].first(TEXT_ROWS).map { |row| [row[:name], row[:files], row[:bytes], row[:compressed_bytes]] }
+        out << table(rows)
+      end
+      out << "\nLargest files:\n"
+      out << table(data[:files].first(TEXT_ROWS).map { |file| [file[:path], 1, file[:bytes], file[:compressed_bytes]] })
+      unless data[:duplicates].empty?
+        out << "\nDuplicate content (#{data[:duplicates].sum { |row| row[:redundant_bytes] }} redundant bytes):\n"
+        data[:duplicates].first(TEXT_ROWS).each do |row|
+          out << "  #{row[:bytes]} bytes x #{row[:paths].size}: #{row[:paths].join(', ')}\n"
+        end
+      end
+      unless data[:dlls].empty?
+        out << "\nDetected DLLs:\n"
+        data[:dlls].each { |dll| out << "  #{dll[:path]} (#{dll[:bytes]} bytes)\n" }
+      end
+      out
+    end
+
+    def table(rows)
+      format("  %<bytes>12s %<compressed>12s %<files>6s  %<name>s\n",
+             bytes: 'bytes', compressed: 'compressed', files: 'files', name: 'name') +
+        rows.map do |name, files, bytes, compressed|
+        format("  %<bytes>12d %<compressed>12d %<files>6d  %<name>s\n",
+                 name: name, files: files, bytes: bytes, compressed: compressed)
+        end.join
+    end
+  end
+end
@@ -0,0 +1,58 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Branch converter for x86 and x64 machine code (see --no-bcj). The
+  # relative targets of CALL (E8) and JMP (E9) instructions are replaced
+  # by absolute ones, which repeat much more often and so compress
+  # better. The stub reverses the conversion (X86Unconvert in stub.c)
+  # before it writes the file.
+  #
+  # Only displacements within +/-16 MiB, i.e. whose top byte is 00 or
+  # FF, are converted, and the converted value is kept in that range.
+  # The four bytes after every E8/E9 are skipped whether converted or
+  # not, so a conversion never changes a byte that an earlier decision
+  # depended on, and the decoder makes the same decisions on the
+  # converted data as the encoder did on the original.
+  module BcjFilter
+    BRANCH_OPCODE = /[\xE8\xE9]/n.freeze
+    ADDRESS_MASK = 0x1FFFFFF
+    SIGN_BIT = 0x1000000
+    SIGN_EXTENSION = 0xFE000000
+
+    PE_MACHINES = [0x14c, 0x8664].freeze # i386, AMD64
+    ELF_MACHINES = [3, 62].freeze # i386, x86-64
+
+    # Whether the file content is a PE or ELF image for x86 or x64.
+    def self.x86_executable?(data)
+      if data.start_with?('MZ') && data.bytesize >= 0x40
+        pe_offset = data.byteslice(0x3c, 4).unpack1('V')
+        data.byteslice(pe_offset, 4) == "PE\0\0" &&
+          PE_MACHINES.include?(data.byteslice(pe_offset + 4, 2).unpack1('v'))
+      elsif data.start_with?("\x7FELF") && data.bytesize >= 20
+        data.getbyte(5) == 1 && ELF_MACHINES.include?(data.byteslice(18, 2).unpack1('v'))
+      else
+        false
+      end
+    end
+
+    # Returns a copy of data with the branch targets converted.
+    # The input is scanned while the copy is modified, as modifying the
+    # scanned string would make every search rescan it.
+    def self.encode(data)
+      data = data.b
+      result = data.dup
+      limit = data.bytesize - 5
+      pos = 0
+      while (pos = data.index(BRANCH_OPCODE, pos)) && pos <= limit
+        top = data.getbyte(pos + 4)
+        if top.zero? || top == 0xFF
+          target = (data.byteslice(pos + 1, 4).unpack1('V') + pos + 5) & ADDRESS_MASK
+          target |= SIGN_EXTENSION if target.anybits?(SIGN_BIT)
+          result[pos + 1, 4] = [target].pack('V')
+        end
+        pos += 5
+      end
+      result
+    end
+  end
+end
@@ -0,0 +1,65 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Trains the dictionary that the LZMA blocks are primed with (see
+  # --shared-dictionary). The blocks are compressed independently, so
+  # content that recurs across them, like the boilerplate of Ruby files
+  # in different gems or the C runtime code of DLLs, is paid for in
+  # every block. Lines and strings that occur in several blocks are
+  # collected into the dictionary instead, which every block refers to.
+  class BlockDictionary
+    # Maximum size of the dictionary
+    SIZE = 256 * 1024
+    # The size is rounded up to a multiple of this, LzmaCompressor::MAP_ALIGN,
+    # so that the content of the blocks after it stays aligned
+    ALIGN = 64 * 1024
+    # Less recurring content than this does not pay for the dictionary
+    MIN_CONTENT = 4 * 1024
+    # Candidate segments: lines, or strings in binaries, of 8 to 200 bytes
+    SEGMENT = /[^\n\0]{8,200}[\n\0]/n
+    # Bytes of each block that segments are counted in, taken from
+    # SAMPLE_SLICES places spread over the block
+    SAMPLE_SIZE = 2 * 1024 * 1024
+    SAMPLE_SLICES = 8
+
+    def initialize
+      @counts = Hash.new(0)
+    end
+
+    # Counts the segments of a block, each once
+    def add(block)
+      slice = SAMPLE_SIZE / SAMPLE_SLICES
+      sample = if block.bytesize <= SAMPLE_SIZE
+                 block
+               else
+                 Array.new(SAMPLE_SLICES) do |i|
+                   block.byteslice((block.bytesize - slice) * i / (SAMPLE_SLICES - 1), slice)
+                 end.join
+               end
+      sample.scan(SEGMENT).uniq.each { |segment| @counts[segment] += 1 }
+      self
+    end
+
+    # Returns the dictionary, or nil when too little content recurs.
+    # Segments are ranked by the bytes that they would save in the
+    # blocks after the first that has them, and the most valuable come
+    # last, closest to the content, where matches are cheapest to
+    # encode. It is padded with zeros at the start up to a multiple of
+    # ALIGN.
+    def train(size = SIZE)
+      ranked = @counts.select { |_, count| count > 1 }
+                      .sort_by { |segment, count| [-(count - 1) * segment.bytesize, segment] }
+      chosen = []
+      total = 0
+      ranked.each do |segment, _|
+        next if total + segment.bytesize > size
+
+        chosen << segment
+        total += segment.bytesize
+      end
+      return nil if total < MIN_CONTENT
+
+      ("\0".b * (-total % ALIGN)) + chosen.reverse.join
+    end
+  end
+end
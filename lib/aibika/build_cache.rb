@@ -0,0 +1,44 @@
+# frozen_string_literal: true
+
+require 'digest/sha2'
+require 'fileutils'
+
+module Aibika
+  # Content-addressed store for build results that are kept between
+  # runs of the builder (see --build-cache). Entries are immutable and
+  # written atomically, so several builds can share one cache.
+  class BuildCache
+    def initialize(dir)
+      @dir = Aibika.Pathname(dir).expand
+    end
+
+    # Computes a cache key from the given strings.
+    def key(*parts)
+      digest = Digest::SHA256.new
+      parts.each { |part| digest << [part.bytesize].pack('Q<') << part }
+      digest.hexdigest
+    end
+
+    def fetch(kind, key)
+      path = entry_path(kind, key)
+      File.binread(path.to_s) if path.file?
+    end
+
+    def store(kind, key, data)
+      path = entry_path(kind, key)
+      FileUtils.mkdir_p(path.dirname.to_s)
+      tmppath = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+      File.binwrite(tmppath, data)
+      File.rename(tmppath, path.to_s)
+    rescue SystemCallError => e
+      Aibika.warn "Failed to store #{kind} in build cache: #{e.message}"
+      File.unlink(tmppath) if tmppath && File.exist?(tmppath)
+    end
+
+    private
+
+    def entry_path(kind, key)
+      @dir / kind / key[0, 2] / key
+    end
+  end
+end
@@ -0,0 +1,106 @@
+# frozen_string_literal: true
+
+require 'digest/sha2'
+
+module Aibika
+  # Finds content that files share with files added before them (see
+  # --dedup). Files are split into chunks at content-defined boundaries
+  # (a gear rolling hash), so an insertion or a changed version resource
+  # only changes the chunks around it, and the chunks of near-duplicate
+  # files, like several vendored versions of a library, still match.
+  # Each chunk is indexed by its digest with the file and offset where
+  # it was first seen, which the stub copies it from when it extracts a
+  # later file.
+  class ChunkIndex
+    # Smaller files are not split, but can still be copied whole
+    MIN_FILE_SIZE = 64 * 1024
+    # Bounds of the chunk size. With MIN_CHUNK skipped and 13 bits in
+    # BOUNDARY_MASK, chunks are about 10 KB on average.
+    MIN_CHUNK = 2 * 1024
+    MAX_CHUNK = 64 * 1024
+    BOUNDARY_MASK = 0xfff80000
+    # Files that share less than this with earlier files are stored as
+    # they are
+    MIN_SHARED = 4 * 1024
+    # Random value of each byte for the rolling hash, fixed so that the
+    # boundaries are the same in every build
+    GEAR = Array.new(256) { |byte| Digest::SHA256.digest(byte.chr).unpack1('L<') }.freeze
+
+    # Bytes of the files that were replaced by copies from earlier files
+    attr_reader :shared_size
+
+    def initialize
+      @chunks = {}
+      @shared_size = 0
+    end
+
+    # Offsets at which data is split, the last being its size
+    def self.boundaries(data)
+      cuts = []
+      start = 0
+      size = data.bytesize
+      while start < size
+        stop = [start + MAX_CHUNK, size].min
+        cut = stop
+        hash = 0
+        i = start + MIN_CHUNK
+        while i < stop
+          hash = ((hash << 1) + GEAR[data.getbyte(i)]) & 0xffffffff
+          i += 1
+          if (hash & BOUNDARY_MASK).zero?
+            cut = i
+            break
+          end
+        end
+        cuts << cut
+        start = cut
+      end
+      cuts
+    end
+
+    # Adds a file, which the stub extracts before the files added after
+    # it. Returns its pieces when it shares at least MIN_SHARED bytes
+    # with earlier files, nil otherwise: [:data, offset, size] for
+    # content of the file itself and [:copy, target, offset, size] for
+    # content of an earlier file. Adjacent pieces are merged.
+    def add(tgt, data)
+      return nil if data.bytesize < MIN_SHARED
+
+      pieces = []
+      found = {}
+      shared = 0
+      offset = 0
+      cuts = data.bytesize < MIN_FILE_SIZE ? [data.bytesize] : ChunkIndex.boundaries(data)
+      cuts.each do |cut|
+        size = cut - offset
+        digest = Digest::SHA256.digest(data.byteslice(offset, size))
+        source = @chunks[digest]
+        if source
+          append(pieces, [:copy, *source, size])
+          shared += size
+        else
+          # Chunks repeated within the file are left to LZMA
+          found[digest] ||= [tgt, offset]
+          append(pieces, [:data, offset, size])
+        end
+        offset = cut
+      end
+      @chunks.merge!(found) { |_, first, _| first }
+      return nil if shared < MIN_SHARED
+
+      @shared_size += shared
+      pieces
+    end
+
+    private
+
+    def append(pieces, piece)
+      last = pieces.last
+      if last && last[0...-2] == piece[0...-2] && last[-2] + last[-1] == piece[-2]
+        last[-1] += piece.last
+      else
+        pieces << piece
+      end
+    end
+  end
+end
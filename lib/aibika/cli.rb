@@ -22,6 +22,14 @@ module Aibika
       --allow-self       Include self (aibika gem) if detected or specified
           This option is required only if aibika gem is deployed as a part
           of broader bundled your solution
+      --no-gem-index     Don't prebuild the RubyGems specification index; let
+          RubyGems load each packaged gemspec at startup
+      --entry [name=]script
+                         Add another script that shares the runtime and files
+          of the executable. It is run instead of script.rb when the
+          executable is invoked as <name>.exe or as '<exe> <name> args'.
+          Name defaults to the script name without extension.
+          Dependencies are only detected by running script.rb.
 
       Gem content detection modes:
 
@@ -49,18 +57,82 @@ module Aibika
       --no-dep-run       Don't run script.rb to check for dependencies.
       --no-autoload      Don't load/include script.rb's autoloads.
       --no-autodll       Disable detection of runtime DLL dependencies.
+      --refresh-dep-cache Run script.rb even if its dependencies are in the
+          build cache (see --build-cache).
 
       Output options:
 
       --output <file>    Name the exe to generate. Defaults to ./<scriptname>.exe.
       --no-lzma          Disable LZMA compression of the executable.
+      --lzma-threads <n> Number of blocks to compress in parallel. Defaults to
+          the number of processors.
+      --no-bcj           Don't convert x86/x64 branch targets in executables
+          and DLLs to make them compress better.
+      --no-store-incompressible
+                         Compress all files, including already compressed ones
+          (archives, images, fonts), which are stored as is by default.
+      --shared-store[=user|machine]
+                         Extract the Ruby runtime and gems once into a store
+          shared by all executables built with this option
+          (%LOCALAPPDATA%\\aibika\\store, or %ProgramData%\\aibika\\store
+          for machine), and hard link them from there. Only administrators
+          can add files to the machine store.
+      --resident[=<seconds>]
+                         Keep a server with the extracted files and a Ruby that
+          has loaded the application's libraries running in the background
+          (Linux and other POSIX systems). Later runs are forked from it.
+          It exits after <seconds> without runs (DEFAULT 300).
+      --pack-sources     Pack the Ruby files into one archive that is extracted
+          instead of each file, and load them from it.
+      --vfs              Extract only Ruby, its libraries and native extensions,
+          and serve the other files from the executable through a
+          preloaded file system interposer (Linux).
+      --extract-cache    Extract once to a directory kept for later runs
+          (%LOCALAPPDATA%\\aibika\\extract\\<digest>). An interrupted
+          extraction is resumed by the next run.
+      --no-prefetch      With --extract-cache, don't read the files that script.rb
+          loaded ahead of Ruby when the exe starts.
+      --compression-profile <name>
+                         LZMA settings: fast-start (small blocks, fast decoding),
+          balanced (DEFAULT), smallest (large blocks and dictionary), or
+          auto (try each on a sample of the payload and pick by target).
+      --compression-target <metric>
+                         Metric for auto profile: size, decode or startup
+          (read and decode time, DEFAULT).
+      --dedup            Split large files into content-defined chunks and store
+          chunks that earlier files have once; the executable copies
+          them from those files when it extracts.
+      --shared-dictionary Train a dictionary from the payload, store it once and
+          prime every LZMA block with it, so content that recurs across
+          blocks is not paid for in each of them.
+      --build-cache <dir> Reuse compressed blocks of unchanged runtime, gem and
+          application files, and the dependencies detected by running
+          script.rb, from previous builds, kept in <dir>.
+      --payload-file     Write the payload to <output>.pak (without .exe) next to a
+          small executable, which maps it read-only. Updates can replace
+          the .pak file alone.
       --innosetup <file> Use given Inno Setup script (.iss) to create an installer.
+      --delta-from <exe> Also write <output>.delta, which turns <exe>, built by an
+          earlier version of the application, into the new executable.
+          Only opcodes and LZMA blocks that changed are carried in it.
+      --apply-delta <old exe> <delta> <new exe>
+                         Reconstruct <new exe> from <old exe> and a delta and
+          verify it, then exit.
+      --analyze          Write a breakdown of the payload by gem, load path root,
+          file type and file, with duplicate content and an estimate of
+          the extraction time, to <output>.analysis.json and .txt.
 
       Executable options:
 
       --windows          Force Windows application (rubyw.exe)
       --console          Force console application (ruby.exe)
       --chdir-first      When exe starts, change working directory to app dir.
+      --gc-tuning        Start Ruby with a heap of the size that script.rb needed
+          when it was run, so it does not collect garbage repeatedly
+          while loading libraries.
+      --gc-env <NAME=VALUE>
+                         Set a RUBY_* variable, like RUBY_GC_HEAP_GROWTH_FACTOR,
+          when the exe starts (implies --gc-tuning).
       --icon <ico>       Replace icon with a custom one.
       --debug            Executable will be verbose.
       --debug-extract    Executable will unpack to local dir and not delete after.
@@ -70,10 +142,60 @@ module Aibika
       case arg
       when /\A--(no-)?lzma\z/
         @options[:lzma_mode] = !::Regexp.last_match(1)
+      when /\A--lzma-threads\z/
+        @options[:lzma_threads] = Integer(argv.shift)
+      when /\A--(no-)?bcj\z/
+        @options[:bcj] = !::Regexp.last_match(1)
+      when /\A--(no-)?store-incompressible\z/
+        @options[:store_incompressible] = !::Regexp.last_match(1)
+      when /\A--shared-store(?:=(.*))?\z/
+        @options[:shared_store] = ::Regexp.last_match(1) || 'user'
+        unless AibikaBuilder::SHARED_STORE_SCOPES.include?(shared_store)
+          Aibika.fatal_error "Unknown shared store #{shared_store}. " \
+                             "Use one of #{AibikaBuilder::SHARED_STORE_SCOPES.join(', ')}.\n"
+        end
+      when /\A--resident(?:=(.*))?\z/
+        @options[:resident] = Integer(::Regexp.last_match(1) || 300)
+        Aibika.fatal_error 'Resident mode is not supported on Windows' if Host.windows?
+      when /\A--pack-sources\z/
+        @options[:pack_sources] = true
+      when /\A--analyze\z/
+        @options[:analyze] = true
+      when /\A--payload-file\z/
+        @options[:payload_file] = true
+      when /\A--extract-cache\z/
+        @options[:extract_cache] = true
+      when /\A--no-prefetch\z/
+        @options[:prefetch] = false
+      when /\A--vfs\z/
+        @options[:vfs] = true
+        Aibika.fatal_error 'The virtual file system is not supported on Windows' if Host.windows?
+      when /\A--compression-profile\z/
+        @options[:compression_profile] = argv.shift
+        unless CompressionProfile.names.include?(compression_profile)
+          Aibika.fatal_error "Unknown compression profile #{compression_profile}. " \
+                             "Use one of #{CompressionProfile.names.join(', ')}.\n"
+        end
+      when /\A--compression-target\z/
+        @options[:compression_target] = argv.shift
+        unless CompressionProfile::TARGETS.include?(compression_target)
+          Aibika.fatal_error "Unknown compression target #{compression_target}. " \
+                             "Use one of #{CompressionProfile::TARGETS.join(', ')}.\n"
+        end
+      when /\A--dedup\z/
+        @options[:dedup] = true
+      when /\A--shared-dictionary\z/
+        @options[:shared_dictionary] = true
+      when /\A--build-cache\z/
+        @options[:build_cache] = Pathname(argv.shift)
       when /\A--no-dep-run\z/
         @options[:run_script] = false
       when /\A--add-all-core\z/
         @options[:add_all_core] = true
+      when /\A--entry\z/
+        name, script = argv.shift.split('=', 2)
+        name, script = nil, name unless script
+        @options[:entries] << [name, script]
       when /\A--output\z/
         @options[:output_override] = Pathname(argv.shift)
       when /\A--dll\z/
@@ -90,17 +212,42 @@ module Aibika
         @options[:load_autoload] = false
       when /\A--chdir-first\z/
         @options[:chdir_first] = true
+      when /\A--gc-tuning\z/
+        @options[:gc_tuning] = true
+      when /\A--gc-env\z/
+        name, value = argv.shift.to_s.split('=', 2)
+        unless value && name.match?(GcTuning::VARIABLE)
+          Aibika.fatal_error "Invalid --gc-env #{name}. Use NAME=VALUE with a RUBY_* variable name.\n"
+        end
+        @options[:gc_tuning] = true
+        @options[:gc_env][name] = value
       when /\A--icon\z/
+        Aibika.fatal_error 'Icons can only be replaced on Windows' unless Host.windows?
         @options[:icon_filename] = Pathname(argv.shift)
         Aibika.fatal_error "Icon file #{icon_filename} not found.\n" unless icon_filename.exist?
       when /\A--gemfile\z/
         @options[:gemfile] = Pathname(argv.shift)
         Aibika.fatal_error "Gemfile #{gemfile} not found.\n" unless gemfile.exist?
+      when /\A--delta-from\z/
+        @options[:delta_from] = Pathname(argv.shift)
+        Aibika.fatal_error "Executable #{delta_from} not found.\n" unless delta_from.exist?
+      when /\A--apply-delta\z/
+        old, delta, new = argv.shift(3)
+        Aibika.fatal_error 'Usage: aibika --apply-delta <old exe> <delta> <new exe>' unless new
+        begin
+          Delta.apply(old, delta, new)
+        rescue StandardError => e
+          Aibika.fatal_error "Applying delta failed: #{e.message}"
+        end
+        Aibika.msg "Wrote #{new}"
+        exit 0
       when /\A--innosetup\z/
         @options[:inno_script] = Pathname(argv.shift)
         Aibika.fatal_error "Inno Script #{inno_script} not found.\n" unless inno_script.exist?
       when /\A--no-autodll\z/
         @options[:autodll] = false
+      when /\A--refresh-dep-cache\z/
+        @options[:refresh_dep_cache] = true
       when /\A--version\z/
         puts "Aibika #{VERSION}"
         exit 0
@@ -115,6 +262,8 @@ module Aibika
         ARGV.clear
       when /\A--(no-)?enc\z/
         @options[:enc] = !::Regexp.last_match(1)
+      when /\A--(no-)?gem-index\z/
+        @options[:gem_index] = !::Regexp.last_match(1)
       when /\A--(no-)?gem-(\w+)(?:=(.*))?$/
         negate = ::Regexp.last_match(1)
         group = ::Regexp.last_match(2)
@@ -141,6 +290,46 @@ module Aibika
       Aibika.fatal_error 'LZMA compression must be disabled (--no-lzma) when using Inno Setup'
     end
 
+    if Aibika.resident && Aibika.inno_script
+      Aibika.fatal_error 'The --resident option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.pack_sources && Aibika.inno_script
+      Aibika.fatal_error 'The --pack-sources option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.delta_from && Aibika.inno_script
+      Aibika.fatal_error 'The --delta-from option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.vfs && Aibika.inno_script
+      Aibika.fatal_error 'The --vfs option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.extract_cache && Aibika.inno_script
+      Aibika.fatal_error 'The --extract-cache option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.payload_file && Aibika.inno_script
+      Aibika.fatal_error 'The --payload-file option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.dedup && Aibika.inno_script
+      Aibika.fatal_error 'The --dedup option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.analyze && Aibika.inno_script
+      Aibika.fatal_error 'The --analyze option conflicts with use of Inno Setup'
+    end
+
+    if Aibika.shared_dictionary && !Aibika.lzma_mode
+      Aibika.fatal_error 'The --shared-dictionary option requires LZMA compression'
+    end
+
+    if Aibika.extract_cache && Aibika.debug_extract
+      Aibika.fatal_error 'The --extract-cache option conflicts with --debug-extract'
+    end
+
     if !Aibika.chdir_first && Aibika.inno_script
       Aibika.fatal_error 'Chdir-first mode must be enabled (--chdir-first) when using Inno Setup'
     end
@@ -160,6 +349,14 @@ module Aibika
       Aibika.fatal_error "#{path} not found!" if files.empty?
       files.map { |pth| Pathname(pth).expand }
     end.flatten!
+
+    @options[:entries].map! do |name, script|
+      path = Pathname(script.encode('UTF-8').tr('\\', '/'))
+      Aibika.fatal_error "#{path} not found!" unless path.file?
+      path = path.expand
+      @options[:files] << path unless files.include?(path)
+      [name || path.basename.to_s.sub(/\.rbw?\z/, ''), path]
+    end
   end
 
   def self.msg(msg)
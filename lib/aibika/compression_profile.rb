@@ -0,0 +1,144 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Named sets of LZMA settings (see --compression-profile). A profile
+  # trades compression ratio against the time and memory the stub needs
+  # to decode the executable: the stub decodes one block at a time
+  # straight into a buffer of the block's size, so the block size bounds
+  # the decoder memory, and the dictionary is never made larger than the
+  # block it is used for.
+  class CompressionProfile
+    attr_reader :name, :block_size, :max_dict_bits, :lc, :lp, :pb, :fb, :mode, :mf
+
+    # Nominal LZMA decoding speed of the stub (bytes of output per second)
+    NOMINAL_DECODE_RATE = 50 * 1024 * 1024
+    # Nominal read speed used to weigh compressed size against decode time
+    NOMINAL_READ_RATE = 100 * 1024 * 1024
+    # Amount of the payload compressed with each candidate in auto mode
+    SAMPLE_SIZE = 4 * 1024 * 1024
+
+    def initialize(name, block_size:, max_dict_bits:, lc: 3, lp: 0, pb: 2, fb: 64, mode: 1, mf: 'bt4')
+      @name = name
+      @block_size = block_size
+      @max_dict_bits = max_dict_bits
+      @lc = lc
+      @lp = lp
+      @pb = pb
+      @fb = fb
+      @mode = mode
+      @mf = mf
+      @decode_rate = NOMINAL_DECODE_RATE
+    end
+
+    PROFILES = [
+      new('fast-start', block_size: 4 * 1024 * 1024, max_dict_bits: 22, fb: 32, mode: 0, mf: 'hc4'),
+      new('balanced', block_size: 16 * 1024 * 1024, max_dict_bits: 24),
+      new('smallest', block_size: 64 * 1024 * 1024, max_dict_bits: 26, fb: 273)
+    ].to_h { |profile| [profile.name, profile] }.freeze
+
+    DEFAULT = 'balanced'
+
+    # Metrics that auto mode can select a profile by
+    TARGETS = %w[size decode startup].freeze
+
+    attr_accessor :decode_rate
+
+    def self.names
+      PROFILES.keys + ['auto']
+    end
+
+    def self.[](name)
+      PROFILES.fetch(name)
+    end
+
+    # Compresses a sample of the payload with each profile and returns
+    # the one that is best by the target metric: 'size' picks the
+    # smallest output, 'decode' the fastest decoding and 'startup' the
+    # shortest estimated time to read and decode the payload.
+    def self.auto(sample, target)
+      sample = sample.byteslice(0, SAMPLE_SIZE)
+      results = PROFILES.values.map do |profile|
+        Thread.new do
+          compressed = profile.run_lzma(%w[e -si -so] + profile.switches(sample.bytesize), sample)
+          started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          profile.run_lzma(%w[d -si -so], compressed)
+          elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+          [profile, compressed.bytesize, elapsed]
+        end
+      end.map(&:value)
+
+      results.each do |profile, size, elapsed|
+        Aibika.verbose_msg "Profile #{profile.name}: #{sample.bytesize} bytes to #{size} bytes, " \
+                           "decoded in #{(elapsed * 1000).round} ms"
+      end
+
+      profile, _size, elapsed = results.min_by do |_profile, size, decode_time|
+        case target
+        when 'size' then size
+        when 'decode' then decode_time
+        else size.fdiv(NOMINAL_READ_RATE) + decode_time
+        end
+      end
+      profile = profile.dup
+      profile.decode_rate = sample.bytesize / elapsed if elapsed.positive?
+      profile
+    end
+
+    # Dictionary size for a block: large enough to cover the block, but
+    # not larger than the profile allows.
+    def dict_bits(data_size)
+      bits = 16
+      bits += 1 while bits < @max_dict_bits && (1 << bits) < data_size
+      bits
+    end
+
+    # Command line switches for lzma.exe to compress a block
+    def switches(data_size)
+      ["-a#{@mode}", "-d#{dict_bits(data_size)}", "-fb#{@fb}", "-mf#{@mf}",
+       "-lc#{@lc}", "-lp#{@lp}", "-pb#{@pb}"]
+    end
+
+    # Identifies the settings, for the keys of the build cache
+    def to_s
+      "#{@name} block=#{@block_size} #{switches(@block_size).join(' ')}"
+    end
+
+    # Memory used by the stub to decode a block: the output buffer and
+    # the probability model of LzmaDec.
+    def decoder_memory(data_size)
+      data_size + ((1846 + (768 << (@lc + @lp))) * 2)
+    end
+
+    def decode_time(data_size)
+      data_size.fdiv(@decode_rate)
+    end
+
+    # Command line for lzma.exe, or for xz with the same settings on
+    # POSIX hosts. Both write the .lzma format that the stub decodes.
+    def lzma_command(args)
+      return [Aibika.lzmapath.to_s, *args] if Host.windows?
+
+      command = [Aibika.lzmapath.to_s, '--format=lzma', '--stdout']
+      return command + ['--decompress'] if args.first == 'd'
+
+      mode = @mode.zero? ? 'fast' : 'normal'
+      dict = 1 << args.find { |arg| arg.start_with?('-d') }[2..].to_i
+      command + ["--lzma1=mode=#{mode},dict=#{dict},nice=#{@fb},mf=#{@mf},lc=#{@lc},lp=#{@lp},pb=#{@pb}"]
+    end
+
+    def run_lzma(args, input)
+      output = IO.popen(lzma_command(args), 'r+b') do |lzma|
+        writer = Thread.new do
+          lzma.write(input)
+          lzma.close_write
+        end
+        result = lzma.read
+        writer.join
+        result
+      end
+      raise "lzma failed (#{$CHILD_STATUS})" unless $CHILD_STATUS.success?
+
+      output
+    end
+  end
+end
@@ -0,0 +1,194 @@
+# frozen_string_literal: true
+
+require 'digest/sha2'
+
+module Aibika
+  # Delta updates between two versions of an executable (see
+  # --delta-from and --apply-delta).
+  #
+  # Both executables are split into segments: the stub, then each
+  # opcode at the top level of the opcode stream (an LZMA block, a file
+  # stored outside the blocks, a launch opcode), then the trailer.
+  # Segments of the new executable that also occur in the old one,
+  # which includes every LZMA block reused from the build cache or
+  # compressed from unchanged content, are copied from the old
+  # executable when the delta is applied. Only the other segments are
+  # carried in the delta.
+  #
+  # The delta is MAGIC, the size and SHA-256 digest of the old and of
+  # the new executable, the number of records, and the records. A record
+  # is either COPY, offset and size in the old executable, or DATA, size
+  # and the bytes. Sizes and offsets are 64 bit little endian.
+  module Delta
+    MAGIC = 'AIBIKADELTA1'
+    COPY = 0
+    DATA = 1
+    # Bytes read at a time when the delta is applied
+    CHUNK_SIZE = 1024 * 1024
+
+    # Arguments of each opcode: Z a string, V an integer, D an integer
+    # followed by that many bytes, L a count followed by that many pairs
+    # of strings
+    OPCODE_ARGUMENTS = {
+      AibikaBuilder::OP_END => '',
+      AibikaBuilder::OP_CREATE_DIRECTORY => 'Z',
+      AibikaBuilder::OP_CREATE_FILE => 'ZD',
+      AibikaBuilder::OP_CREATE_PROCESS => 'ZZ',
+      AibikaBuilder::OP_DECOMPRESS_LZMA => 'D',
+      AibikaBuilder::OP_SETENV => 'ZZ',
+      AibikaBuilder::OP_POST_CREATE_PROCESS => 'ZZ',
+      AibikaBuilder::OP_ENABLE_DEBUG_MODE => '',
+      AibikaBuilder::OP_CREATE_INST_DIRECTORY => 'VVV',
+      AibikaBuilder::OP_CREATE_FILE_BCJ => 'ZD',
+      AibikaBuilder::OP_USE_SHARED_STORE => 'V',
+      AibikaBuilder::OP_LINK_SHARED_FILES => 'L',
+      AibikaBuilder::OP_CREATE_SHARED_FILE => 'ZZVD',
+      AibikaBuilder::OP_ENTRY_POINT => 'ZZZ',
+      AibikaBuilder::OP_RESIDENT => 'ZV',
+      AibikaBuilder::OP_VFS_IMAGE => 'D',
+      AibikaBuilder::OP_EXTRACT_CACHE => 'Z',
+      AibikaBuilder::OP_PAYLOAD_FILE => 'Z',
+      AibikaBuilder::OP_PADDING => 'D',
+      AibikaBuilder::OP_LZMA_DICTIONARY => 'VD',
+      AibikaBuilder::OP_DECOMPRESS_LZMA_PRIMED => 'D',
+      AibikaBuilder::OP_CREATE_FILE_CHUNKS => 'ZVD',
+      AibikaBuilder::OP_PREFETCH => 'D'
+    }.freeze
+
+    class << self
+      # Writes the delta that turns the old executable into the new one
+      def generate(old_path, new_path, delta_path)
+        old = File.binread(old_path)
+        new = File.binread(new_path)
+        known = {}
+        segments(old).each { |offset, size| known[Digest::SHA256.digest(old.byteslice(offset, size))] ||= offset }
+
+        records = []
+        segments(new).each do |offset, size|
+          data = new.byteslice(offset, size)
+          old_offset = known[Digest::SHA256.digest(data)]
+          last = records.last
+          if old_offset.nil?
+            if last&.first == DATA
+              last[1] << data
+            else
+              records << [DATA, data.dup]
+            end
+          elsif last&.first == COPY && last[1] + last[2] == old_offset
+            last[2] += size
+          else
+            records << [COPY, old_offset, size]
+          end
+        end
+
+        File.open(delta_path, 'wb') do |file|
+          file.write(MAGIC, header(old), header(new), [records.size].pack('V'))
+          records.each do |type, *args|
+            if type == COPY
+              file.write([COPY, *args].pack('CQ<Q<'))
+            else
+              file.write([DATA, args[0].bytesize].pack('CQ<'), args[0])
+            end
+          end
+        end
+        records.sum { |type, *args| type == DATA ? args[0].bytesize : 0 }
+      end
+
+      # Reconstructs the new executable from the old one and the delta,
+      # verifying both against the digests in the delta. The files are
+      # read a chunk at a time, not held in memory.
+      def apply(old_path, delta_path, new_path)
+        old_header = [File.size(old_path)].pack('Q<') + Digest::SHA256.file(old_path).digest
+        File.open(old_path, 'rb') do |old|
+          File.open(delta_path, 'rb') do |delta|
+            raise 'not an Aibika delta' unless delta.read(MAGIC.bytesize) == MAGIC
+            raise "#{old_path} is not the executable that the delta was made from" unless delta.read(40) == old_header
+
+            new_size, new_digest = delta.read(40).unpack('Q<a32')
+            digest = Digest::SHA256.new
+            File.open(new_path, 'wb') do |file|
+              delta.read(4).unpack1('V').times do
+                if delta.readbyte == COPY
+                  offset, size = delta.read(16).unpack('Q<Q<')
+                  old.seek(offset)
+                  copy(old, file, size, digest)
+                else
+                  copy(delta, file, delta.read(8).unpack1('Q<'), digest)
+                end
+              end
+            end
+            unless File.size(new_path) == new_size && digest.digest == new_digest
+              File.unlink(new_path)
+              raise 'the reconstructed executable does not match the delta'
+            end
+          end
+        end
+        File.chmod(File.stat(old_path).mode, new_path)
+      end
+
+      # Splits an executable into the stub, the top level opcodes and the
+      # trailer, as offset and size pairs. Data that is not understood
+      # forms a single segment.
+      def segments(data)
+        signature = AibikaBuilder::Signature.pack('C*')
+        return [[0, data.bytesize]] unless data.bytesize >= 8 && data.end_with?(signature)
+
+        opcode_offset = data.byteslice(-8, 4).unpack1('V')
+        return [[0, data.bytesize]] if opcode_offset > data.bytesize - 8
+
+        result = [[0, opcode_offset]]
+        pos = opcode_offset
+        while pos < data.bytesize - 8
+          size = opcode_size(data, pos)
+          break unless size
+
+          result << [pos, size]
+          pos += size
+        end
+        result << [pos, data.bytesize - pos] if pos < data.bytesize
+        result
+      end
+
+      private
+
+      # Copies size bytes from the current position of input to output
+      def copy(input, output, size, digest)
+        while size.positive?
+          data = input.read([size, CHUNK_SIZE].min)
+          raise 'the delta is damaged' if data.nil?
+
+          digest << data
+          output.write(data)
+          size -= data.bytesize
+        end
+      end
+
+      def header(data)
+        [data.bytesize].pack('Q<') + Digest::SHA256.digest(data)
+      end
+
+      def opcode_size(data, start)
+        arguments = OPCODE_ARGUMENTS[data.byteslice(start, 4).unpack1('V')]
+        return unless arguments
+
+        pos = start + 4
+        arguments.each_char do |argument|
+          case argument
+          when 'Z'
+            pos = data.index("\0", pos)&.succ
+          when 'V'
+            pos += 4
+          when 'D'
+            pos += 4 + data.byteslice(pos, 4).unpack1('V')
+          when 'L'
+            count = data.byteslice(pos, 4).unpack1('V')
+            pos += 4
+            (count * 2).times { pos = data.index("\0", pos)&.succ if pos }
+          end
+          return if pos.nil? || pos > data.bytesize
+        end
+        pos - start
+      end
+    end
+  end
+end
@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Initial heap size of the packaged Ruby (see --gc-tuning). Ruby starts
+  # with a small heap and grows it while the application loads its
+  # libraries, running a garbage collection each time it fills up. The
+  # heap that the script needed when it was run to detect its
+  # dependencies is recorded instead, and the executable sets the
+  # RUBY_GC_HEAP_*_INIT_SLOTS variables so that Ruby starts with a heap
+  # of that size.
+  module GcTuning
+    # Room for objects that the application allocates after loading
+    HEADROOM = 1.25
+    # Initial slots of each heap in Ruby; smaller values are not set
+    DEFAULT_SLOTS = 10_000
+    # Names of variables that can be set with --gc-env
+    VARIABLE = /\ARUBY_[A-Z0-9_]+\z/
+
+    # Live objects of each heap (size pool) of this Ruby, or of the
+    # whole heap with a Ruby that has only one initial size
+    def self.capture
+      if per_heap?
+        count = GC::INTERNAL_CONSTANTS[:HEAP_COUNT] || GC::INTERNAL_CONSTANTS[:SIZE_POOL_COUNT]
+        heaps = Array.new(count) do |heap|
+          stat = GC.stat_heap(heap)
+          stat[:total_allocated_objects] - stat[:total_freed_objects]
+        end
+        { heaps: heaps }
+      else
+        { live_slots: GC.stat[:heap_live_slots] }
+      end
+    end
+
+    # The variables to set at launch for statistics captured by capture
+    def self.environment(stats)
+      return {} unless stats
+
+      if stats[:heaps] && per_heap?
+        stats[:heaps].each_with_index.to_h { |live, heap| ["RUBY_GC_HEAP_#{heap}_INIT_SLOTS", slots(live)] }
+                     .select { |_, value| value > DEFAULT_SLOTS }.transform_values(&:to_s)
+      elsif stats[:live_slots]
+        value = slots(stats[:live_slots])
+        value > DEFAULT_SLOTS ? { 'RUBY_GC_HEAP_INIT_SLOTS' => value.to_s } : {}
+      else
+        {}
+      end
+    end
+
+    # Since Ruby 3.3, each heap has its own initial size, and
+    # RUBY_GC_HEAP_INIT_SLOTS is ignored
+    def self.per_heap?
+      GC.respond_to?(:stat_heap) && Gem::Version.new(RUBY_VERSION) >= Gem::Version.new('3.3')
+    end
+
+    def self.slots(live)
+      (live * HEADROOM).ceil
+    end
+  end
+end
@@ -4,6 +4,12 @@ module Aibika
   # Variables describing the host's build environment.
   module Host
     class << self
+      # Whether the host (and so the built executable) is Windows.
+      # Other hosts get the POSIX stub (src/stub_posix.c).
+      def windows?
+        Gem.win_platform?
+      end
+
       def exec_prefix
         @exec_prefix ||= Aibika.Pathname(RbConfig::CONFIG['exec_prefix'])
       end
@@ -16,8 +22,32 @@ module Aibika
         @bindir ||= Aibika.Pathname(RbConfig::CONFIG['bindir'])
       end
 
+      def libdir
+        @libdir ||= Aibika.Pathname(RbConfig::CONFIG['libdir'])
+      end
+
+      # Name of the shared Ruby library, as the Ruby executable refers
+      # to it. Nil for a Ruby linked statically on POSIX hosts.
       def libruby_so
-        @libruby_so ||= Aibika.Pathname(RbConfig::CONFIG['LIBRUBY_SO'])
+        return @libruby_so if defined?(@libruby_so)
+
+        @libruby_so = if windows?
+                        Aibika.Pathname(RbConfig::CONFIG['LIBRUBY_SO'])
+                      elsif RbConfig::CONFIG['ENABLE_SHARED'] == 'yes'
+                        Aibika.Pathname(RbConfig::CONFIG['LIBRUBY_SONAME'] || RbConfig::CONFIG['LIBRUBY_SO'])
+                      end
+      end
+
+      # Directory holding the shared Ruby library
+      def libruby_dir
+        windows? ? bindir : libdir
+      end
+
+      # Whether Ruby finds its libraries relative to its executable, so
+      # that the copy extracted by the stub does not use the host's.
+      # Always the case on Windows.
+      def load_relative?
+        windows? || RbConfig::CONFIG['LIBRUBY_RELATIVE'] == 'yes'
       end
 
       def exeext
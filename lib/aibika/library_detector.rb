@@ -77,9 +77,28 @@ module Aibika
       end
     end
 
+    # Shared objects mapped into the process on POSIX hosts (Linux)
+    def self.loaded_shared_objects
+      return [] unless File.readable?('/proc/self/maps')
+
+      paths = File.readlines('/proc/self/maps').map { |line| line.split(' ', 6)[5].to_s.strip }
+      paths = paths.select { |path| path.start_with?('/') && path =~ /\.so(\.[\d.]+)?\z/ }
+      paths.uniq.map { |path| Aibika.Pathname(path) }
+    end
+
     def self.detect_dlls
-      loaded = loaded_dlls
       exec_prefix = Host.exec_prefix
+      unless Host.windows?
+        # Extensions are packaged as features, and the mapped Ruby
+        # library is the versioned file that its soname links to
+        features = $LOADED_FEATURES.map { |feature| Aibika.Pathname(feature) }
+        return loaded_shared_objects.select do |path|
+          path.subpath?(exec_prefix) && !features.include?(path) &&
+            !(Host.libruby_so && path.basename.to_s.start_with?(Host.libruby_so.to_s))
+        end
+      end
+
+      loaded = loaded_dlls
       loaded.select do |path|
         path.subpath?(exec_prefix) && path.basename.ext?('.dll') && path.basename != Host.libruby_so
       end
@@ -0,0 +1,321 @@
+# frozen_string_literal: true
+
+require 'digest/sha2'
+require 'etc'
+
+module Aibika
+  # Compresses the opcode stream in independent blocks. Each block is
+  # piped through its own lzma.exe process, so several blocks are
+  # compressed in parallel, and the compressed blocks are written to
+  # the executable in order as OP_DECOMPRESS_LZMA opcodes. No temporary
+  # files are used.
+  #
+  # With a build cache, blocks are looked up by the digest of their
+  # content and the compression settings, and blocks that are unchanged
+  # since a previous build are reused as is.
+  #
+  # Opcodes for content that does not compress (see incompressible?)
+  # can be stored uncompressed between the blocks instead, so that the
+  # stub writes them straight from the mapped executable.
+  #
+  # A block with files for the shared store is preceded by a list of
+  # those files, so that the stub can link them from the store and
+  # skip the block.
+  #
+  # The content of large files is aligned in the block, with padding
+  # before and after it, so that the POSIX stub can map the output file
+  # there and decode into it (see write_file).
+  #
+  # With a shared dictionary (see BlockDictionary), the blocks are held
+  # until the whole payload has been seen and the dictionary has been
+  # trained from it. The dictionary is stored once, compressed, and
+  # each block is compressed as the continuation of it: the compressed
+  # block starts with the same bytes as the compressed dictionary, so
+  # only the length of that common prefix is written with the block.
+  # The stub decodes the dictionary once and starts each block from a
+  # copy of its decoder's state.
+  class LzmaCompressor
+    # Offset and size of the uncompressed size field in the LZMA header
+    UNPACKSIZE_OFFSET = 5
+    UNPACKSIZE_SIZE = 8
+    HEADER_SIZE = UNPACKSIZE_OFFSET + UNPACKSIZE_SIZE
+
+    # A block found in the build cache
+    CachedBlock = Struct.new(:value)
+    # Opcodes written to the executable uncompressed
+    StoredData = Struct.new(:value)
+    # A block held until the shared dictionary is trained
+    HeldBlock = Struct.new(:value)
+
+    # Files smaller than this are always compressed
+    STORE_MIN_SIZE = 16 * 1024
+    # Size of each of the samples that the entropy is estimated from
+    STORE_SAMPLE_SIZE = 16 * 1024
+    # Entropy (bits per byte) above which content is stored uncompressed
+    STORE_ENTROPY = 7.95
+
+    # Files from this size are aligned for the stub to decode into
+    MAP_MIN_SIZE = 1024 * 1024
+    # Alignment of their content in the block, a multiple of the page
+    # size of the supported systems
+    MAP_ALIGN = 64 * 1024
+
+    # Uncompressed and compressed size of each block written, in order
+    attr_reader :data_size, :compressed_size, :block_sizes, :profile
+
+    # With profile 'auto', the profile is chosen by the target metric
+    # once the first sample of the payload has been collected.
+    def initialize(out, threads: nil, profile: nil, target: nil, cache: nil, dictionary: false)
+      @out = out
+      @threads = [threads || Etc.nprocessors, 1].max
+      @profile = CompressionProfile[profile || CompressionProfile::DEFAULT] unless profile == 'auto'
+      @target = target
+      @cache = cache
+      @block = new_block
+      @jobs = []
+      @data_size = 0
+      @compressed_size = 0
+      @max_block_size = 0
+      @cached_blocks = 0
+      @blocks = 0
+      @block_sizes = []
+      @stored = []
+      @stored_size = 0
+      @shared_files = []
+      return unless dictionary
+
+      @trainer = BlockDictionary.new
+      @held = []
+    end
+
+    # Estimates the byte entropy of samples from the start, middle and
+    # end of the data. Already compressed content (archives, images,
+    # fonts) is close to 8 bits per byte and gains nothing from LZMA.
+    def self.incompressible?(data)
+      return false if data.bytesize < STORE_MIN_SIZE
+
+      samples = [0, (data.bytesize - STORE_SAMPLE_SIZE) / 2, data.bytesize - STORE_SAMPLE_SIZE].uniq.map do |offset|
+        data.byteslice([offset, 0].max, STORE_SAMPLE_SIZE)
+      end.join
+      counts = samples.unpack('C*').tally.values
+      entropy = counts.sum { |count| -count * Math.log2(count.fdiv(samples.bytesize)) } / samples.bytesize
+      entropy > STORE_ENTROPY
+    end
+
+    # Appends an opcode with its arguments. Blocks are only split
+    # between opcodes, never inside one.
+    def write(*parts)
+      parts.each { |part| @block << part }
+      choose_profile if @profile.nil? && @block.bytesize >= CompressionProfile::SAMPLE_SIZE
+      flush if @profile && @block.bytesize >= @profile.block_size
+    end
+
+    # Appends an OP_CREATE_FILE or OP_CREATE_FILE_BCJ opcode (header)
+    # with the content of the file. Content of large files starts at a
+    # multiple of MAP_ALIGN in the block, and the next opcode does too,
+    # so that the pages that hold it hold nothing else.
+    def write_file(header, data)
+      return write(header, data) if Host.windows? || data.bytesize < MAP_MIN_SIZE
+
+      before = padding(@block.bytesize, header.bytesize)
+      after = padding(@block.bytesize + before.bytesize + header.bytesize + data.bytesize)
+      write(before, header, data, after)
+    end
+
+    def <<(part)
+      write(part)
+      self
+    end
+
+    # Adds a file of the shared store to the list for the current block
+    def link_shared(path, digest)
+      @shared_files << [path, digest].pack('Z*Z*')
+    end
+
+    # Appends an opcode that is written uncompressed. It follows the
+    # block that is being collected, which contains any directories
+    # that it depends on.
+    def store(*parts)
+      data = parts.join
+      @stored_size += data.bytesize
+      if @block.empty?
+        queue(StoredData.new(data))
+      else
+        @stored << StoredData.new(data)
+      end
+    end
+
+    # Appends an opcode that is written uncompressed. Unlike store, the
+    # current block is terminated first, so the opcode stays in order
+    # with the opcodes written before it.
+    def write_uncompressed(*parts)
+      flush
+      queue(StoredData.new(parts.join))
+    end
+
+    # Number of the block that the opcodes written next go into
+    def block_index
+      @blocks
+    end
+
+    # Terminates the current block and hands it to a compressor process.
+    def flush
+      return if @block.empty?
+
+      choose_profile if @profile.nil?
+      @block << [AibikaBuilder::OP_END].pack('V')
+      unless @shared_files.empty?
+        queue(StoredData.new([AibikaBuilder::OP_LINK_SHARED_FILES, @shared_files.size].pack('VV') + @shared_files.join))
+        @shared_files.clear
+      end
+      if @held
+        @trainer.add(@block)
+        queue(HeldBlock.new(@block))
+      else
+        queue(cached_block(@block) || compress(@block))
+      end
+      @blocks += 1
+      @max_block_size = [@max_block_size, @block.bytesize].max
+      @block = new_block
+      @stored.each { |job| queue(job) }
+      @stored.clear
+    end
+
+    def close
+      flush
+      compress_held if @held
+      write_block(@jobs.shift) until @jobs.empty?
+      Aibika.msg "Reused #{@cached_blocks} of #{@blocks} blocks from build cache" if @cache
+      Aibika.msg "Compressed #{@data_size} bytes to #{@compressed_size} bytes"
+      Aibika.msg "Stored #{@stored_size} bytes uncompressed" if @stored_size.positive?
+      return unless @profile
+
+      Aibika.msg "Compression profile #{@profile.name}: expected decode time " \
+                 "#{(@profile.decode_time(@data_size) * 1000).round} ms, decoder memory " \
+                 "#{@profile.decoder_memory(@max_block_size + (@dictionary&.bytesize || 0))} bytes"
+    end
+
+    private
+
+    # Hands a job to the writer, waiting for the oldest jobs to finish
+    # while too many are in progress
+    def queue(job)
+      return @held << job if @held
+
+      write_block(@jobs.shift) while @jobs.size >= @threads
+      @jobs << job
+    end
+
+    def new_block
+      String.new(encoding: Encoding::BINARY)
+    end
+
+    # OP_PADDING to write at offset in the block, so that it and the
+    # following bytes end at a multiple of MAP_ALIGN
+    def padding(offset, following = 0)
+      size = -(offset + 8 + following) % MAP_ALIGN
+      [AibikaBuilder::OP_PADDING, size].pack('VV') + ("\0" * size)
+    end
+
+    # Trains the shared dictionary once every block has been collected,
+    # writes it, and compresses the held blocks. A single block gains
+    # nothing from it, and without content that recurs across blocks
+    # there is no dictionary; the blocks are compressed alone then.
+    def compress_held
+      jobs = @held
+      @held = nil
+      @dictionary = @trainer.train if @blocks > 1
+      if @dictionary
+        compressed = @profile.run_lzma(%w[e -si -so] + @profile.switches(@dictionary.bytesize + @profile.block_size),
+                                       @dictionary)
+        @reference = compressed.byteslice(HEADER_SIZE..)
+        # The stub decodes it with the properties that the blocks have
+        stream = compressed.byteslice(0, UNPACKSIZE_OFFSET) + @reference
+        queue(StoredData.new([AibikaBuilder::OP_LZMA_DICTIONARY, @dictionary.bytesize,
+                              stream.bytesize].pack('VVV') + stream))
+        @compressed_size += stream.bytesize
+        Aibika.msg "Priming blocks with a shared dictionary of #{@dictionary.bytesize} bytes " \
+                   "(#{@reference.bytesize} bytes compressed)"
+      end
+      jobs.each do |job|
+        queue(job.is_a?(HeldBlock) ? cached_block(job.value) || compress(job.value) : job)
+      end
+    end
+
+    def choose_profile
+      @profile = CompressionProfile.auto(@block, @target)
+      Aibika.msg "Selected compression profile #{@profile.name} (target: #{@target || 'startup'})"
+    end
+
+    # Identifies the compressor and its settings, so that cached blocks
+    # are not reused after either changes.
+    def settings
+      @settings ||= "lzma.exe #{Digest::SHA256.file(Aibika.lzmapath.to_s).hexdigest} #{@profile}" +
+                    (@dictionary ? " dictionary #{Digest::SHA256.hexdigest(@dictionary)}" : '')
+    end
+
+    def cached_block(data)
+      return unless @cache
+
+      @block_key = @cache.key(settings, data)
+      compressed = @cache.fetch('lzma', @block_key)
+      return unless compressed
+
+      @cached_blocks += 1
+      CachedBlock.new([data.bytesize, compressed])
+    end
+
+    def compress(data)
+      Aibika.verbose_msg "Compressing block of #{data.bytesize} bytes"
+      key = @block_key
+      profile = @profile
+      dictionary = @dictionary
+      Thread.new do
+        compressed = run_lzma(profile, data, dictionary)
+        @cache&.store('lzma', key, compressed)
+        [data.bytesize, compressed]
+      end
+    end
+
+    # Compresses data alone or, primed, as the continuation of the
+    # dictionary
+    def run_lzma(profile, data, dictionary = nil)
+      input = data
+      window = data.bytesize
+      if dictionary
+        # The same settings as the dictionary, or the streams part early
+        input = dictionary + data
+        window = [input.bytesize, dictionary.bytesize + profile.block_size].max
+      end
+      compressed = profile.run_lzma(%w[e -si -so] + profile.switches(window), input)
+
+      # The size is unknown to lzma when streaming from stdin
+      compressed[UNPACKSIZE_OFFSET, UNPACKSIZE_SIZE] = [input.bytesize].pack('Q<')
+      dictionary ? primed(compressed) : compressed
+    end
+
+    # Replaces the bytes that a block compressed after the dictionary
+    # shares with the compressed dictionary alone by their number
+    def primed(compressed)
+      stream = compressed.byteslice(HEADER_SIZE..)
+      shared = 0
+      limit = [stream.bytesize, @reference.bytesize].min
+      shared += 1 while shared < limit && stream.getbyte(shared) == @reference.getbyte(shared)
+      compressed.byteslice(0, HEADER_SIZE) + [shared].pack('V') + stream.byteslice(shared..)
+    end
+
+    def write_block(job)
+      if job.is_a?(StoredData)
+        @out.write(job.value)
+        return
+      end
+
+      size, compressed = job.value
+      opcode = @dictionary ? AibikaBuilder::OP_DECOMPRESS_LZMA_PRIMED : AibikaBuilder::OP_DECOMPRESS_LZMA
+      @out.write([opcode, compressed.bytesize].pack('VV'), compressed)
+      @data_size += size
+      @compressed_size += compressed.bytesize
+      @block_sizes << [size, compressed.bytesize]
+    end
+  end
+end
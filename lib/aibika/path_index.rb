@@ -0,0 +1,56 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Prefix tree of directories, keyed by their path components, that
+  # finds the directories containing a path in one walk of its
+  # components, instead of testing Pathname#subpath? against each
+  # directory. Containment follows the rules of subpath?: it ignores
+  # case, and a directory does not contain itself.
+  class PathIndex
+    Node = Struct.new(:children, :entry)
+
+    # dirs maps each directory to the value that lookups return for it
+    def initialize(dirs = {})
+      @root = Node.new({}, nil)
+      dirs.each { |dir, value| add(dir, value) }
+    end
+
+    # Adds a directory. Of directories that only differ in case, the
+    # first one added is kept.
+    def add(dir, value = dir)
+      node = components(dir).inject(@root) { |parent, part| parent.children[part] ||= Node.new({}, nil) }
+      node.entry ||= [dir, value]
+      self
+    end
+
+    # The [directory, value] pairs of the directories that contain
+    # path, the outermost first
+    def lookup_all(path)
+      node = @root
+      found = []
+      components(path)[0...-1].each do |part|
+        node = node.children[part]
+        break unless node
+
+        found << node.entry if node.entry
+      end
+      found
+    end
+
+    # The [directory, value] pair of the innermost directory that
+    # contains path, or nil
+    def lookup(path)
+      lookup_all(path).last
+    end
+
+    def include?(path)
+      !lookup(path).nil?
+    end
+
+    private
+
+    def components(path)
+      Aibika.Pathname(path).to_posix.downcase.split('/', -1)
+    end
+  end
+end
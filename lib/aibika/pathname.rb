@@ -23,8 +23,9 @@ module Aibika
       @path = path&.encode('UTF-8')
     end
 
+    # Path as the stub expects it: with backslashes on Windows hosts
     def to_native
-      @path.tr File::SEPARATOR, File::ALT_SEPARATOR
+      Host.windows? ? @path.tr(File::SEPARATOR, File::ALT_SEPARATOR) : to_posix
     end
 
     def to_posix
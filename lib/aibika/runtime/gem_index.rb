@@ -0,0 +1,56 @@
+# frozen_string_literal: true
+
+# Required by executables built with Aibika (ruby -raibika/runtime/gem_index)
+# before the application script is run. It is not used by the builder itself.
+# It does not define Aibika, which scripts look for to detect the builder.
+module AibikaRuntime
+  # Installs the RubyGems specification index prepared at build time,
+  # so that RubyGems does not have to read and evaluate every packaged
+  # .gemspec file when it first looks up a gem.
+  module GemIndex
+    INDEX_FILE = File.join(__dir__, 'gem_index.dat')
+
+    class << self
+      attr_reader :specs
+
+      def loaded?
+        !@specs.nil?
+      end
+
+      def load(path = INDEX_FILE)
+        index = File.open(path, 'rb') { |file| Marshal.load(file) }
+        specs = index[:specs].map do |loaded_from, fields|
+          spec = Gem::Specification.new
+          fields.each { |name, value| spec.instance_variable_set(name, value) }
+          spec.loaded_from = File.expand_path(loaded_from, File.dirname(path))
+          spec
+        end
+        # Specs activated while RubyGems booted take precedence
+        Gem::Specification.all = Gem.loaded_specs.values | specs
+        @specs = specs
+        activate(index[:activate])
+      rescue StandardError, LoadError
+        # Leave RubyGems to scan the specifications directories itself
+        Gem::Specification.reset if loaded?
+        @specs = nil
+      end
+
+      # Activates the gem set resolved by Bundler at build time.
+      def activate(names)
+        names.each do |name, version|
+          spec = @specs.find { |s| s.name == name && s.version.to_s == version }
+          next if spec.nil? || spec.activated?
+
+          begin
+            spec.activate
+          rescue Gem::LoadError
+            # Conflicts are left for Bundler or RubyGems to report
+            next
+          end
+        end
+      end
+    end
+  end
+end
+
+AibikaRuntime::GemIndex.load if defined?(Gem) && File.exist?(AibikaRuntime::GemIndex::INDEX_FILE)
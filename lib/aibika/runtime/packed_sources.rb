@@ -0,0 +1,167 @@
+# frozen_string_literal: true
+
+# Required by executables built with Aibika --pack-sources
+# (RUBYOPT=-raibika/runtime/packed_sources) before the application
+# script is run. It is not used by the builder itself. It does not
+# define Aibika, which scripts look for to detect the builder.
+
+require 'monitor'
+
+module AibikaRuntime
+  # Serves the Ruby files that the builder packed into one archive
+  # (sources.pak next to this file) instead of extracting each of them.
+  #
+  # require, require_relative and load find packed files through the
+  # index of the archive, under the paths that they would have been
+  # extracted to, so __FILE__ and __dir__ are unchanged and files next
+  # to them are read from disk as usual. File.file?, File.exist?,
+  # File.readable? and File.read see packed files too, so that RubyGems
+  # activates gems whose files are packed.
+  module PackedSources
+    ARCHIVE = File.join(__dir__, 'sources.pak')
+    # Extensions of features that are never packed
+    NATIVE_EXTENSIONS = %w[.so .o .dll .bundle].freeze
+
+    class << self
+      # Reads the index: the size of the header, then the header
+      # (Marshal) with the location of the archive relative to the
+      # installation directory and the offset and size of each file
+      # relative to the end of the header.
+      def load_index(path = ARCHIVE)
+        @io = File.open(path, 'rb')
+        size = @io.read(4).unpack1('V')
+        header = Marshal.load(@io.read(size))
+        root = File.dirname(path).delete_suffix("/#{header[:dir]}")
+        @files = header[:files].to_h do |name, (offset, length)|
+          ["#{root}/#{name}", [4 + size + offset, length]]
+        end
+        @loaded = {}
+        @lock = Monitor.new
+      end
+
+      def include?(path)
+        path = path.to_path if path.respond_to?(:to_path)
+        return false unless path.is_a?(String)
+
+        @files.key?(path) || (!File.absolute_path?(path) && @files.key?(File.expand_path(path)))
+      end
+
+      def read(path)
+        path = File.expand_path(path)
+        offset, length = @files.fetch(path)
+        @lock.synchronize do
+          @io.seek(offset)
+          @io.read(length).force_encoding(Encoding::UTF_8)
+        end
+      end
+
+      # Returns the packed file that require would load for the
+      # feature, or nil
+      def resolve(feature)
+        feature = feature.to_path if feature.respond_to?(:to_path)
+        feature = feature.to_str
+        return if NATIVE_EXTENSIONS.include?(File.extname(feature))
+
+        name = feature.end_with?('.rb') ? feature : "#{feature}.rb"
+        if File.absolute_path?(name) || name.start_with?('./', '../', '~')
+          path = File.expand_path(name)
+          return @files.key?(path) ? path : nil
+        end
+
+        $LOAD_PATH.each do |dir|
+          path = "#{dir.to_s.delete_suffix('/')}/#{name}"
+          return path if @files.key?(path)
+        end
+        nil
+      end
+
+      # Loads a packed feature like require. Returns nil when the
+      # feature is not packed.
+      def require(feature)
+        path = resolve(feature)
+        return unless path
+
+        @lock.synchronize do
+          return false if @loaded[path]
+
+          @loaded[path] = true
+          $LOADED_FEATURES << path
+          begin
+            evaluate(path)
+          rescue Exception # rubocop:disable Lint/RescueException
+            @loaded.delete(path)
+            $LOADED_FEATURES.delete(path)
+            raise
+          end
+        end
+        true
+      end
+
+      def evaluate(path)
+        RubyVM::InstructionSequence.compile(read(path), path, path, 1).eval
+      end
+    end
+
+    # Sees packed files as regular files
+    module FileMethods
+      def file?(path)
+        super || PackedSources.include?(path)
+      end
+
+      def exist?(path)
+        super || PackedSources.include?(path)
+      end
+
+      def readable?(path)
+        super || PackedSources.include?(path)
+      end
+
+      def read(path, *args, **kwargs)
+        return super if !PackedSources.include?(path) || !args.empty? || !kwargs.empty?
+
+        PackedSources.read(path)
+      end
+    end
+  end
+end
+
+AibikaRuntime::PackedSources.load_index
+File.singleton_class.prepend(AibikaRuntime::PackedSources::FileMethods)
+
+module Kernel
+  alias aibika_packed_sources_require require
+  alias aibika_packed_sources_load load
+  private :aibika_packed_sources_require, :aibika_packed_sources_load
+
+  def require(feature)
+    loaded = AibikaRuntime::PackedSources.require(feature)
+    return loaded unless loaded.nil?
+
+    begin
+      aibika_packed_sources_require(feature)
+    rescue LoadError
+      # RubyGems may have activated a gem whose files are packed
+      loaded = AibikaRuntime::PackedSources.require(feature)
+      raise if loaded.nil?
+
+      loaded
+    end
+  end
+
+  def require_relative(feature)
+    base = caller_locations(1, 1).first&.absolute_path
+    raise LoadError, "cannot infer basepath for #{feature}" unless base
+
+    require File.expand_path(feature, File.dirname(base))
+  end
+
+  def load(file, wrap = false)
+    path = AibikaRuntime::PackedSources.resolve(file) if !wrap && file.to_s.end_with?('.rb')
+    return aibika_packed_sources_load(file, wrap) unless path
+
+    AibikaRuntime::PackedSources.evaluate(path)
+    true
+  end
+
+  private :require, :require_relative, :load
+end
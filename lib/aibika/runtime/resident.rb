@@ -0,0 +1,203 @@
+# frozen_string_literal: true
+
+# Required by executables built with Aibika --resident
+# (ruby -raibika/runtime/resident) before the application script is run.
+# It is not used by the builder itself. It does not define Aibika, which
+# scripts look for to detect the builder.
+
+require 'io/wait'
+require 'socket'
+
+module AibikaRuntime
+  # Server that keeps the extracted files and a Ruby with the
+  # application's libraries loaded, and runs the application in a
+  # forked worker for each later run of the executable.
+  #
+  # The stub (stub_posix.c) passes the socket, the installation
+  # directory and the idle timeout through the environment when no
+  # server is running yet. It then runs the script as usual, and this
+  # file starts the server first. Later stubs connect to the socket and
+  # send the command line, environment and working directory of the
+  # program, followed by their standard input, output and error, and
+  # wait for the exit status.
+  module Resident
+    PRELOAD_FILE = File.join(__dir__, 'resident.dat')
+    # Environment of the bundle, which overrides that of the stub
+    BUNDLE_ENV = %w[RUBYOPT RUBYLIB GEM_PATH LD_LIBRARY_PATH].freeze
+
+    class << self
+      # Binds the socket and forks the server, unless another one was
+      # started in the meantime. A socket left behind by a server that
+      # was killed is replaced.
+      def start
+        path = ENV.delete('AIBIKA_RESIDENT_SOCKET')
+        idle = Integer(ENV.delete('AIBIKA_RESIDENT_IDLE') || 300)
+        root = ENV.delete('AIBIKA_RESIDENT_ROOT')
+        cleanup = ENV.delete('AIBIKA_RESIDENT_CLEANUP')
+        return unless path && root
+
+        server = bind(path)
+        return unless server
+
+        pid = fork do
+          Process.setsid
+          Dir.chdir('/')
+          [$stdin, $stdout, $stderr].each { |io| io.reopen(File::NULL, io == $stdin ? 'r' : 'w') }
+          Server.new(server, path: path, root: root, idle: idle, cleanup: cleanup).run
+        end
+        server.close
+        Process.detach(pid)
+      rescue NotImplementedError, SystemCallError
+        # The program runs without a server
+        File.unlink(path) if server && File.socket?(path)
+      end
+
+      def bind(path)
+        server = UNIXServer.new(path)
+        File.chmod(0o600, path)
+        server
+      rescue Errno::EADDRINUSE
+        begin
+          UNIXSocket.new(path).close
+          nil
+        rescue Errno::ECONNREFUSED, Errno::ENOENT
+          File.unlink(path) if File.socket?(path)
+          retry
+        end
+      end
+    end
+
+    # The resident server process
+    class Server
+      def initialize(server, path:, root:, idle:, cleanup:)
+        @server = server
+        @path = path
+        @root = root
+        @idle = idle
+        @cleanup = cleanup
+        @bundle_env = ENV.to_h.slice(*BUNDLE_ENV)
+        @workers = {}
+        @lock = Mutex.new
+      end
+
+      def run
+        preload
+        loop do
+          ready = IO.select([@server], nil, nil, @idle)
+          if ready
+            serve(@server.accept)
+          elsif @lock.synchronize { @workers.empty? }
+            break
+          end
+        end
+        shutdown
+      end
+
+      # Loads the features that the script loaded when the executable
+      # was built, so that workers start with them loaded
+      def preload
+        return unless File.exist?(PRELOAD_FILE)
+
+        File.open(PRELOAD_FILE, 'rb') { |file| Marshal.load(file) }.each do |feature|
+          require File.join(@root, feature)
+        rescue StandardError, LoadError, NotImplementedError
+          # Left for the script to load or report
+          next
+        end
+      end
+
+      # Stops accepting runs, then serves the runs that were already
+      # waiting and removes the files once all workers are done.
+      def shutdown
+        File.unlink(@path) if File.socket?(@path)
+        loop do
+          serve(@server.accept_nonblock)
+        rescue IO::WaitReadable, Errno::EINTR
+          break
+        end
+        @server.close
+        Thread.list.each { |thread| thread.join unless thread == Thread.current }
+        return unless @cleanup
+
+        require 'fileutils'
+        FileUtils.rm_rf(@root)
+      end
+
+      def serve(client)
+        request = read_request(client)
+        pid = fork { run_worker(client, *request) }
+        request[3].each(&:close)
+        @lock.synchronize { @workers[pid] = client }
+        Thread.new { wait_worker(pid, client) }
+      rescue StandardError
+        client.close
+      end
+
+      # Reads the message of the stub (see RunResident in stub_posix.c)
+      def read_request(client)
+        length = read_exactly(client, 4).unpack1('V')
+        strings = read_exactly(client, length).split("\0", -1)
+        argv = strings.shift(Integer(strings.shift))
+        env = strings.shift(Integer(strings.shift)).to_h { |var| var.split('=', 2) }
+        cwd = strings.shift
+        _, _, _, control = client.recvmsg(1, 0, nil, scm_rights: true)
+        raise 'no standard streams received' unless control&.cmsg_is?(:SOCKET, :RIGHTS)
+
+        [argv, env, cwd, control.unix_rights]
+      end
+
+      # Reads without buffering, so that the byte carrying the standard
+      # streams is left for recvmsg
+      def read_exactly(client, size)
+        data = String.new(encoding: Encoding::BINARY)
+        data << client.sysread(size - data.bytesize) while data.bytesize < size
+        data
+      end
+
+      # Relays the exit status of the worker to the stub. If the stub
+      # goes away first (e.g. it was interrupted), the worker is
+      # interrupted too.
+      def wait_worker(pid, client)
+        watcher = Thread.new do
+          client.wait_readable
+          Process.kill(:INT, pid)
+        rescue StandardError
+          nil
+        end
+        _, status = Process.wait2(pid)
+        watcher.kill
+        code = status.exitstatus || (128 + status.termsig.to_i)
+        client.write([code].pack('l<'))
+      rescue StandardError
+        nil
+      ensure
+        client.close
+        @lock.synchronize { @workers.delete(pid) }
+      end
+
+      def run_worker(client, argv, env, cwd, streams)
+        @server.close
+        client.close
+        @workers.each_value(&:close)
+        [$stdin, $stdout, $stderr].zip(streams) { |io, stream| io.reopen(stream) }
+        streams.each(&:close)
+        ENV.replace(env.merge(@bundle_env))
+        Dir.chdir(expand(cwd))
+
+        # The first argument after the options of ruby is the script
+        args = argv.drop(1)
+        args.shift while args.first&.start_with?('-')
+        script = expand(args.shift)
+        ARGV.replace(args)
+        $PROGRAM_NAME = script
+        load script
+      end
+
+      def expand(path)
+        path.sub(/\A\|/) { @root }
+      end
+    end
+  end
+end
+
+AibikaRuntime::Resident.start if ENV['AIBIKA_RESIDENT_SOCKET']
@@ -0,0 +1,43 @@
+# frozen_string_literal: true
+
+# Packaged with every executable built with Aibika, for the application
+# to require (require 'aibika/runtime/startup_metrics'). It is not used
+# by the builder itself. It does not define Aibika, which scripts look
+# for to detect the builder.
+module AibikaRuntime
+  # Reads the metrics of the start of the executable, which the stub
+  # passes to the program in AIBIKA_STARTUP_METRICS, e.g.
+  #
+  #   decode_ms=12.5 extract_ms=48.0 files=812 bytes=24117248 cache=miss peak_kb=9120 cleanup_backlog=0
+  #
+  # decode_ms is the time spent decompressing, extract_ms the time from
+  # the start of the stub until the program is run, files and bytes what
+  # was written to disk, cache whether the extracted files were reused
+  # (none, hit, partial or miss), peak_kb the peak memory of the stub and
+  # cleanup_backlog the number of earlier extraction directories that
+  # are still waiting to be removed.
+  module StartupMetrics
+    VARIABLE = 'AIBIKA_STARTUP_METRICS'
+    INTEGERS = %i[files bytes peak_kb cleanup_backlog].freeze
+    FLOATS = %i[decode_ms extract_ms].freeze
+
+    # Returns the metrics as a Hash with Symbol keys, or nil when the
+    # program was not started by a stub. Values of keys that this
+    # version does not know are left as strings.
+    def self.parse(value = ENV.fetch(VARIABLE, nil))
+      return nil unless value
+
+      value.split.to_h do |pair|
+        key, text = pair.split('=', 2)
+        key = key.to_sym
+        if INTEGERS.include?(key)
+          [key, Integer(text, exception: false)]
+        elsif FLOATS.include?(key)
+          [key, Float(text, exception: false)]
+        else
+          [key, text]
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,45 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Archive of the Ruby files that are not extracted with
+  # --pack-sources. The executable extracts it as one file, and the
+  # loader (runtime/packed_sources.rb) serves require, require_relative
+  # and load from it.
+  #
+  # The archive is the size of the header, the header (Marshal) with
+  # the directory of the archive relative to the installation directory
+  # and the offset and size of each file by its path relative to the
+  # installation directory, then the content of the files.
+  class SourceArchive
+    # keep lists the source files (see Pathname#to_posix) that are
+    # extracted nonetheless, as Ruby loads them before the loader.
+    def initialize(keep)
+      @keep = keep
+      @files = {}
+    end
+
+    def pack?(src, tgt)
+      tgt.ext?('.rb') && !@keep.include?(Aibika.Pathname(src).expand.to_posix)
+    end
+
+    def add(tgt, data)
+      @files[tgt.to_posix] = data.b
+    end
+
+    def size
+      @files.size
+    end
+
+    # Serializes the archive, which is placed in dir
+    def to_s(dir)
+      offset = 0
+      index = @files.transform_values do |data|
+        entry = [offset, data.bytesize]
+        offset += data.bytesize
+        entry
+      end
+      header = Marshal.dump({ dir: dir.to_posix, files: index })
+      [header.bytesize].pack('V') + header + @files.values.join
+    end
+  end
+end
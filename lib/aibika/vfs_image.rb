@@ -0,0 +1,121 @@
+# frozen_string_literal: true
+
+module Aibika
+  # Image of the files that are not extracted with --vfs. The
+  # interposer preloaded into Ruby (vfs_posix.c) serves them from the
+  # executable, so only the files that the dynamic loader or the kernel
+  # reads (see materialize?) are extracted.
+  #
+  # The image is a header, a table of blocks, a table of files sorted by
+  # path, the paths, and the data. With LZMA compression, the files are
+  # grouped in path order into blocks of about BLOCK_SIZE bytes, which
+  # are compressed independently, so that opening a file decodes one
+  # block rather than the whole image. Files that do not compress (see
+  # LzmaCompressor.incompressible?) are stored uncompressed.
+  class VfsImage
+    MAGIC = 'AVFS'
+    BLOCK_SIZE = 256 * 1024
+    # Block number of files stored uncompressed
+    RAW = 0xFFFFFFFF
+
+    HEADER_SIZE = 16
+    BLOCK_ENTRY_SIZE = 12
+    FILE_ENTRY_SIZE = 20
+
+    # Files that must exist on disk: shared objects and executables,
+    # which are loaded by the dynamic loader or the kernel rather than
+    # read by the program.
+    def self.materialize?(data)
+      data.start_with?("\x7FELF".b, '#!')
+    end
+
+    def initialize(lzma: false, profile: nil, target: nil)
+      @lzma = lzma
+      @profile = profile
+      @target = target
+      @files = {}
+    end
+
+    def add(tgt, data, mode = 0o644)
+      @files[tgt.to_posix] = [data.b, mode]
+    end
+
+    def empty?
+      @files.empty?
+    end
+
+    def to_s
+      names = @files.keys.sort
+      entries, blocks = layout(names)
+      strings = names.map { |name| "#{name}\0" }.join
+      offset = HEADER_SIZE + (blocks.size * BLOCK_ENTRY_SIZE) + (names.size * FILE_ENTRY_SIZE) + strings.bytesize
+
+      # The data follows the tables, so offsets are known once every
+      # block has been compressed
+      data = String.new(encoding: Encoding::BINARY)
+      block_table = blocks.map do |block|
+        entry = [offset + data.bytesize, block[:data].bytesize, block[:size]].pack('VVV')
+        data << block[:data]
+        entry
+      end
+      name_offset = 0
+      file_table = names.zip(entries).map do |name, (block, position, size, mode)|
+        position += offset + data.bytesize if block == RAW
+        entry = [name_offset, block, position, size, mode].pack('VVVVV')
+        name_offset += name.bytesize + 1
+        entry
+      end
+      raw = names.zip(entries).select { |_, entry| entry[0] == RAW }.map { |name, _| @files[name][0] }
+
+      Aibika.msg "Virtual file system: #{names.size} files in #{blocks.size} blocks"
+      [MAGIC, names.size, blocks.size, strings.bytesize].pack('a4VVV') +
+        block_table.join + file_table.join + strings + data + raw.join
+    end
+
+    private
+
+    # Assigns each file to a block, or to the uncompressed data. Returns
+    # the entries of the files (block, offset, size, mode; the offset of
+    # uncompressed files is relative to their data) and the blocks.
+    def layout(names)
+      blocks = []
+      current = nil
+      raw_size = 0
+      entries = names.map do |name|
+        data, mode = @files[name]
+        if !@lzma || LzmaCompressor.incompressible?(data)
+          raw_size += data.bytesize
+          next [RAW, raw_size - data.bytesize, data.bytesize, mode]
+        end
+
+        if current.nil? || current.bytesize >= BLOCK_SIZE
+          current = String.new(encoding: Encoding::BINARY)
+          blocks << current
+        end
+        current << data
+        [blocks.size - 1, current.bytesize - data.bytesize, data.bytesize, mode]
+      end
+      [entries, compress(blocks)]
+    end
+
+    # Compresses the blocks in parallel, like LzmaCompressor
+    def compress(blocks)
+      return [] if blocks.empty?
+
+      profile = if @profile == 'auto'
+                  CompressionProfile.auto(blocks.first, @target)
+                else
+                  CompressionProfile[@profile || CompressionProfile::DEFAULT]
+                end
+      blocks.each_slice(Etc.nprocessors).flat_map do |slice|
+        slice.map do |block|
+          Thread.new do
+            compressed = profile.run_lzma(%w[e -si -so] + profile.switches(block.bytesize), block)
+            compressed[LzmaCompressor::UNPACKSIZE_OFFSET, LzmaCompressor::UNPACKSIZE_SIZE] = [block.bytesize].pack('Q<')
+            { data: compressed, size: block.bytesize }
+          end
+        end.map(&:value)
+      end
+    end
+  end
+end
@@ -0,0 +1,138 @@
+/*
+  Read Strategy Benchmark (POSIX)
+
+  Runs an executable built by Aibika with each read strategy (see
+  payload_reader.h), with large files decoded into a mapping of the
+  output file (mmap) or written (write, AIBIKA_MAP_OUTPUT=0), and with
+  the executable in the page cache (warm) and dropped from it (cold).
+  Reports the wall time, the peak resident memory and the page faults
+  of the runs.
+
+  Usage: bench_read EXECUTABLE [RUNS]
+
+  The payload file of a --payload-file build (.pak next to the
+  executable) is dropped from the page cache with it. Dropping needs
+  no privileges, but only works for pages that no other process maps.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* Strategies[] = { "auto", "mmap", "stream", "direct" };
+static const char* Outputs[] = { "mmap", "write" };
+
+static void DropFromCache(const char* FileName)
+{
+   int File = open(FileName, O_RDONLY);
+   if (File < 0)
+      return;
+   fdatasync(File);
+   posix_fadvise(File, 0, 0, POSIX_FADV_DONTNEED);
+   close(File);
+}
+
+static void DropPayload(const char* Executable)
+{
+   char PayloadFileName[4096];
+   snprintf(PayloadFileName, sizeof(PayloadFileName), "%s", Executable);
+   char* Extension = strrchr(PayloadFileName, '.');
+   if (!Extension || strchr(Extension, '/'))
+      Extension = PayloadFileName + strlen(PayloadFileName);
+   snprintf(Extension, sizeof(PayloadFileName) - (Extension - PayloadFileName), ".pak");
+   DropFromCache(Executable);
+   DropFromCache(PayloadFileName);
+}
+
+static double Now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs the executable once, returns 0 on failure */
+static int Run(const char* Executable, const char* Strategy, const char* Output, double* Seconds,
+               struct rusage* Usage)
+{
+   double Start = Now();
+   pid_t Child = fork();
+   if (Child < 0)
+      return 0;
+   if (Child == 0)
+   {
+      int Null = open("/dev/null", O_WRONLY);
+      if (Null >= 0)
+      {
+         dup2(Null, STDOUT_FILENO);
+         close(Null);
+      }
+      setenv("AIBIKA_READ_STRATEGY", Strategy, 1);
+      setenv("AIBIKA_MAP_OUTPUT", strcmp(Output, "write") == 0 ? "0" : "1", 1);
+      execl(Executable, Executable, (char*)NULL);
+      _exit(127);
+   }
+
+   int Status;
+   if (wait4(Child, &Status, 0, Usage) != Child)
+      return 0;
+   *Seconds = Now() - Start;
+   return WIFEXITED(Status) && WEXITSTATUS(Status) != 127;
+}
+
+int main(int argc, char** argv)
+{
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: %s EXECUTABLE [RUNS]\n", argv[0]);
+      return 1;
+   }
+   const char* Executable = argv[1];
+   int Runs = argc > 2 ? atoi(argv[2]) : 5;
+   if (Runs < 1)
+      Runs = 1;
+
+   printf("%-8s %-6s %-5s %10s %10s %10s %10s\n", "strategy", "output", "cache", "time (ms)", "rss (KB)", "major",
+          "minor");
+   size_t i, j;
+   int Cold;
+   for (i = 0; i < sizeof(Strategies) / sizeof(Strategies[0]); i++)
+   {
+      for (j = 0; j < sizeof(Outputs) / sizeof(Outputs[0]); j++)
+      {
+         for (Cold = 1; Cold >= 0; Cold--)
+         {
+            double Total = 0;
+            long MaxRss = 0, Major = 0, Minor = 0;
+            int Iteration;
+            for (Iteration = 0; Iteration < Runs; Iteration++)
+            {
+               if (Cold)
+                  DropPayload(Executable);
+               double Seconds;
+               struct rusage Usage;
+               if (!Run(Executable, Strategies[i], Outputs[j], &Seconds, &Usage))
+               {
+                  fprintf(stderr, "Failed to run %s\n", Executable);
+                  return 1;
+               }
+               Total += Seconds;
+               if (Usage.ru_maxrss > MaxRss)
+                  MaxRss = Usage.ru_maxrss;
+               Major += Usage.ru_majflt;
+               Minor += Usage.ru_minflt;
+            }
+            printf("%-8s %-6s %-5s %10.1f %10ld %10ld %10ld\n", Strategies[i], Outputs[j], Cold ? "cold" : "warm",
+                   Total * 1000 / Runs, MaxRss, Major / Runs, Minor / Runs);
+         }
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,354 @@
+/*
+  Payload Reader (POSIX)
+
+  See payload_reader.h.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+#include "payload_reader.h"
+
+/* Size of the reads of the stream and direct strategies */
+#define READ_CHUNK (4 << 20)
+/* How far the helper thread reads ahead of the processing */
+#define READ_AHEAD_LIMIT (64 << 20)
+/* How far ahead of the processing the mmap strategy asks for pages */
+#define MMAP_WINDOW (8 << 20)
+/* Files up to this size are mapped by the auto strategy */
+#define AUTO_MMAP_SIZE (16 << 20)
+/* Alignment of the reads, for O_DIRECT */
+#define READ_ALIGN 4096
+
+static size_t AlignDown(size_t Value, size_t Alignment)
+{
+   return Value & ~(Alignment - 1);
+}
+
+ReadStrategy ReaderStrategyNamed(const char* Name)
+{
+   if (Name && strcmp(Name, "mmap") == 0)
+      return READ_MMAP;
+   if (Name && strcmp(Name, "stream") == 0)
+      return READ_STREAM;
+   if (Name && strcmp(Name, "direct") == 0)
+      return READ_DIRECT;
+   return READ_AUTO;
+}
+
+const char* ReaderStrategyName(ReadStrategy Strategy)
+{
+   switch (Strategy)
+   {
+   case READ_MMAP:
+      return "mmap";
+   case READ_STREAM:
+      return "stream";
+   case READ_DIRECT:
+      return "direct";
+   default:
+      return "auto";
+   }
+}
+
+/** Offset of the last page read at once, with the signature */
+static size_t TailOffset(PayloadReader* Reader)
+{
+   return AlignDown(Reader->Size >= 8 ? Reader->Size - 8 : 0, READ_ALIGN);
+}
+
+/**
+   Whether most of the file is in the page cache, so that mapping it
+   causes no reads.
+*/
+static int MostlyCached(PayloadReader* Reader)
+{
+#ifdef __linux__
+   long PageSize = sysconf(_SC_PAGESIZE);
+   size_t Pages = (Reader->Size + PageSize - 1) / PageSize;
+   void* Mapping = mmap(NULL, Reader->Size, PROT_READ, MAP_SHARED, Reader->File, 0);
+   if (Mapping == MAP_FAILED)
+      return 1;
+   unsigned char* Resident = malloc(Pages);
+   size_t Count = 0, i;
+   if (Resident && mincore(Mapping, Reader->Size, Resident) == 0)
+   {
+      for (i = 0; i < Pages; i++)
+         Count += Resident[i] & 1;
+   }
+   else
+   {
+      Count = Pages;
+   }
+   free(Resident);
+   munmap(Mapping, Reader->Size);
+   return Count * 2 >= Pages;
+#else
+   (void)Reader;
+   return 1;
+#endif
+}
+
+/** Whether the file is on a network or user space file system */
+static int RemoteFile(PayloadReader* Reader)
+{
+#ifdef __linux__
+   struct statfs fs;
+   if (fstatfs(Reader->File, &fs) != 0)
+      return 0;
+   switch ((unsigned long)fs.f_type)
+   {
+   case 0x6969:     /* NFS */
+   case 0x517B:     /* SMB */
+   case 0xFF534D42: /* CIFS */
+   case 0xFE534D42: /* SMB2 */
+   case 0x65735546: /* FUSE */
+   case 0x01021997: /* 9P */
+      return 1;
+   }
+#else
+   (void)Reader;
+#endif
+   return 0;
+}
+
+static ReadStrategy ChooseStrategy(PayloadReader* Reader)
+{
+   if (RemoteFile(Reader))
+      return READ_STREAM;
+   if (Reader->Size <= AUTO_MMAP_SIZE || MostlyCached(Reader))
+      return READ_MMAP;
+   return READ_STREAM;
+}
+
+/** Bypasses the page cache for the reads of the file */
+static int SetDirect(PayloadReader* Reader, int Enable)
+{
+#if defined(O_DIRECT)
+   int Flags = fcntl(Reader->File, F_GETFL);
+   return Flags >= 0 && fcntl(Reader->File, F_SETFL, Enable ? Flags | O_DIRECT : Flags & ~O_DIRECT) == 0;
+#elif defined(F_NOCACHE)
+   return fcntl(Reader->File, F_NOCACHE, Enable) == 0;
+#else
+   (void)Reader;
+   (void)Enable;
+   return 0;
+#endif
+}
+
+/** Reads the bytes from From to To (or the end of the file) */
+static int ReadRange(PayloadReader* Reader, size_t From, size_t To)
+{
+   while (From < To)
+   {
+      size_t Length = To - From < READ_CHUNK ? To - From : READ_CHUNK;
+      ssize_t n = pread(Reader->File, Reader->Base + From, Length, From);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         return 0;
+      if (n == 0)
+         break;
+      From += n;
+   }
+   return 1;
+}
+
+int ReaderOpen(PayloadReader* Reader, const char* FileName, ReadStrategy Strategy)
+{
+   memset(Reader, 0, sizeof(*Reader));
+   Reader->File = open(FileName, O_RDONLY | O_CLOEXEC);
+   if (Reader->File < 0)
+      return 0;
+
+   struct stat st;
+   if (fstat(Reader->File, &st) != 0 || st.st_size == 0)
+   {
+      if (errno == 0)
+         errno = EINVAL;
+      close(Reader->File);
+      return 0;
+   }
+   Reader->Size = st.st_size;
+   long PageSize = sysconf(_SC_PAGESIZE);
+   Reader->MappedSize = (Reader->Size + PageSize - 1) / PageSize * PageSize;
+
+   if (Strategy == READ_AUTO)
+      Strategy = ChooseStrategy(Reader);
+   if (Strategy == READ_DIRECT && !SetDirect(Reader, 1))
+      Strategy = READ_STREAM;
+   Reader->Strategy = Strategy;
+
+   if (Strategy == READ_MMAP)
+   {
+      Reader->Base = mmap(NULL, Reader->Size, PROT_READ, MAP_SHARED, Reader->File, 0);
+      Reader->Available = Reader->Size;
+   }
+   else
+   {
+      Reader->Base = mmap(NULL, Reader->MappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   }
+   if (Reader->Base == MAP_FAILED)
+   {
+      close(Reader->File);
+      return 0;
+   }
+
+   if (Strategy != READ_MMAP && !ReadRange(Reader, TailOffset(Reader), Reader->MappedSize))
+   {
+      /* Some file systems accept O_DIRECT but fail the reads */
+      if (Strategy != READ_DIRECT || errno != EINVAL || !SetDirect(Reader, 0) ||
+          !ReadRange(Reader, TailOffset(Reader), Reader->MappedSize))
+      {
+         int Error = errno;
+         munmap(Reader->Base, Reader->MappedSize);
+         close(Reader->File);
+         errno = Error;
+         return 0;
+      }
+      Reader->Strategy = READ_STREAM;
+   }
+
+   pthread_mutex_init(&Reader->Lock, NULL);
+   pthread_cond_init(&Reader->Changed, NULL);
+   return 1;
+}
+
+/** Helper thread of the stream and direct strategies */
+static void* ReadAhead(void* Arg)
+{
+   PayloadReader* Reader = Arg;
+   size_t Offset = Reader->ReadOffset;
+   size_t End = TailOffset(Reader);
+   while (Offset < End)
+   {
+      pthread_mutex_lock(&Reader->Lock);
+      while (!Reader->Stop && Offset - Reader->Released >= READ_AHEAD_LIMIT && Offset >= Reader->Wanted)
+         pthread_cond_wait(&Reader->Changed, &Reader->Lock);
+      int Stop = Reader->Stop;
+      pthread_mutex_unlock(&Reader->Lock);
+      if (Stop)
+         break;
+
+      size_t Length = End - Offset < READ_CHUNK ? End - Offset : READ_CHUNK;
+      ssize_t n = pread(Reader->File, Reader->Base + Offset, Length, Offset);
+      if (n < 0 && errno == EINTR)
+         continue;
+
+      pthread_mutex_lock(&Reader->Lock);
+      if (n <= 0)
+         Reader->Error = 1;
+      else
+         Offset += n;
+      Reader->Available = Offset < End ? Offset : Reader->Size;
+      pthread_cond_broadcast(&Reader->Changed);
+      pthread_mutex_unlock(&Reader->Lock);
+      if (n <= 0)
+         break;
+   }
+   return NULL;
+}
+
+void ReaderStart(PayloadReader* Reader, size_t Offset)
+{
+   size_t Start = AlignDown(Offset, READ_ALIGN);
+   Reader->Released = Start;
+   if (Reader->Strategy == READ_MMAP)
+   {
+#ifdef MADV_SEQUENTIAL
+      madvise(Reader->Base + Start, Reader->Size - Start, MADV_SEQUENTIAL);
+#endif
+      Reader->Advised = Start;
+      ReaderWait(Reader, Offset);
+      return;
+   }
+
+   Reader->ReadOffset = Start;
+   Reader->Available = Start < TailOffset(Reader) ? Start : Reader->Size;
+   if (Start < TailOffset(Reader))
+      Reader->ThreadStarted = pthread_create(&Reader->Thread, NULL, ReadAhead, Reader) == 0;
+   if (!Reader->ThreadStarted)
+   {
+      /* Read everything now */
+      Reader->Available = ReadRange(Reader, Start, TailOffset(Reader)) ? Reader->Size : Start;
+      Reader->Error = Reader->Available != Reader->Size;
+   }
+}
+
+size_t ReaderWait(PayloadReader* Reader, size_t End)
+{
+   if (End > Reader->Size)
+      return 0;
+
+   if (Reader->Strategy == READ_MMAP)
+   {
+      /* Ask for the pages ahead, in windows */
+      while (Reader->Advised < Reader->Size && Reader->Advised < End + MMAP_WINDOW)
+      {
+         size_t Length = Reader->Size - Reader->Advised < MMAP_WINDOW ? Reader->Size - Reader->Advised : MMAP_WINDOW;
+#ifdef MADV_WILLNEED
+         madvise(Reader->Base + Reader->Advised, Length, MADV_WILLNEED);
+#endif
+         Reader->Advised += Length;
+      }
+      return Reader->Size;
+   }
+
+   pthread_mutex_lock(&Reader->Lock);
+   if (Reader->Available < End)
+   {
+      Reader->Wanted = End;
+      pthread_cond_broadcast(&Reader->Changed);
+   }
+   while (Reader->Available < End && !Reader->Error)
+      pthread_cond_wait(&Reader->Changed, &Reader->Lock);
+   size_t Available = Reader->Available >= End ? Reader->Available : 0;
+   pthread_mutex_unlock(&Reader->Lock);
+   return Available;
+}
+
+void ReaderRelease(PayloadReader* Reader, size_t End)
+{
+   size_t Page = AlignDown(End, sysconf(_SC_PAGESIZE));
+   if (Page <= Reader->Released)
+      return;
+
+   /* Dropped from the mapping: pages of the file stay in the page
+      cache, anonymous pages are freed */
+   madvise(Reader->Base + Reader->Released, Page - Reader->Released, MADV_DONTNEED);
+   if (Reader->Strategy == READ_MMAP)
+   {
+      Reader->Released = Page;
+      return;
+   }
+   pthread_mutex_lock(&Reader->Lock);
+   Reader->Released = Page;
+   pthread_cond_broadcast(&Reader->Changed);
+   pthread_mutex_unlock(&Reader->Lock);
+}
+
+void ReaderClose(PayloadReader* Reader)
+{
+   if (Reader->ThreadStarted)
+   {
+      pthread_mutex_lock(&Reader->Lock);
+      Reader->Stop = 1;
+      pthread_cond_broadcast(&Reader->Changed);
+      pthread_mutex_unlock(&Reader->Lock);
+      pthread_join(Reader->Thread, NULL);
+   }
+   pthread_mutex_destroy(&Reader->Lock);
+   pthread_cond_destroy(&Reader->Changed);
+   munmap(Reader->Base, Reader->Strategy == READ_MMAP ? Reader->Size : Reader->MappedSize);
+   close(Reader->File);
+}
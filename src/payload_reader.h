@@ -0,0 +1,84 @@
+/*
+  Payload Reader (POSIX)
+
+  Makes the executable (or payload file) available to the stub in
+  memory at file offsets, with one of several read strategies:
+
+  mmap    Map the file, with sequential access and read-ahead hints,
+          and drop the pages that have been processed from the mapping.
+  stream  Read the payload into an anonymous mapping with large reads
+          on a helper thread, ahead of the processing. Processed pages
+          are released.
+  direct  Like stream, bypassing the page cache (O_DIRECT) where the
+          file system supports it.
+
+  The default (auto) maps files that are mostly in the page cache or
+  small, and streams the others and files on network file systems,
+  where page faults are small synchronous reads. AIBIKA_READ_STRATEGY
+  selects a strategy.
+*/
+
+#ifndef PAYLOAD_READER_H
+#define PAYLOAD_READER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+   READ_AUTO,
+   READ_MMAP,
+   READ_STREAM,
+   READ_DIRECT
+} ReadStrategy;
+
+typedef struct
+{
+   int File;
+   ReadStrategy Strategy;
+   /* The content of the file, at its offsets */
+   uint8_t* Base;
+   size_t Size;
+   /* Size of the mapping at Base (a multiple of the page size) */
+   size_t MappedSize;
+   /* Bytes before Available can be read; pages before Released were
+      dropped. Available is only updated by the helper thread. */
+   size_t Available;
+   size_t Released;
+   /* Read-ahead limit of the mmap strategy */
+   size_t Advised;
+   /* Helper thread of the stream and direct strategies */
+   pthread_t Thread;
+   int ThreadStarted;
+   pthread_mutex_t Lock;
+   pthread_cond_t Changed;
+   size_t ReadOffset;
+   /* Offset that the processing waits for, read even beyond the
+      read-ahead limit */
+   size_t Wanted;
+   int Error;
+   int Stop;
+} PayloadReader;
+
+ReadStrategy ReaderStrategyNamed(const char* Name);
+const char* ReaderStrategyName(ReadStrategy Strategy);
+
+/* Opens a file. The last page is available at once, so the signature
+   at the end can be checked. Returns 0 and sets errno on failure. */
+int ReaderOpen(PayloadReader* Reader, const char* FileName, ReadStrategy Strategy);
+
+/* Starts reading at Offset, where the payload begins */
+void ReaderStart(PayloadReader* Reader, size_t Offset);
+
+/* Waits until the bytes before End can be read. Returns the offset up
+   to which they can, or 0 on a read error or if End is past the end
+   of the file. */
+size_t ReaderWait(PayloadReader* Reader, size_t End);
+
+/* Tells that the bytes before End have been processed */
+void ReaderRelease(PayloadReader* Reader, size_t End);
+
+void ReaderClose(PayloadReader* Reader);
+
+#endif
@@ -5,10 +5,16 @@
   and files in a temporary directory, launching a program.
 */
 
+#define PSAPI_VERSION 2
 #include <windows.h>
+#include <psapi.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <stdlib.h>
 #include <string.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 const BYTE Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
 
@@ -21,7 +27,27 @@ const BYTE Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
 #define OP_POST_CREATE_PROCRESS 6
 #define OP_ENABLE_DEBUG_MODE 7
 #define OP_CREATE_INST_DIRECTORY 8
-#define OP_MAX 9
+#define OP_CREATE_FILE_BCJ 9
+#define OP_USE_SHARED_STORE 10
+#define OP_LINK_SHARED_FILES 11
+#define OP_CREATE_SHARED_FILE 12
+#define OP_ENTRY_POINT 13
+#define OP_RESIDENT 14
+#define OP_VFS_IMAGE 15
+#define OP_EXTRACT_CACHE 16
+#define OP_PAYLOAD_FILE 17
+#define OP_PADDING 18
+#define OP_LZMA_DICTIONARY 19
+#define OP_DECOMPRESS_LZMA_PRIMED 20
+#define OP_CREATE_FILE_CHUNKS 21
+#define OP_PREFETCH 22
+#define OP_MAX 23
+
+#define SHARED_STORE_MACHINE 1
+#define SHARED_FILE_BCJ 1
+
+#define CHUNK_DATA 0
+#define CHUNK_COPY 1
 
 /** Manages digital signatures **/
 
@@ -51,6 +77,20 @@ BOOL OpSetEnv(LPBYTE* p);
 BOOL OpPostCreateProcess(LPBYTE* p);
 BOOL OpEnableDebugMode(LPBYTE* p);
 BOOL OpCreateInstDirectory(LPBYTE* p);
+BOOL OpCreateFileBcj(LPBYTE* p);
+BOOL OpUseSharedStore(LPBYTE* p);
+BOOL OpLinkSharedFiles(LPBYTE* p);
+BOOL OpCreateSharedFile(LPBYTE* p);
+BOOL OpEntryPoint(LPBYTE* p);
+BOOL OpResident(LPBYTE* p);
+BOOL OpVfsImage(LPBYTE* p);
+BOOL OpExtractCache(LPBYTE* p);
+BOOL OpPayloadFile(LPBYTE* p);
+BOOL OpPadding(LPBYTE* p);
+BOOL OpLzmaDictionary(LPBYTE* p);
+BOOL OpDecompressLzmaPrimed(LPBYTE* p);
+BOOL OpCreateFileChunks(LPBYTE* p);
+BOOL OpPrefetch(LPBYTE* p);
 
 #if WITH_LZMA
 #include <LzmaDec.h>
@@ -63,6 +103,7 @@ LPTSTR PostCreateProcess_CommandLine = NULL;
 
 DWORD ExitStatus = 0;
 BOOL ExitCondition = FALSE;
+BOOL EntryPointSelected = FALSE;
 BOOL DebugModeEnabled = FALSE;
 BOOL DeleteInstDirEnabled = FALSE;
 BOOL ChdirBeforeRunEnabled = TRUE;
@@ -99,9 +140,76 @@ POpcodeHandler OpcodeHandlers[OP_MAX] =
    &OpPostCreateProcess,
    &OpEnableDebugMode,
    &OpCreateInstDirectory,
+   &OpCreateFileBcj,
+   &OpUseSharedStore,
+   &OpLinkSharedFiles,
+   &OpCreateSharedFile,
+   &OpEntryPoint,
+   &OpResident,
+   &OpVfsImage,
+   &OpExtractCache,
+   &OpPayloadFile,
+   &OpPadding,
+#if WITH_LZMA
+   &OpLzmaDictionary,
+   &OpDecompressLzmaPrimed,
+#else
+   NULL,
+   NULL,
+#endif
+   &OpCreateFileChunks,
+   &OpPrefetch,
 };
 
 TCHAR InstDir[MAX_PATH];
+TCHAR StoreDir[MAX_PATH] = _T("");
+
+/* Set when the files of the next LZMA block are all in the shared store */
+BOOL SkipNextBlock = FALSE;
+
+/* Digest of the executable when it extracts to a persistent
+   installation directory (see OpExtractCache) */
+TCHAR ExtractCacheDigest[65] = _T("");
+
+/* Journal of the persistent installation directory: records of the
+   files and blocks extracted so far (see OpenJournal) */
+typedef struct
+{
+   DWORD Block;
+   DWORD Entry;
+} JournalRecord;
+
+#define JOURNAL_NAME _T(".aibika-journal")
+/* Entry of the record that completes a block */
+#define JOURNAL_BLOCK_DONE 0xFFFFFFFF
+
+HANDLE Journal = INVALID_HANDLE_VALUE;
+JournalRecord* Committed = NULL;
+DWORD CommittedCount = 0;
+/* Records written since the journal was last flushed (see JournalFlush) */
+JournalRecord* PendingRecords = NULL;
+DWORD PendingRecordCount = 0;
+DWORD PendingRecordCapacity = 0;
+/* Number of the LZMA block being extracted (0 outside blocks), and of
+   the next file in it */
+DWORD CurrentBlock = 0;
+DWORD CurrentEntry = 0;
+DWORD BlockCount = 0;
+/* Set when the persistent installation directory is used */
+BOOL ExtractCacheUsed = FALSE;
+
+/* Startup measurements passed to the program (see SetStartupMetrics) */
+double StartTime = 0;
+double DecodeTime = 0;
+DWORD WrittenFiles = 0;
+ULONGLONG WrittenBytes = 0;
+/* Files and blocks that the journal or the store had extracted already */
+DWORD FilesReused = 0;
+/* Directories of earlier runs that could not be deleted yet */
+DWORD CleanupBacklog = 0;
+
+BOOL CreateDirectories(LPTSTR Path);
+BOOL CreateMachineStore(LPTSTR Path);
 
 /** Decoder: Zero-terminated string */
 LPTSTR GetString(LPBYTE* p)
@@ -119,6 +227,25 @@ DWORD GetInteger(LPBYTE* p)
    return dw;
 }
 
+/**
+   Formats a path into a buffer of MAX_PATH characters. Fails when it
+   does not fit, rather than leaving a truncated path to another file.
+*/
+BOOL FormatPath(LPTSTR Path, LPCTSTR Format, ...)
+{
+   va_list Args;
+   va_start(Args, Format);
+   int Length = _vsntprintf(Path, MAX_PATH, Format, Args);
+   va_end(Args);
+   if (Length < 0 || Length >= MAX_PATH)
+   {
+      Path[MAX_PATH - 1] = _T('\0');
+      FATAL("Path too long: %s...", Path);
+      return FALSE;
+   }
+   return TRUE;
+}
+
 /**
    Handler for console events.
 */
@@ -197,6 +324,7 @@ BOOL DeleteRecursively(LPTSTR path)
 
 void MarkForDeletion(LPTSTR path)
 {
+   CleanupBacklog++;
    TCHAR marker[MAX_PATH];
    lstrcpy(marker, path);
    lstrcat(marker, ".aibika-delete-me");
@@ -238,6 +366,170 @@ void DeleteOldFiles()
    FindClose(handle);
 }
 
+int CompareRecords(const void* a, const void* b)
+{
+   const JournalRecord* x = a;
+   const JournalRecord* y = b;
+   if (x->Block != y->Block)
+      return x->Block < y->Block ? -1 : 1;
+   if (x->Entry != y->Entry)
+      return x->Entry < y->Entry ? -1 : 1;
+   return 0;
+}
+
+/**
+   Opens the journal of the persistent installation directory and
+   reads the records committed by earlier runs. A record is appended
+   once a file has been renamed into place, or once every file of an
+   LZMA block has. The journal is opened exclusively until the files
+   are extracted, so concurrent runs wait for the first one and find
+   the files committed. A record cut short by an interruption is
+   dropped.
+*/
+BOOL OpenJournal(void)
+{
+   TCHAR Path[MAX_PATH];
+   if (!FormatPath(Path, _T("%s\\%s"), InstDir, JOURNAL_NAME))
+      return FALSE;
+   while ((Journal = CreateFile(Path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+   {
+      if (GetLastError() != ERROR_SHARING_VIOLATION)
+      {
+         DEBUG("Failed to open journal '%s' (error %lu)", Path, GetLastError());
+         return FALSE;
+      }
+      Sleep(50);
+   }
+
+   DWORD Size = GetFileSize(Journal, NULL);
+   if (Size != INVALID_FILE_SIZE && Size >= sizeof(JournalRecord))
+   {
+      CommittedCount = Size / sizeof(JournalRecord);
+      Committed = LocalAlloc(LMEM_FIXED, CommittedCount * sizeof(JournalRecord));
+      DWORD BytesRead;
+      if (!ReadFile(Journal, Committed, CommittedCount * sizeof(JournalRecord), &BytesRead, NULL) ||
+          BytesRead != CommittedCount * sizeof(JournalRecord))
+         CommittedCount = 0;
+      qsort(Committed, CommittedCount, sizeof(JournalRecord), CompareRecords);
+   }
+   SetFilePointer(Journal, CommittedCount * sizeof(JournalRecord), NULL, FILE_BEGIN);
+   SetEndOfFile(Journal);
+   DEBUG("Journal has %lu records", CommittedCount);
+   return TRUE;
+}
+
+/**
+   Appends the records written since the last call to the journal, and
+   flushes it once. This is done once per LZMA block; the files of the
+   records are flushed before they are renamed into place, so a record
+   never outlives the content of its file after a power loss.
+*/
+void JournalFlush(void)
+{
+   DWORD Size = PendingRecordCount * sizeof(JournalRecord);
+   PendingRecordCount = 0;
+   if (Journal == INVALID_HANDLE_VALUE || Size == 0)
+      return;
+   DWORD BytesWritten;
+   if (!WriteFile(Journal, PendingRecords, Size, &BytesWritten, NULL) || BytesWritten != Size ||
+       !FlushFileBuffers(Journal))
+      DEBUG("Failed to write journal (error %lu)", GetLastError());
+}
+
+void CloseJournal(void)
+{
+   if (Journal == INVALID_HANDLE_VALUE)
+      return;
+   JournalFlush();
+   CloseHandle(Journal);
+   Journal = INVALID_HANDLE_VALUE;
+   if (Committed)
+      LocalFree(Committed);
+   Committed = NULL;
+   CommittedCount = 0;
+}
+
+BOOL JournalCommitted(DWORD Block, DWORD Entry)
+{
+   JournalRecord Record = { Block, Entry };
+   return CommittedCount && bsearch(&Record, Committed, CommittedCount, sizeof(JournalRecord), CompareRecords);
+}
+
+/** Records a file or block, with the next JournalFlush */
+void JournalCommit(DWORD Block, DWORD Entry)
+{
+   if (Journal == INVALID_HANDLE_VALUE)
+      return;
+   if (PendingRecordCount == PendingRecordCapacity)
+   {
+      DWORD Capacity = PendingRecordCapacity ? PendingRecordCapacity * 2 : 64;
+      JournalRecord* Records = PendingRecords
+         ? LocalReAlloc(PendingRecords, Capacity * sizeof(JournalRecord), LMEM_MOVEABLE)
+         : LocalAlloc(LMEM_FIXED, Capacity * sizeof(JournalRecord));
+      if (!Records)
+         return; /* The next run verifies the file */
+      PendingRecords = Records;
+      PendingRecordCapacity = Capacity;
+   }
+   JournalRecord Record = { Block, Entry };
+   PendingRecords[PendingRecordCount++] = Record;
+}
+
+/**
+   Numbers the next file of the current block. Returns TRUE when an
+   earlier run extracted it already.
+*/
+BOOL NextEntryExtracted(DWORD* Entry)
+{
+   *Entry = CurrentEntry++;
+   if (Journal == INVALID_HANDLE_VALUE || !JournalCommitted(CurrentBlock, *Entry))
+      return FALSE;
+   FilesReused++;
+   return TRUE;
+}
+
+/** Monotonic clock, in seconds */
+double Now(void)
+{
+   LARGE_INTEGER Count, Frequency;
+   QueryPerformanceCounter(&Count);
+   QueryPerformanceFrequency(&Frequency);
+   return (double)Count.QuadPart / Frequency.QuadPart;
+}
+
+void FileWritten(DWORD Size)
+{
+   WrittenFiles++;
+   WrittenBytes += Size;
+}
+
+/**
+   Passes measurements of the startup to the program in
+   AIBIKA_STARTUP_METRICS (see SetStartupMetrics in stub_posix.c). The
+   cleanup backlog is the number of directories of earlier runs that
+   are still marked for deletion.
+*/
+void SetStartupMetrics(void)
+{
+   const char* Cache = "none";
+   if (ExtractCacheUsed || StoreDir[0])
+      Cache = WrittenFiles == 0 ? "hit" : FilesReused ? "partial" : "miss";
+
+   DWORD PeakKb = 0;
+   PROCESS_MEMORY_COUNTERS Counters;
+   if (GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+      PeakKb = (DWORD)(Counters.PeakWorkingSetSize / 1024);
+
+   char Metrics[256];
+   snprintf(Metrics, sizeof(Metrics),
+            "decode_ms=%.1f extract_ms=%.1f files=%lu bytes=%I64u cache=%s peak_kb=%lu cleanup_backlog=%lu",
+            DecodeTime * 1000, (Now() - StartTime) * 1000, WrittenFiles, WrittenBytes, Cache, PeakKb,
+            CleanupBacklog);
+   DEBUG("Startup metrics: %s", Metrics);
+   SetEnvironmentVariable(_T("AIBIKA_STARTUP_METRICS"), Metrics);
+}
+
 BOOL OpCreateInstDirectory(LPBYTE* p)
 {
    DWORD DebugExtractMode = GetInteger(p);
@@ -245,6 +537,27 @@ BOOL OpCreateInstDirectory(LPBYTE* p)
    DeleteInstDirEnabled = GetInteger(p);
    ChdirBeforeRunEnabled = GetInteger(p);
 
+   if (ExtractCacheDigest[0] && !DebugExtractMode)
+   {
+      /* Persistent installation directory, kept after the program exits */
+      TCHAR Base[MAX_PATH];
+      DWORD Length = GetEnvironmentVariable(_T("LOCALAPPDATA"), Base, MAX_PATH);
+      if (Length == 0 || Length + 60 > MAX_PATH)
+         Length = GetTempPath(MAX_PATH - 60, Base);
+      if (Length > 0 && Base[Length - 1] == _T('\\'))
+         Base[Length - 1] = _T('\0');
+      wsprintf(InstDir, _T("%s\\aibika\\extract\\%.32s"), Base, ExtractCacheDigest);
+
+      if (CreateDirectories(InstDir) && OpenJournal())
+      {
+         DEBUG("Using installation directory: '%s'", InstDir);
+         DeleteInstDirEnabled = FALSE;
+         ExtractCacheUsed = TRUE;
+         return TRUE;
+      }
+      DEBUG("Failed to create installation directory '%s' (error %lu)", InstDir, GetLastError());
+   }
+
    /* Create an installation directory that will hold the extracted files */
    TCHAR TempPath[MAX_PATH];
    if (DebugExtractMode)
@@ -285,6 +598,7 @@ BOOL OpCreateInstDirectory(LPBYTE* p)
 
 int CALLBACK _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCmdLine, int nCmdShow)
 {
+   StartTime = Now();
    DeleteOldFiles();
 
    /* Find name of image */
@@ -300,6 +614,7 @@ int CALLBACK _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCm
 
    /* Set up environment */
    SetEnvironmentVariable(_T("AIBIKA_EXECUTABLE"), ImageFileName);
+   SetEnvironmentVariable(_T("AIBIKA_PAYLOAD"), NULL);
 
    SetConsoleCtrlHandler(&ConsoleHandleRoutine, TRUE);
 
@@ -333,6 +648,8 @@ int CALLBACK _tWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPTSTR lpCm
       {
          ExitStatus = -1;
       }
+      CloseJournal();
+      SetStartupMetrics();
 
       if (!UnmapViewOfFile(lpv))
       {
@@ -410,10 +727,15 @@ static BOOL isDigitallySigned(PIMAGE_NT_HEADERS ntHeader) {
 
 /* Find the location of aibika's signature
    NOTE: *not* the same as the digital signature from code signing
+   A payload file (see OpPayloadFile) is not an executable, and ends
+   with the signature.
 */
 static LPBYTE aibikaSignatureLocation(LPBYTE ptr, DWORD size)
 {
    LPBYTE ret = NULL;
+   if (size >= 8 && ((PIMAGE_DOS_HEADER)ptr)->e_magic != 0x5a4d)
+      return ptr + size - 4;
+
    PIMAGE_NT_HEADERS ntHeader = retrieveNTHeader(ptr);
    if (ntHeader) {
       if (!isDigitallySigned(ntHeader)) {
@@ -545,20 +867,87 @@ LPTSTR SkipArg(LPTSTR str)
 /**
    Create a file (OP_CREATE_FILE opcode handler)
 */
-BOOL OpCreateFile(LPBYTE* p)
+/** Whether the file exists with the given content */
+BOOL SameFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize)
 {
-   BOOL Result = TRUE;
-   LPTSTR FileName = GetString(p);
-   DWORD FileSize = GetInteger(p);
-   LPBYTE Data = *p;
-   *p += FileSize;
+   HANDLE hFile = CreateFile(Fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+      return FALSE;
 
-   TCHAR Fn[MAX_PATH];
-   lstrcpy(Fn, InstDir);
-   lstrcat(Fn, _T("\\"));
-   lstrcat(Fn, FileName);
+   BOOL Result = FALSE;
+   if (GetFileSize(hFile, NULL) == FileSize)
+   {
+      Result = TRUE;
+      BYTE Buffer[65536];
+      DWORD Offset = 0, BytesRead;
+      while (Result && Offset < FileSize)
+      {
+         DWORD Chunk = FileSize - Offset < sizeof(Buffer) ? FileSize - Offset : sizeof(Buffer);
+         Result = ReadFile(hFile, Buffer, Chunk, &BytesRead, NULL) && BytesRead == Chunk &&
+                  memcmp(Buffer, Data + Offset, Chunk) == 0;
+         Offset += Chunk;
+      }
+   }
+   CloseHandle(hFile);
+   return Result;
+}
 
-   DEBUG("CreateFile(%s, %lu)", Fn, FileSize);
+/** Flushes a file that was written before to the disk */
+BOOL FlushFile(LPTSTR Fn)
+{
+   HANDLE hFile = CreateFile(Fn, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+      return FALSE;
+   BOOL Result = FlushFileBuffers(hFile);
+   CloseHandle(hFile);
+   return Result;
+}
+
+/**
+   Writes an extracted file to the persistent installation directory,
+   under a temporary name that is then renamed, so an interrupted run
+   never leaves a partial file under the final name. The file is flushed
+   before it is renamed, as its record follows with the block. A file
+   that is there already but not in the journal (the run was interrupted
+   before it flushed the journal) is only verified, and flushed.
+*/
+BOOL ExtractFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize)
+{
+   if (SameFileData(Fn, Data, FileSize))
+   {
+      DEBUG("Verified %s", Fn);
+      return FlushFile(Fn);
+   }
+
+   TCHAR TempPath[MAX_PATH];
+   if (!FormatPath(TempPath, _T("%s.aibika-tmp"), Fn))
+      return FALSE;
+   HANDLE hFile = CreateFile(TempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to create file '%s'", TempPath);
+      return FALSE;
+   }
+   DWORD BytesWritten;
+   BOOL Result = WriteFile(hFile, Data, FileSize, &BytesWritten, NULL) && BytesWritten == FileSize &&
+                 FlushFileBuffers(hFile);
+   CloseHandle(hFile);
+   if (!Result || !MoveFileEx(TempPath, Fn, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+   {
+      FATAL("Failed to write '%s' (error %lu)", Fn, GetLastError());
+      (void)DeleteFile(TempPath);
+      return FALSE;
+   }
+   FileWritten(FileSize);
+   return TRUE;
+}
+
+/**
+   Writes an extracted file outside a persistent installation directory.
+*/
+BOOL WriteFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize)
+{
+   BOOL Result = TRUE;
    HANDLE hFile = CreateFile(Fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
    if (hFile != INVALID_HANDLE_VALUE)
    {
@@ -574,6 +963,8 @@ BOOL OpCreateFile(LPBYTE* p)
          Result = FALSE;
       }
       CloseHandle(hFile);
+      if (Result)
+         FileWritten(FileSize);
    }
    else
    {
@@ -584,6 +975,187 @@ BOOL OpCreateFile(LPBYTE* p)
    return Result;
 }
 
+BOOL OpCreateFile(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += FileSize;
+
+   TCHAR Fn[MAX_PATH];
+   if (!FormatPath(Fn, _T("%s\\%s"), InstDir, FileName))
+      return FALSE;
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+      return TRUE;
+
+   DEBUG("CreateFile(%s, %lu)", Fn, FileSize);
+   if (Journal != INVALID_HANDLE_VALUE)
+   {
+      if (!ExtractFileData(Fn, Data, FileSize))
+         return FALSE;
+      JournalCommit(CurrentBlock, Entry);
+      return TRUE;
+   }
+
+   return WriteFileData(Fn, Data, FileSize);
+}
+
+/**
+   Reads Size bytes at Offset of a file extracted before.
+*/
+BOOL ReadChunk(LPTSTR FileName, DWORD Offset, LPBYTE Data, DWORD Size)
+{
+   TCHAR Fn[MAX_PATH];
+   if (!FormatPath(Fn, _T("%s\\%s"), InstDir, FileName))
+      return FALSE;
+   HANDLE hFile = CreateFile(Fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to open '%s' (error %lu)", Fn, GetLastError());
+      return FALSE;
+   }
+   DWORD BytesRead = 0;
+   BOOL Result = SetFilePointer(hFile, Offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+                 ReadFile(hFile, Data, Size, &BytesRead, NULL) && BytesRead == Size;
+   CloseHandle(hFile);
+   if (!Result)
+      FATAL("Failed to read %lu bytes at %lu of '%s'", Size, Offset, Fn);
+   return Result;
+}
+
+/**
+   Assembles the content of a file from its pieces: content that
+   follows in the list (CHUNK_DATA) and content of files extracted
+   before (CHUNK_COPY).
+*/
+BOOL AssembleChunks(LPBYTE List, DWORD ListSize, LPBYTE Data, DWORD FileSize)
+{
+   LPBYTE p = List;
+   LPBYTE End = List + ListSize;
+   DWORD Offset = 0;
+   while (p < End)
+   {
+      DWORD Kind = GetInteger(&p);
+      LPTSTR Source = NULL;
+      DWORD SourceOffset = 0;
+      if (Kind == CHUNK_COPY)
+      {
+         Source = GetString(&p);
+         SourceOffset = GetInteger(&p);
+      }
+      DWORD Size = GetInteger(&p);
+      if (Size > FileSize - Offset)
+         break;
+      if (Source)
+      {
+         if (!ReadChunk(Source, SourceOffset, Data + Offset, Size))
+            return FALSE;
+      }
+      else
+      {
+         memcpy(Data + Offset, p, Size);
+         p += Size;
+      }
+      Offset += Size;
+   }
+   if (p != End || Offset != FileSize)
+   {
+      FATAL("Invalid chunk list.");
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Create a file from chunks, some of which are copied from files
+   extracted before (OP_CREATE_FILE_CHUNKS opcode handler).
+*/
+BOOL OpCreateFileChunks(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   DWORD ListSize = GetInteger(p);
+   LPBYTE List = *p;
+   *p += ListSize;
+
+   TCHAR Fn[MAX_PATH];
+   if (!FormatPath(Fn, _T("%s\\%s"), InstDir, FileName))
+      return FALSE;
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+      return TRUE;
+
+   DEBUG("CreateFileChunks(%s, %lu)", Fn, FileSize);
+   LPBYTE Data = LocalAlloc(LMEM_FIXED, FileSize ? FileSize : 1);
+   if (!Data)
+   {
+      FATAL("Failed to allocate %lu bytes for '%s'.", FileSize, Fn);
+      return FALSE;
+   }
+   BOOL Result = AssembleChunks(List, ListSize, Data, FileSize);
+   if (Result && Journal != INVALID_HANDLE_VALUE)
+      Result = ExtractFileData(Fn, Data, FileSize);
+   else if (Result)
+      Result = WriteFileData(Fn, Data, FileSize);
+   LocalFree(Data);
+   if (Result)
+      JournalCommit(CurrentBlock, Entry);
+   return Result;
+}
+
+/**
+   Reverses the branch conversion applied by the builder to x86/x64
+   executables (see Aibika::BcjFilter): the absolute targets of CALL
+   (E8) and JMP (E9) instructions are turned back into relative ones.
+   Only targets with a top byte of 00 or FF were converted, and the
+   converted values kept that property, so the same instructions are
+   selected here. The bytes after an E8/E9 are skipped whether they
+   were converted or not, as the builder did.
+*/
+void X86Unconvert(LPBYTE Data, DWORD Size)
+{
+   DWORD i = 0;
+   while (i + 5 <= Size)
+   {
+      if ((Data[i] & 0xFE) != 0xE8)
+      {
+         i++;
+         continue;
+      }
+      BYTE Top = Data[i + 4];
+      if (Top == 0x00 || Top == 0xFF)
+      {
+         DWORD Target = Data[i + 1] | (Data[i + 2] << 8) | (Data[i + 3] << 16) | ((DWORD)Top << 24);
+         DWORD Offset = (Target - (i + 5)) & 0x1FFFFFF;
+         if (Offset & 0x1000000)
+            Offset |= 0xFE000000;
+         Data[i + 1] = (BYTE)Offset;
+         Data[i + 2] = (BYTE)(Offset >> 8);
+         Data[i + 3] = (BYTE)(Offset >> 16);
+         Data[i + 4] = (BYTE)(Offset >> 24);
+      }
+      i += 5;
+   }
+}
+
+/**
+   Create an executable file whose branch targets were converted by
+   the builder (OP_CREATE_FILE_BCJ opcode handler). The conversion is
+   reversed in place in the decompressed data.
+*/
+BOOL OpCreateFileBcj(LPBYTE* p)
+{
+   LPBYTE q = *p;
+   LPTSTR FileName = GetString(&q);
+   DWORD FileSize = GetInteger(&q);
+   DEBUG("X86Unconvert(%s, %lu)", FileName, FileSize);
+   X86Unconvert(q, FileSize);
+   return OpCreateFile(p);
+}
+
 /**
    Create a directory (OP_CREATE_DIRECTORY opcode handler)
 */
@@ -592,9 +1164,8 @@ BOOL OpCreateDirectory(LPBYTE* p)
    LPTSTR DirectoryName = GetString(p);
 
    TCHAR DirName[MAX_PATH];
-   lstrcpy(DirName, InstDir);
-   lstrcat(DirName, _T("\\"));
-   lstrcat(DirName, DirectoryName);
+   if (!FormatPath(DirName, _T("%s\\%s"), InstDir, DirectoryName))
+      return FALSE;
 
    DEBUG("CreateDirectory(%s)", DirName);
 
@@ -614,7 +1185,289 @@ BOOL OpCreateDirectory(LPBYTE* p)
    return TRUE;
 }
 
-void GetCreateProcessInfo(LPBYTE* p, LPTSTR* pApplicationName, LPTSTR* pCommandLine)
+/**
+   Creates a directory and any missing parent directories. Existing
+   directories are not an error.
+*/
+BOOL CreateDirectories(LPTSTR Path)
+{
+   TCHAR Dir[MAX_PATH];
+   lstrcpy(Dir, Path);
+   LPTSTR a = Dir;
+   while ((a = _tcschr(a + 1, _T('\\'))))
+   {
+      *a = _T('\0');
+      (void)CreateDirectory(Dir, NULL);
+      *a = _T('\\');
+   }
+   return CreateDirectory(Dir, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+/**
+   Selects the shared store that runtime files are extracted to and
+   linked from (OP_USE_SHARED_STORE opcode handler). The store is
+   %LOCALAPPDATA%\aibika\store, or %ProgramData%\aibika\store for
+   the machine-wide store. Without a usable store, the files are
+   extracted to the installation directory as usual.
+*/
+BOOL OpUseSharedStore(LPBYTE* p)
+{
+   DWORD Scope = GetInteger(p);
+   LPCTSTR Variable = Scope == SHARED_STORE_MACHINE ? _T("ProgramData") : _T("LOCALAPPDATA");
+
+   TCHAR Base[MAX_PATH];
+   DWORD Length = GetEnvironmentVariable(Variable, Base, MAX_PATH);
+   if (Length == 0 || Length + 20 > MAX_PATH)
+   {
+      DEBUG("Shared store not available (%s not set)", Variable);
+      return TRUE;
+   }
+
+   lstrcpy(StoreDir, Base);
+   lstrcat(StoreDir, _T("\\aibika\\store"));
+   if (Scope == SHARED_STORE_MACHINE ? !CreateMachineStore(StoreDir) : !CreateDirectories(StoreDir))
+   {
+      DEBUG("Failed to create shared store '%s' (error %lu)", StoreDir, GetLastError());
+      StoreDir[0] = _T('\0');
+      return TRUE;
+   }
+
+   DEBUG("Using shared store '%s'", StoreDir);
+   return TRUE;
+}
+
+/**
+   Creates the machine-wide store, which everyone can read and only
+   administrators can change. Files in the store are linked and run
+   without being checked, so a store that exists already must be owned
+   by the administrators (or the system) and must not inherit the
+   rights of %ProgramData%, where every user can create files.
+*/
+BOOL CreateMachineStore(LPTSTR Path)
+{
+   SECURITY_ATTRIBUTES Attributes = { sizeof(Attributes), NULL, FALSE };
+   if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
+          _T("O:BAD:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)(A;OICI;FRFX;;;BU)"), SDDL_REVISION_1,
+          &Attributes.lpSecurityDescriptor, NULL))
+      return FALSE;
+   TCHAR Parent[MAX_PATH];
+   lstrcpy(Parent, Path);
+   *_tcsrchr(Parent, _T('\\')) = _T('\0');
+   (void)CreateDirectory(Parent, &Attributes);
+   (void)CreateDirectory(Path, &Attributes);
+   LocalFree(Attributes.lpSecurityDescriptor);
+
+   PSID Owner;
+   PSECURITY_DESCRIPTOR Descriptor;
+   if (GetNamedSecurityInfo(Path, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, &Owner,
+                            NULL, NULL, NULL, &Descriptor) != ERROR_SUCCESS)
+      return FALSE;
+   SECURITY_DESCRIPTOR_CONTROL Control;
+   DWORD Revision;
+   BOOL Protected = GetSecurityDescriptorControl(Descriptor, &Control, &Revision) && (Control & SE_DACL_PROTECTED) &&
+                    (IsWellKnownSid(Owner, WinBuiltinAdministratorsSid) || IsWellKnownSid(Owner, WinLocalSystemSid));
+   LocalFree(Descriptor);
+   if (!Protected)
+      DEBUG("Not using shared store '%s', which other users can change", Path);
+   return Protected;
+}
+
+/** Path of a file in the shared store: <store>\<first 2 digits>\<hash> */
+BOOL GetSharedFilePath(LPTSTR Path, LPTSTR Hash)
+{
+   return FormatPath(Path, _T("%s\\%.2s\\%s"), StoreDir, Hash, Hash);
+}
+
+/**
+   Makes a file from the shared store appear in the installation
+   directory, as a hard link or, where that is not possible (e.g. the
+   store is on another volume), as a copy.
+*/
+BOOL LinkSharedFile(LPTSTR FileName, LPTSTR Hash)
+{
+   TCHAR SharedPath[MAX_PATH];
+   if (!GetSharedFilePath(SharedPath, Hash))
+      return FALSE;
+
+   TCHAR Fn[MAX_PATH];
+   if (!FormatPath(Fn, _T("%s\\%s"), InstDir, FileName))
+      return FALSE;
+
+   /* The directories are created after the block, which may be skipped */
+   LPTSTR Sep = _tcsrchr(Fn, _T('\\'));
+   *Sep = _T('\0');
+   CreateDirectories(Fn);
+   *Sep = _T('\\');
+
+   DEBUG("LinkSharedFile(%s, %s)", Fn, SharedPath);
+   (void)DeleteFile(Fn);
+   if (CreateHardLink(Fn, SharedPath, NULL))
+   {
+      FilesReused++;
+      return TRUE;
+   }
+
+   WIN32_FILE_ATTRIBUTE_DATA Attributes;
+   if (CopyFile(SharedPath, Fn, FALSE) && (Journal == INVALID_HANDLE_VALUE || FlushFile(Fn)))
+   {
+      FileWritten(GetFileAttributesEx(SharedPath, GetFileExInfoStandard, &Attributes) ? Attributes.nFileSizeLow : 0);
+      return TRUE;
+   }
+
+   DEBUG("Failed to link '%s' (error %lu)", Fn, GetLastError());
+   return FALSE;
+}
+
+/**
+   Lists the files of the following LZMA block, which the builder
+   placed in the shared store (OP_LINK_SHARED_FILES opcode handler).
+   When all of them are already in the store, they are linked into
+   the installation directory and the block is not decompressed.
+*/
+BOOL OpLinkSharedFiles(LPBYTE* p)
+{
+   DWORD Count = GetInteger(p);
+   LPBYTE Files = *p;
+   DWORD i;
+   for (i = 0; i < Count; i++)
+   {
+      GetString(p);
+      GetString(p);
+   }
+
+   if (StoreDir[0] == _T('\0'))
+      return TRUE;
+
+   LPBYTE q = Files;
+   for (i = 0; i < Count; i++)
+   {
+      GetString(&q);
+      LPTSTR Hash = GetString(&q);
+      TCHAR SharedPath[MAX_PATH];
+      if (!GetSharedFilePath(SharedPath, Hash) || GetFileAttributes(SharedPath) == INVALID_FILE_ATTRIBUTES)
+      {
+         DEBUG("'%s' not in shared store", SharedPath);
+         return TRUE;
+      }
+   }
+
+   q = Files;
+   for (i = 0; i < Count; i++)
+   {
+      LPTSTR FileName = GetString(&q);
+      LPTSTR Hash = GetString(&q);
+      if (!LinkSharedFile(FileName, Hash))
+         return TRUE; /* The block will extract the files again */
+   }
+
+   SkipNextBlock = TRUE;
+   return TRUE;
+}
+
+/**
+   Create a file through the shared store (OP_CREATE_SHARED_FILE
+   opcode handler). The content is added to the store under its hash
+   unless another executable already did, and is then linked into the
+   installation directory. The file is written under a temporary name
+   and renamed, so concurrent executables never see a partial file.
+*/
+BOOL OpCreateSharedFile(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   LPTSTR Hash = GetString(p);
+   DWORD Flags = GetInteger(p);
+   DWORD FileSize = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += FileSize;
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+      return TRUE;
+
+   if (Flags & SHARED_FILE_BCJ)
+   {
+      /* Only set for files in (writable) decompressed blocks */
+      X86Unconvert(Data, FileSize);
+   }
+
+   TCHAR SharedPath[MAX_PATH];
+   if (StoreDir[0] != _T('\0') && GetSharedFilePath(SharedPath, Hash))
+   {
+      if (GetFileAttributes(SharedPath) == INVALID_FILE_ATTRIBUTES)
+      {
+         TCHAR Directory[MAX_PATH];
+         lstrcpy(Directory, SharedPath);
+         *_tcsrchr(Directory, _T('\\')) = _T('\0');
+         CreateDirectories(Directory);
+         TCHAR TempPath[MAX_PATH];
+         if (!FormatPath(TempPath, _T("%s\\%s.%lu.%lu.tmp"), Directory, Hash, GetCurrentProcessId(), GetTickCount()))
+            return FALSE;
+
+         DEBUG("CreateSharedFile(%s, %lu)", SharedPath, FileSize);
+         HANDLE hFile = CreateFile(TempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+         if (hFile != INVALID_HANDLE_VALUE)
+         {
+            DWORD BytesWritten;
+            BOOL Written = WriteFile(hFile, Data, FileSize, &BytesWritten, NULL) && BytesWritten == FileSize &&
+                           FlushFileBuffers(hFile);
+            CloseHandle(hFile);
+            /* Flushed, as other executables trust a stored file by its name */
+            if (!Written || !MoveFileEx(TempPath, SharedPath, MOVEFILE_WRITE_THROUGH))
+            {
+               /* Another executable may have stored it in the meantime */
+               (void)DeleteFile(TempPath);
+            }
+            else
+            {
+               FileWritten(FileSize);
+            }
+         }
+      }
+
+      if (LinkSharedFile(FileName, Hash))
+      {
+         JournalCommit(CurrentBlock, Entry);
+         return TRUE;
+      }
+   }
+
+   /* Extract the file to the installation directory as usual */
+   TCHAR Fn[MAX_PATH];
+   if (!FormatPath(Fn, _T("%s\\%s"), InstDir, FileName))
+      return FALSE;
+   /* The directories are created after the block */
+   LPTSTR Sep = _tcsrchr(Fn, _T('\\'));
+   *Sep = _T('\0');
+   CreateDirectories(Fn);
+   *Sep = _T('\\');
+   (void)DeleteFile(Fn);
+
+   DEBUG("CreateFile(%s, %lu)", Fn, FileSize);
+   if (Journal != INVALID_HANDLE_VALUE)
+   {
+      if (!ExtractFileData(Fn, Data, FileSize))
+         return FALSE;
+      JournalCommit(CurrentBlock, Entry);
+      return TRUE;
+   }
+
+   HANDLE hFile = CreateFile(Fn, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, NULL);
+   if (hFile == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to create file '%s'", Fn);
+      return FALSE;
+   }
+   DWORD BytesWritten;
+   BOOL Result = WriteFile(hFile, Data, FileSize, &BytesWritten, NULL) && BytesWritten == FileSize;
+   if (Result)
+      FileWritten(FileSize);
+   else
+      FATAL("Write failure (%lu)", GetLastError());
+   CloseHandle(hFile);
+   return Result;
+}
+
+void GetCreateProcessInfoWithArgs(LPBYTE* p, LPTSTR* pApplicationName, LPTSTR* pCommandLine, LPTSTR MyArgs)
 {
    LPTSTR ImageName = GetString(p);
    LPTSTR CmdLine = GetString(p);
@@ -624,9 +1477,6 @@ void GetCreateProcessInfo(LPBYTE* p, LPTSTR* pApplicationName, LPTSTR* pCommandL
    LPTSTR ExpandedCommandLine;
    ExpandPath(&ExpandedCommandLine, CmdLine);
 
-   LPTSTR MyCmdLine = GetCommandLine();
-   LPTSTR MyArgs = SkipArg(MyCmdLine);
-
    *pCommandLine = LocalAlloc(LMEM_FIXED, lstrlen(ExpandedCommandLine) + sizeof(TCHAR) + lstrlen(MyArgs) + sizeof(TCHAR));
    lstrcpy(*pCommandLine, ExpandedCommandLine);
    lstrcat(*pCommandLine, _T(" "));
@@ -635,6 +1485,11 @@ void GetCreateProcessInfo(LPBYTE* p, LPTSTR* pApplicationName, LPTSTR* pCommandL
    LocalFree(ExpandedCommandLine);
 }
 
+void GetCreateProcessInfo(LPBYTE* p, LPTSTR* pApplicationName, LPTSTR* pCommandLine)
+{
+   GetCreateProcessInfoWithArgs(p, pApplicationName, pCommandLine, SkipArg(GetCommandLine()));
+}
+
 /**
    Create a new process and wait for it to complete (OP_CREATE_PROCESS
    opcode handler)
@@ -683,7 +1538,14 @@ void CreateAndWaitForProcess(LPTSTR ApplicationName, LPTSTR CommandLine)
 BOOL OpPostCreateProcess(LPBYTE* p)
 {
    DEBUG("PostCreateProcess");
-   if (PostCreateProcess_ApplicationName || PostCreateProcess_CommandLine)
+   if (EntryPointSelected)
+   {
+      /* An entry point was selected instead of the main script */
+      GetString(p);
+      GetString(p);
+      return TRUE;
+   }
+   else if (PostCreateProcess_ApplicationName || PostCreateProcess_CommandLine)
    {
       return FALSE;
    }
@@ -694,6 +1556,225 @@ BOOL OpPostCreateProcess(LPBYTE* p)
    }
 }
 
+/**
+   Returns the arguments after the entry point name when the named
+   entry point was invoked, either through the name of the executable
+   (e.g. a copy or link named <name>.exe) or as the first argument
+   (<exe> <name> args...). Returns NULL otherwise.
+*/
+LPTSTR MatchEntryPoint(LPTSTR Name)
+{
+   TCHAR ExeName[MAX_PATH];
+   LPTSTR Base = _tcsrchr(ImageFileName, _T('\\'));
+   lstrcpy(ExeName, Base ? Base + 1 : ImageFileName);
+   LPTSTR Ext = _tcsrchr(ExeName, _T('.'));
+   if (Ext && lstrcmpi(Ext, _T(".exe")) == 0)
+      *Ext = _T('\0');
+   if (lstrcmpi(ExeName, Name) == 0)
+      return SkipArg(GetCommandLine());
+
+   LPTSTR Arg = SkipArg(GetCommandLine());
+   while (*Arg == _T(' '))
+      Arg++;
+   int NameLength = lstrlen(Name);
+   if (_tcsncmp(Arg, Name, NameLength) == 0 && (Arg[NameLength] == _T(' ') || Arg[NameLength] == _T('\0')))
+      return Arg + NameLength;
+
+   return NULL;
+}
+
+/**
+   Declares an additional script of the bundle that can be run instead
+   of the main one (OP_ENTRY_POINT opcode handler). The first entry
+   point that matches the invocation replaces the process set up by
+   OP_POST_CREATE_PROCESS.
+*/
+BOOL OpEntryPoint(LPBYTE* p)
+{
+   LPTSTR Name = GetString(p);
+   LPTSTR MyArgs = EntryPointSelected ? NULL : MatchEntryPoint(Name);
+   if (MyArgs == NULL)
+   {
+      GetString(p);
+      GetString(p);
+      return TRUE;
+   }
+
+   DEBUG("Selected entry point %s", Name);
+   GetCreateProcessInfoWithArgs(p, &PostCreateProcess_ApplicationName, &PostCreateProcess_CommandLine, MyArgs);
+   EntryPointSelected = TRUE;
+   return TRUE;
+}
+
+/**
+   Resident mode (OP_RESIDENT opcode handler). The resident server
+   needs fork, so the Windows stub always extracts and runs the
+   program itself (see stub_posix.c).
+*/
+BOOL OpResident(LPBYTE* p)
+{
+   GetString(p);
+   GetInteger(p);
+   return TRUE;
+}
+
+/**
+   Virtual file system (OP_VFS_IMAGE opcode handler). There is no
+   interposer for Windows, so the builder only emits it for POSIX
+   stubs (see stub_posix.c).
+*/
+BOOL OpVfsImage(LPBYTE* p)
+{
+   FATAL("Virtual file system not supported on Windows");
+   return FALSE;
+}
+
+/**
+   Extracts to a persistent installation directory named after the
+   digest of the executable (OP_EXTRACT_CACHE opcode handler, before
+   OP_CREATE_INST_DIRECTORY). Later runs reuse the files, and a run
+   that was interrupted is resumed from the journal (see OpenJournal).
+   The directory is %LOCALAPPDATA%\aibika\extract\<digest>.
+*/
+BOOL OpExtractCache(LPBYTE* p)
+{
+   LPTSTR Digest = GetString(p);
+   lstrcpyn(ExtractCacheDigest, Digest, 65);
+   return TRUE;
+}
+
+/* Threads that read the files of OP_PREFETCH */
+#define PREFETCH_THREADS 4
+
+typedef struct
+{
+   LPTSTR* Names;
+   DWORD Count;
+   LONG Next;
+} PrefetchList;
+
+PrefetchList Prefetch = { NULL, 0, 0 };
+
+/**
+   Reads the next files of the list into the file cache, until none is
+   left. The files are shared with the program, which opens them
+   meanwhile.
+*/
+DWORD WINAPI PrefetchFiles(LPVOID Arg)
+{
+   PrefetchList* List = Arg;
+   LPBYTE Buffer = LocalAlloc(LMEM_FIXED, 65536);
+   if (!Buffer)
+      return 0;
+
+   LONG Index;
+   while ((Index = InterlockedIncrement(&List->Next) - 1) < (LONG)List->Count)
+   {
+      TCHAR Path[MAX_PATH];
+      _sntprintf(Path, MAX_PATH, _T("%s\\%s"), InstDir, List->Names[Index]);
+      Path[MAX_PATH - 1] = 0;
+      HANDLE File = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (File == INVALID_HANDLE_VALUE)
+         continue;
+      DWORD Read;
+      while (ReadFile(File, Buffer, 65536, &Read, NULL) && Read > 0)
+         ;
+      CloseHandle(File);
+   }
+   LocalFree(Buffer);
+   return 0;
+}
+
+/**
+   Reads the files that the program reads when it starts, in the order
+   it reads them (OP_PREFETCH opcode handler, after the files). When
+   the persistent installation directory was extracted by an earlier
+   run, the first run after a reboot would otherwise read each file
+   from the disk when Ruby gets to it. Threads read them while the
+   program starts. Set AIBIKA_PREFETCH=0 to disable it.
+*/
+BOOL OpPrefetch(LPBYTE* p)
+{
+   DWORD Size = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += Size;
+
+   TCHAR Setting[2];
+   DWORD SettingLength = GetEnvironmentVariable(_T("AIBIKA_PREFETCH"), Setting, 2);
+   if (!ExtractCacheUsed || (WrittenFiles > 0 && !FilesReused) || (SettingLength == 1 && Setting[0] == '0'))
+      return TRUE;
+
+   /* The executable is unmapped before the program exits */
+   LPBYTE Names = LocalAlloc(LMEM_FIXED, Size);
+   if (!Names)
+      return TRUE;
+   memcpy(Names, Data, Size);
+   for (LPBYTE Name = Names; Name < Names + Size; Name += lstrlen((LPTSTR)Name) + 1)
+      Prefetch.Count++;
+   Prefetch.Names = LocalAlloc(LMEM_FIXED, Prefetch.Count * sizeof(LPTSTR));
+   if (!Prefetch.Names)
+      return TRUE;
+   DWORD Index = 0;
+   for (LPBYTE Name = Names; Name < Names + Size; Name += lstrlen((LPTSTR)Name) + 1)
+      Prefetch.Names[Index++] = (LPTSTR)Name;
+   DEBUG("Prefetch(%lu files)", Prefetch.Count);
+
+   for (int i = 0; i < PREFETCH_THREADS; i++)
+   {
+      HANDLE Thread = CreateThread(NULL, 0, PrefetchFiles, &Prefetch, 0, NULL);
+      if (Thread)
+         CloseHandle(Thread);
+   }
+   return TRUE;
+}
+
+/**
+   Processes the payload written to a file next to the executable
+   (OP_PAYLOAD_FILE opcode handler), which holds the opcodes and the
+   signature like an executable with the payload appended. The file is
+   mapped read-only, so concurrent instances share its pages, and an
+   update can replace the file alone.
+*/
+BOOL OpPayloadFile(LPBYTE* p)
+{
+   LPTSTR Name = GetString(p);
+
+   TCHAR Directory[MAX_PATH];
+   FindExeDir(Directory);
+   TCHAR PayloadFileName[MAX_PATH];
+   if (!FormatPath(PayloadFileName, _T("%s\\%s"), Directory, Name))
+      return FALSE;
+   DEBUG("PayloadFile(%s)", PayloadFileName);
+
+   HANDLE hPayload = CreateFile(PayloadFileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                                OPEN_EXISTING, 0, NULL);
+   if (hPayload == INVALID_HANDLE_VALUE)
+   {
+      FATAL("Failed to open payload file '%s' (error %lu)", PayloadFileName, GetLastError());
+      return FALSE;
+   }
+
+   BOOL Result = FALSE;
+   DWORD FileSize = GetFileSize(hPayload, NULL);
+   HANDLE hMem = CreateFileMapping(hPayload, NULL, PAGE_READONLY, 0, FileSize, NULL);
+   LPBYTE lpv = hMem ? MapViewOfFile(hMem, FILE_MAP_READ, 0, 0, 0) : NULL;
+   if (lpv == NULL)
+   {
+      FATAL("Failed to map payload file '%s' into memory (error %lu).", PayloadFileName, GetLastError());
+   }
+   else
+   {
+      SetEnvironmentVariable(_T("AIBIKA_PAYLOAD"), PayloadFileName);
+      Result = ProcessImage(lpv, FileSize);
+      UnmapViewOfFile(lpv);
+   }
+   if (hMem)
+      CloseHandle(hMem);
+   CloseHandle(hPayload);
+   return Result;
+}
+
 BOOL OpEnableDebugMode(LPBYTE* p)
 {
    DebugModeEnabled = TRUE;
@@ -709,16 +1790,99 @@ ISzAlloc alloc = { SzAlloc, SzFree };
 #define LZMA_UNPACKSIZE_SIZE 8
 #define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
 
-BOOL OpDecompressLzma(LPBYTE* p)
+/* Dictionary that primed LZMA blocks continue (see OpLzmaDictionary):
+   its size, the properties and stream that it was compressed to, and
+   the state of the decoder that decoded it up to DictionaryConsumed
+   bytes of the stream */
+DWORD DictionarySize = 0;
+LPBYTE DictionaryProps = NULL;
+LPBYTE DictionaryStream = NULL;
+DWORD DictionaryStreamSize = 0;
+CLzmaDec DictionaryDecoder;
+SizeT DictionaryConsumed = 0;
+/* The stream of a primed block parts from the stream of the dictionary
+   in its last bytes, where the encoder flushed it, so the state is saved
+   that many bytes before its end */
+#define DICTIONARY_TAIL 256
+
+/**
+   Decodes a primed LZMA block from a copy of the state of the decoder
+   after the dictionary: the rest of the stream of the dictionary that
+   the block has in common with it, then the block's own stream. A block
+   whose stream parts from the dictionary's before that state is decoded
+   from the start of the dictionary.
+*/
+SRes DecodePrimed(Byte* Dest, SizeT DestSize, DWORD SharedSize, const Byte* Rest, SizeT RestSize)
+{
+   CLzmaDec Decoder;
+   LzmaDec_Construct(&Decoder);
+   SRes res = LzmaDec_AllocateProbs(&Decoder, DictionaryProps, LZMA_PROPS_SIZE, &alloc);
+   if (res != SZ_OK)
+      return res;
+
+   const Byte* In = DictionaryStream;
+   SizeT InSize = SharedSize;
+   if (DictionaryConsumed <= SharedSize)
+   {
+      CLzmaProb* Probs = Decoder.probs;
+      Decoder = DictionaryDecoder;
+      Decoder.probs = Probs;
+      memcpy(Probs, DictionaryDecoder.probs, Decoder.numProbs * sizeof(CLzmaProb));
+      memcpy(Dest, DictionaryDecoder.dic, DictionaryDecoder.dicPos);
+      In += DictionaryConsumed;
+      InSize -= DictionaryConsumed;
+   }
+   else
+   {
+      DEBUG("Decoding the dictionary again");
+      LzmaDec_Init(&Decoder);
+   }
+   Decoder.dic = Dest;
+   Decoder.dicBufSize = DestSize;
+
+   ELzmaStatus status;
+   res = LzmaDec_DecodeToDic(&Decoder, DestSize, In, &InSize, LZMA_FINISH_ANY, &status);
+   if (res == SZ_OK)
+      res = LzmaDec_DecodeToDic(&Decoder, DestSize, Rest, &RestSize, LZMA_FINISH_ANY, &status);
+   if (res == SZ_OK && Decoder.dicPos < DestSize)
+      res = SZ_ERROR_INPUT_EOF;
+   LzmaDec_FreeProbs(&Decoder, &alloc);
+   return res;
+}
+
+/**
+   Decodes an LZMA block and processes its opcodes. A primed block is
+   the continuation of the stream of the shared dictionary: the
+   compressed block starts with the number of bytes that it has in
+   common with that stream, which precede the rest of the block.
+*/
+BOOL DecompressLzma(LPBYTE* p, BOOL Primed)
 {
    BOOL Success = TRUE;
 
    DWORD CompressedSize = GetInteger(p);
-   DEBUG("LzmaDecode(%ld)", CompressedSize);
+   DEBUG("LzmaDecode(%ld)%s", CompressedSize, Primed ? " primed" : "");
 
    Byte* src = (Byte*)*p;
    *p += CompressedSize;
 
+   DWORD Block = ++BlockCount;
+   if (SkipNextBlock)
+   {
+      DEBUG("All files of block found in shared store");
+      SkipNextBlock = FALSE;
+      JournalCommit(Block, JOURNAL_BLOCK_DONE);
+      FilesReused++;
+      return TRUE;
+   }
+
+   if (Journal != INVALID_HANDLE_VALUE && JournalCommitted(Block, JOURNAL_BLOCK_DONE))
+   {
+      DEBUG("Block %lu extracted already", Block);
+      FilesReused++;
+      return TRUE;
+   }
+
    UInt64 unpackSize = 0;
    int i;
    for (i = 0; i < 8; i++)
@@ -726,13 +1890,34 @@ BOOL OpDecompressLzma(LPBYTE* p)
       unpackSize += (UInt64)src[LZMA_PROPS_SIZE + i] << (i * 8);
    }
 
+   Byte* In = src + LZMA_HEADER_SIZE;
+   SizeT inSizePure = CompressedSize - LZMA_HEADER_SIZE;
+   DWORD SharedSize = 0;
+   DWORD Skip = 0;
+   if (Primed)
+   {
+      LPBYTE Shared = In;
+      SharedSize = inSizePure >= 4 ? GetInteger(&Shared) : 0;
+      if (inSizePure < 4 || !DictionaryStream || SharedSize > DictionaryStreamSize || unpackSize < DictionarySize ||
+          memcmp(src, DictionaryProps, LZMA_PROPS_SIZE) != 0)
+      {
+         FATAL("Invalid primed LZMA block.");
+         return FALSE;
+      }
+      In = Shared;
+      inSizePure -= 4;
+      Skip = DictionarySize;
+   }
+
    Byte* DecompressedData = LocalAlloc(LMEM_FIXED, unpackSize);
 
    SizeT lzmaDecompressedSize = unpackSize;
-   SizeT inSizePure = CompressedSize - LZMA_HEADER_SIZE;
    ELzmaStatus status;
-   SRes res = LzmaDecode(DecompressedData, &lzmaDecompressedSize, src + LZMA_HEADER_SIZE, &inSizePure,
-                         src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status, &alloc);
+   double DecodeStart = Now();
+   SRes res = Primed ? DecodePrimed(DecompressedData, unpackSize, SharedSize, In, inSizePure)
+                     : LzmaDecode(DecompressedData, &lzmaDecompressedSize, In, &inSizePure,
+                                  src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status, &alloc);
+   DecodeTime += Now() - DecodeStart;
    if (res != SZ_OK)
    {
       FATAL("LZMA decompression failed.");
@@ -740,18 +1925,106 @@ BOOL OpDecompressLzma(LPBYTE* p)
    }
    else
    {
-      LPBYTE decPtr = DecompressedData;
+      /* Each block is terminated by its own OP_END */
+      DWORD TopLevelEntry = CurrentEntry;
+      CurrentBlock = Block;
+      CurrentEntry = 0;
+      LPBYTE decPtr = DecompressedData + Skip;
       if (!ProcessOpcodes(&decPtr))
       {
          Success = FALSE;
       }
+      else
+      {
+         JournalCommit(Block, JOURNAL_BLOCK_DONE);
+      }
+      /* The records of the block are committed together */
+      JournalFlush();
+      ExitCondition = FALSE;
+      CurrentBlock = 0;
+      CurrentEntry = TopLevelEntry;
    }
 
    LocalFree(DecompressedData);
    return Success;
 }
+
+BOOL OpDecompressLzma(LPBYTE* p)
+{
+   return DecompressLzma(p, FALSE);
+}
+
+BOOL OpDecompressLzmaPrimed(LPBYTE* p)
+{
+   return DecompressLzma(p, TRUE);
+}
+
+/**
+   Keeps the shared dictionary that the following LZMA blocks are
+   primed with (OP_LZMA_DICTIONARY opcode handler), and decodes it
+   once: each primed block starts from a copy of the decoder's state.
+   The executable or payload file stays mapped while its blocks are
+   decoded.
+*/
+BOOL OpLzmaDictionary(LPBYTE* p)
+{
+   DictionarySize = GetInteger(p);
+   DWORD Size = GetInteger(p);
+   DEBUG("LzmaDictionary(%lu, %lu)", DictionarySize, Size);
+   DictionaryProps = *p;
+   *p += Size;
+   if (Size < LZMA_PROPS_SIZE)
+   {
+      FATAL("Invalid LZMA dictionary.");
+      return FALSE;
+   }
+   DictionaryStream = DictionaryProps + LZMA_PROPS_SIZE;
+   DictionaryStreamSize = Size - LZMA_PROPS_SIZE;
+
+   LzmaDec_FreeProbs(&DictionaryDecoder, &alloc);
+   if (DictionaryDecoder.dic)
+      LocalFree(DictionaryDecoder.dic);
+   LzmaDec_Construct(&DictionaryDecoder);
+   SRes res = LzmaDec_AllocateProbs(&DictionaryDecoder, DictionaryProps, LZMA_PROPS_SIZE, &alloc);
+   DictionaryDecoder.dic = LocalAlloc(LMEM_FIXED, DictionarySize ? DictionarySize : 1);
+   DictionaryDecoder.dicBufSize = DictionarySize;
+   if (!DictionaryDecoder.dic || res == SZ_ERROR_MEM)
+   {
+      FATAL("Failed to allocate memory for the LZMA dictionary.");
+      return FALSE;
+   }
+
+   SizeT InSize = DictionaryStreamSize > DICTIONARY_TAIL ? DictionaryStreamSize - DICTIONARY_TAIL : 0;
+   double DecodeStart = Now();
+   if (res == SZ_OK)
+   {
+      ELzmaStatus status;
+      LzmaDec_Init(&DictionaryDecoder);
+      res = LzmaDec_DecodeToDic(&DictionaryDecoder, DictionarySize, DictionaryStream, &InSize, LZMA_FINISH_ANY,
+                                &status);
+   }
+   DecodeTime += Now() - DecodeStart;
+   if (res != SZ_OK)
+   {
+      FATAL("LZMA decompression failed.");
+      return FALSE;
+   }
+   DictionaryConsumed = InSize;
+   return TRUE;
+}
 #endif
 
+/**
+   Padding that aligns the content of large files in LZMA blocks for
+   the POSIX stub (OP_PADDING opcode handler).
+*/
+BOOL OpPadding(LPBYTE* p)
+{
+   DWORD Size = GetInteger(p);
+   *p += Size;
+   return TRUE;
+}
+
 BOOL OpEnd(LPBYTE* p)
 {
    ExitCondition = TRUE;
@@ -0,0 +1,2628 @@
+/*
+  Single Executable Bundle Stub (POSIX)
+
+  Counterpart of stub.c for Linux and other POSIX systems. It reads the
+  same embedded instructions from the end of its own executable, creates
+  the directories and files in a temporary directory and launches the
+  program.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "payload_reader.h"
+
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef BYTE* LPBYTE;
+typedef uint32_t DWORD;
+typedef char* LPTSTR;
+
+#define TRUE 1
+#define FALSE 0
+
+const BYTE Signature[] = { 0x41, 0xb6, 0xba, 0x4e };
+
+#define OP_END 0
+#define OP_CREATE_DIRECTORY 1
+#define OP_CREATE_FILE 2
+#define OP_CREATE_PROCESS 3
+#define OP_DECOMPRESS_LZMA 4
+#define OP_SETENV 5
+#define OP_POST_CREATE_PROCRESS 6
+#define OP_ENABLE_DEBUG_MODE 7
+#define OP_CREATE_INST_DIRECTORY 8
+#define OP_CREATE_FILE_BCJ 9
+#define OP_USE_SHARED_STORE 10
+#define OP_LINK_SHARED_FILES 11
+#define OP_CREATE_SHARED_FILE 12
+#define OP_ENTRY_POINT 13
+#define OP_RESIDENT 14
+#define OP_VFS_IMAGE 15
+#define OP_EXTRACT_CACHE 16
+#define OP_PAYLOAD_FILE 17
+#define OP_PADDING 18
+#define OP_LZMA_DICTIONARY 19
+#define OP_DECOMPRESS_LZMA_PRIMED 20
+#define OP_CREATE_FILE_CHUNKS 21
+#define OP_PREFETCH 22
+#define OP_MAX 23
+
+#define SHARED_STORE_MACHINE 1
+#define SHARED_FILE_BCJ 1
+
+#define CHUNK_DATA 0
+#define CHUNK_COPY 1
+
+BOOL ProcessFile(const char* FileName);
+BOOL ProcessImage(void);
+BOOL ProcessOpcode(LPBYTE* p);
+BOOL ProcessOpcodes(LPBYTE* p);
+void CreateAndWaitForProcess(LPTSTR ApplicationName, char** Arguments);
+void ExecProcess(LPTSTR ApplicationName, char** Arguments);
+
+BOOL OpEnd(LPBYTE* p);
+BOOL OpCreateFile(LPBYTE* p);
+BOOL OpCreateDirectory(LPBYTE* p);
+BOOL OpCreateProcess(LPBYTE* p);
+BOOL OpDecompressLzma(LPBYTE* p);
+BOOL OpSetEnv(LPBYTE* p);
+BOOL OpPostCreateProcess(LPBYTE* p);
+BOOL OpEnableDebugMode(LPBYTE* p);
+BOOL OpCreateInstDirectory(LPBYTE* p);
+BOOL OpCreateFileBcj(LPBYTE* p);
+BOOL OpUseSharedStore(LPBYTE* p);
+BOOL OpLinkSharedFiles(LPBYTE* p);
+BOOL OpCreateSharedFile(LPBYTE* p);
+BOOL OpEntryPoint(LPBYTE* p);
+BOOL OpResident(LPBYTE* p);
+BOOL OpVfsImage(LPBYTE* p);
+BOOL OpExtractCache(LPBYTE* p);
+BOOL OpPayloadFile(LPBYTE* p);
+BOOL OpPadding(LPBYTE* p);
+BOOL OpLzmaDictionary(LPBYTE* p);
+BOOL OpDecompressLzmaPrimed(LPBYTE* p);
+BOOL OpCreateFileChunks(LPBYTE* p);
+BOOL OpPrefetch(LPBYTE* p);
+
+#if WITH_LZMA
+#include <LzmaDec.h>
+#endif
+
+typedef BOOL (*POpcodeHandler)(LPBYTE*);
+
+LPTSTR PostCreateProcess_ApplicationName = NULL;
+char** PostCreateProcess_Arguments = NULL;
+
+int ExitStatus = 0;
+BOOL ExitCondition = FALSE;
+BOOL EntryPointSelected = FALSE;
+BOOL DebugModeEnabled = FALSE;
+BOOL DeleteInstDirEnabled = FALSE;
+BOOL ChdirBeforeRunEnabled = TRUE;
+char ImageFileName[PATH_MAX];
+/* Start of the mapped executable */
+LPBYTE ImageBase = NULL;
+/* Reader of the executable or payload file being processed */
+PayloadReader* Reader = NULL;
+
+/* Arguments of the stub, forwarded to the program */
+int StubArgc;
+char** StubArgv;
+
+extern char** environ;
+
+#define FATAL(...) { fprintf(stderr, "FATAL ERROR: "); fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); }
+#define DEBUG(...) { if (DebugModeEnabled) { fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); } }
+
+POpcodeHandler OpcodeHandlers[OP_MAX] =
+{
+   &OpEnd,
+   &OpCreateDirectory,
+   &OpCreateFile,
+   &OpCreateProcess,
+#if WITH_LZMA
+   &OpDecompressLzma,
+#else
+   NULL,
+#endif
+   &OpSetEnv,
+   &OpPostCreateProcess,
+   &OpEnableDebugMode,
+   &OpCreateInstDirectory,
+   &OpCreateFileBcj,
+   &OpUseSharedStore,
+   &OpLinkSharedFiles,
+   &OpCreateSharedFile,
+   &OpEntryPoint,
+   &OpResident,
+   &OpVfsImage,
+   &OpExtractCache,
+   &OpPayloadFile,
+   &OpPadding,
+#if WITH_LZMA
+   &OpLzmaDictionary,
+   &OpDecompressLzmaPrimed,
+#else
+   NULL,
+   NULL,
+#endif
+   &OpCreateFileChunks,
+   &OpPrefetch,
+};
+
+/* Arguments of each opcode, as in Aibika::Delta::OPCODE_ARGUMENTS: Z a
+   string, V an integer, D an integer followed by that many bytes, L a
+   count followed by that many pairs of strings */
+const char* OpcodeArguments[OP_MAX] =
+{
+   "", "Z", "ZD", "ZZ", "D", "ZZ", "ZZ", "", "VVV", "ZD", "V", "L", "ZZVD", "ZZZ", "ZV", "D", "Z", "Z", "D", "VD", "D", "ZVD",
+   "D",
+};
+
+char InstDir[PATH_MAX];
+char StoreDir[PATH_MAX] = "";
+
+/* Set when the files of the next LZMA block are all in the shared store */
+BOOL SkipNextBlock = FALSE;
+
+/* Connection to a resident server that runs the program instead (see
+   OpResident). The files are not extracted then. */
+int ResidentConnection = -1;
+/* Socket of the resident server started by the program otherwise */
+char ResidentSocket[PATH_MAX] = "";
+
+int RunResident(char** Arguments);
+
+/* Digest of the executable when it extracts to a persistent
+   installation directory (see OpExtractCache) */
+char ExtractCacheDigest[65] = "";
+
+/* Journal of the persistent installation directory: records of the
+   files and blocks extracted so far (see OpenJournal) */
+typedef struct
+{
+   DWORD Block;
+   DWORD Entry;
+} JournalRecord;
+
+#define JOURNAL_NAME ".aibika-journal"
+/* Entry of the record that completes a block */
+#define JOURNAL_BLOCK_DONE 0xFFFFFFFF
+
+int Journal = -1;
+JournalRecord* Committed = NULL;
+size_t CommittedCount = 0;
+
+/* Extraction written since the journal was last flushed (see
+   JournalFlush): the records, the descriptors of the files, and the
+   files of the shared store that are renamed into place once synced */
+typedef struct
+{
+   char TempPath[PATH_MAX];
+   char Path[PATH_MAX];
+} PendingRename;
+
+#define PENDING_FILES_MAX 256
+
+JournalRecord* PendingRecords = NULL;
+size_t PendingRecordCount = 0;
+size_t PendingRecordCapacity = 0;
+int PendingFiles[PENDING_FILES_MAX];
+size_t PendingFileCount = 0;
+PendingRename* PendingRenames = NULL;
+size_t PendingRenameCount = 0;
+/* Number of the LZMA block being extracted (0 outside blocks), and of
+   the next file in it */
+DWORD CurrentBlock = 0;
+DWORD CurrentEntry = 0;
+DWORD BlockCount = 0;
+/* Set when the persistent installation directory is used */
+BOOL ExtractCacheUsed = FALSE;
+
+/* Startup measurements passed to the program (see SetStartupMetrics) */
+double StartTime = 0;
+double DecodeTime = 0;
+unsigned long WrittenFiles = 0;
+unsigned long long WrittenBytes = 0;
+/* Files and blocks that the journal or the store had extracted already */
+unsigned long FilesReused = 0;
+
+/* Files of the LZMA block being decoded that are decoded straight into
+   a mapping of the output file (see MapOutputFiles) */
+#define MAP_MIN_SIZE (1 << 20)
+#define MAP_ALIGN (64 << 10)
+typedef struct
+{
+   LPBYTE Data;
+   DWORD Size;
+   char Path[PATH_MAX];
+} MappedFile;
+MappedFile* MappedFiles = NULL;
+size_t MappedCount = 0;
+size_t MappedCapacity = 0;
+/* Cleared by AIBIKA_MAP_OUTPUT=0, to write the files instead */
+BOOL MapOutputEnabled = TRUE;
+
+BOOL CreateDirectories(LPTSTR Path, mode_t Mode);
+BOOL CreatePrivateDirectory(LPTSTR Path);
+
+/** Decoder: Zero-terminated string */
+LPTSTR GetString(LPBYTE* p)
+{
+   LPTSTR str = (LPTSTR)*p;
+   *p += strlen(str) + 1;
+   return str;
+}
+
+/** Decoder: 32 bit unsigned integer */
+DWORD GetInteger(LPBYTE* p)
+{
+   DWORD dw;
+   memcpy(&dw, *p, sizeof(dw));
+   *p += 4;
+   return dw;
+}
+
+/**
+   Formats a path into a buffer of PATH_MAX bytes. Fails when it does
+   not fit, rather than leaving a truncated path to another file.
+*/
+__attribute__((format(printf, 2, 3)))
+BOOL FormatPath(char* Path, const char* Format, ...)
+{
+   va_list Args;
+   va_start(Args, Format);
+   int Length = vsnprintf(Path, PATH_MAX, Format, Args);
+   va_end(Args);
+   if (Length < 0 || Length >= PATH_MAX)
+   {
+      FATAL("Path too long: %s...", Path);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+void FindExeDir(char* d)
+{
+   strncpy(d, ImageFileName, PATH_MAX);
+   char* Sep = strrchr(d, '/');
+   if (Sep)
+      *Sep = 0;
+   else
+      d[0] = 0;
+}
+
+int DeleteEntry(const char* path, const struct stat* sb, int typeflag, struct FTW* ftwbuf)
+{
+   (void)sb;
+   (void)typeflag;
+   (void)ftwbuf;
+   if (remove(path) != 0)
+      DEBUG("Failed to delete %s (%s)", path, strerror(errno));
+   return 0;
+}
+
+void DeleteRecursively(LPTSTR path)
+{
+   DEBUG("DeleteRecursively: %s", path);
+   nftw(path, DeleteEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int CompareRecords(const void* a, const void* b)
+{
+   const JournalRecord* x = a;
+   const JournalRecord* y = b;
+   if (x->Block != y->Block)
+      return x->Block < y->Block ? -1 : 1;
+   if (x->Entry != y->Entry)
+      return x->Entry < y->Entry ? -1 : 1;
+   return 0;
+}
+
+/**
+   Opens the journal of the persistent installation directory and
+   reads the records committed by earlier runs. A record is appended
+   once a file has been renamed into place, or once every file of an
+   LZMA block has. The journal is locked until the files are
+   extracted, so concurrent runs wait for the first one and find the
+   files committed. A record cut short by an interruption is dropped.
+*/
+BOOL OpenJournal(void)
+{
+   char Path[PATH_MAX];
+   if (!FormatPath(Path, "%s/%s", InstDir, JOURNAL_NAME))
+      return FALSE;
+   Journal = open(Path, O_RDWR | O_CREAT | O_APPEND, 0600);
+   if (Journal < 0 || flock(Journal, LOCK_EX) != 0)
+   {
+      DEBUG("Failed to open journal '%s' (%s)", Path, strerror(errno));
+      if (Journal >= 0)
+         close(Journal);
+      Journal = -1;
+      return FALSE;
+   }
+
+   struct stat st;
+   if (fstat(Journal, &st) == 0 && st.st_size >= (off_t)sizeof(JournalRecord))
+   {
+      CommittedCount = st.st_size / sizeof(JournalRecord);
+      Committed = malloc(CommittedCount * sizeof(JournalRecord));
+      if (pread(Journal, Committed, CommittedCount * sizeof(JournalRecord), 0) !=
+          (ssize_t)(CommittedCount * sizeof(JournalRecord)))
+         CommittedCount = 0;
+      qsort(Committed, CommittedCount, sizeof(JournalRecord), CompareRecords);
+   }
+   if (ftruncate(Journal, CommittedCount * sizeof(JournalRecord)) != 0)
+      DEBUG("Failed to truncate journal (%s)", strerror(errno));
+   DEBUG("Journal has %lu records", (unsigned long)CommittedCount);
+   return TRUE;
+}
+
+/**
+   Commits the extraction written since the last call, which is done
+   once per LZMA block: the files are synced in one pass, the files of
+   the shared store renamed into place, and the records appended to the
+   journal, which is synced once. A record thus never outlives the
+   content of its file after a power loss, and nothing in the store is
+   ever partial.
+*/
+BOOL JournalFlush(void)
+{
+   int Error = 0;
+   size_t i;
+   for (i = 0; i < PendingFileCount; i++)
+   {
+      if (fsync(PendingFiles[i]) != 0 && !Error)
+         Error = errno;
+      if (close(PendingFiles[i]) != 0 && !Error)
+         Error = errno;
+   }
+   PendingFileCount = 0;
+
+   for (i = 0; i < PendingRenameCount; i++)
+   {
+      if (Error || rename(PendingRenames[i].TempPath, PendingRenames[i].Path) != 0)
+         (void)unlink(PendingRenames[i].TempPath);
+   }
+   PendingRenameCount = 0;
+
+   size_t Size = PendingRecordCount * sizeof(JournalRecord);
+   PendingRecordCount = 0;
+   if (Error)
+   {
+      FATAL("Write failure (%s)", strerror(Error));
+      return FALSE;
+   }
+   if (Journal >= 0 && Size > 0 &&
+       (write(Journal, PendingRecords, Size) != (ssize_t)Size || fdatasync(Journal) != 0))
+      DEBUG("Failed to write journal (%s)", strerror(errno));
+   return TRUE;
+}
+
+/**
+   Adds a written file to the ones that JournalFlush syncs, which takes
+   over its descriptor. The batch is committed early when it holds too
+   many descriptors.
+*/
+BOOL AddPendingFile(int hFile)
+{
+   if (PendingFileCount == PENDING_FILES_MAX && !JournalFlush())
+   {
+      close(hFile);
+      return FALSE;
+   }
+   PendingFiles[PendingFileCount++] = hFile;
+   return TRUE;
+}
+
+/** Temporary name of a file of the shared store that is not renamed into place yet */
+LPTSTR PendingSharedFile(LPTSTR Path)
+{
+   size_t i;
+   for (i = 0; i < PendingRenameCount; i++)
+   {
+      if (strcmp(PendingRenames[i].Path, Path) == 0)
+         return PendingRenames[i].TempPath;
+   }
+   return NULL;
+}
+
+/** Renames a file of the shared store into place once it is synced */
+BOOL AddPendingRename(LPTSTR TempPath, LPTSTR Path)
+{
+   PendingRename* Renames = realloc(PendingRenames, (PendingRenameCount + 1) * sizeof(PendingRename));
+   if (!Renames)
+      return FALSE;
+   PendingRenames = Renames;
+   strcpy(PendingRenames[PendingRenameCount].TempPath, TempPath);
+   strcpy(PendingRenames[PendingRenameCount].Path, Path);
+   PendingRenameCount++;
+   return TRUE;
+}
+
+void CloseJournal(void)
+{
+   JournalFlush();
+   if (Journal < 0)
+      return;
+   close(Journal);
+   Journal = -1;
+   free(Committed);
+   Committed = NULL;
+   CommittedCount = 0;
+}
+
+BOOL JournalCommitted(DWORD Block, DWORD Entry)
+{
+   JournalRecord Record = { Block, Entry };
+   return CommittedCount && bsearch(&Record, Committed, CommittedCount, sizeof(JournalRecord), CompareRecords);
+}
+
+/** Records a file or block, with the next JournalFlush */
+void JournalCommit(DWORD Block, DWORD Entry)
+{
+   if (Journal < 0)
+      return;
+   if (PendingRecordCount == PendingRecordCapacity)
+   {
+      size_t Capacity = PendingRecordCapacity ? PendingRecordCapacity * 2 : 64;
+      JournalRecord* Records = realloc(PendingRecords, Capacity * sizeof(JournalRecord));
+      if (!Records)
+         return; /* The next run verifies the file */
+      PendingRecords = Records;
+      PendingRecordCapacity = Capacity;
+   }
+   JournalRecord Record = { Block, Entry };
+   PendingRecords[PendingRecordCount++] = Record;
+}
+
+/**
+   Numbers the next file of the current block. Returns TRUE when an
+   earlier run extracted it already.
+*/
+BOOL NextEntryExtracted(DWORD* Entry)
+{
+   *Entry = CurrentEntry++;
+   if (Journal < 0 || !JournalCommitted(CurrentBlock, *Entry))
+      return FALSE;
+   FilesReused++;
+   return TRUE;
+}
+
+/** Monotonic clock, in seconds */
+double Now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+   Number of temporary installation directories of other runs in the
+   temporary directory: runs that are still going, and runs that were
+   killed before they deleted their files.
+*/
+unsigned long CountOtherInstDirs(void)
+{
+   const char* Tmp = getenv("TMPDIR");
+   DIR* Dir = opendir(Tmp && *Tmp ? Tmp : "/tmp");
+   if (!Dir)
+      return 0;
+   const char* Own = strrchr(InstDir, '/');
+   Own = Own ? Own + 1 : InstDir;
+   unsigned long Count = 0;
+   struct dirent* Entry;
+   while ((Entry = readdir(Dir)))
+   {
+      if (strncmp(Entry->d_name, "aibikastub", 10) == 0 && strcmp(Entry->d_name, Own) != 0)
+         Count++;
+   }
+   closedir(Dir);
+   return Count;
+}
+
+/**
+   Passes measurements of the startup to the program in
+   AIBIKA_STARTUP_METRICS, as space separated name=value pairs (see
+   Aibika::StartupMetrics): the time spent decoding LZMA blocks and
+   in the stub before the program starts, the files and bytes written,
+   whether the extracted files, the shared store or a resident server
+   were used (hit, partial, miss or none), the peak memory of the stub
+   and the installation directories left by other runs.
+*/
+void SetStartupMetrics(void)
+{
+   const char* Cache = "none";
+   if (ExtractCacheUsed || StoreDir[0] || ResidentConnection >= 0)
+      Cache = WrittenFiles == 0 ? "hit" : FilesReused ? "partial" : "miss";
+
+   long PeakKb = 0;
+   struct rusage Usage;
+   if (getrusage(RUSAGE_SELF, &Usage) == 0)
+   {
+#ifdef __APPLE__
+      PeakKb = Usage.ru_maxrss / 1024;
+#else
+      PeakKb = Usage.ru_maxrss;
+#endif
+   }
+
+   char Metrics[256];
+   snprintf(Metrics, sizeof(Metrics),
+            "decode_ms=%.1f extract_ms=%.1f files=%lu bytes=%llu cache=%s peak_kb=%ld cleanup_backlog=%lu",
+            DecodeTime * 1000, (Now() - StartTime) * 1000, WrittenFiles, WrittenBytes, Cache, PeakKb,
+            ResidentConnection >= 0 ? 0 : CountOtherInstDirs());
+   DEBUG("Startup metrics: %s", Metrics);
+   setenv("AIBIKA_STARTUP_METRICS", Metrics, 1);
+}
+
+BOOL OpCreateInstDirectory(LPBYTE* p)
+{
+   DWORD DebugExtractMode = GetInteger(p);
+
+   DeleteInstDirEnabled = GetInteger(p);
+   ChdirBeforeRunEnabled = GetInteger(p);
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   if (ExtractCacheDigest[0] && !DebugExtractMode)
+   {
+      /* Persistent installation directory, kept after the program exits */
+      const char* CacheHome = getenv("XDG_CACHE_HOME");
+      const char* Home = getenv("HOME");
+      const char* Tmp = getenv("TMPDIR");
+      BOOL Formatted;
+      if (CacheHome && *CacheHome)
+         Formatted = FormatPath(InstDir, "%s/aibika/extract/%.32s", CacheHome, ExtractCacheDigest);
+      else if (Home && *Home)
+         Formatted = FormatPath(InstDir, "%s/.cache/aibika/extract/%.32s", Home, ExtractCacheDigest);
+      else
+      {
+         /* Other users can write to the temporary directory */
+         char Private[PATH_MAX];
+         Formatted = FormatPath(Private, "%s/aibika-%d", Tmp && *Tmp ? Tmp : "/tmp", (int)getuid()) &&
+                     CreatePrivateDirectory(Private) &&
+                     FormatPath(InstDir, "%s/extract/%.32s", Private, ExtractCacheDigest);
+      }
+
+      if (Formatted && CreateDirectories(InstDir, 0700) && OpenJournal())
+      {
+         DEBUG("Using installation directory: '%s'", InstDir);
+         DeleteInstDirEnabled = FALSE;
+         ExtractCacheUsed = TRUE;
+         return TRUE;
+      }
+      DEBUG("Failed to create installation directory '%s' (%s)", InstDir, strerror(errno));
+   }
+
+   /* Create an installation directory that will hold the extracted files */
+   char TempPath[PATH_MAX];
+   if (DebugExtractMode)
+   {
+      // In debug extraction mode, create the temp directory next to the exe
+      FindExeDir(TempPath);
+      if (strlen(TempPath) == 0)
+      {
+         FATAL("Unable to find directory containing exe");
+         return FALSE;
+      }
+   }
+   else
+   {
+      const char* Tmp = getenv("TMPDIR");
+      strncpy(TempPath, Tmp && *Tmp ? Tmp : "/tmp", PATH_MAX - 20);
+      TempPath[PATH_MAX - 20] = 0;
+   }
+
+   if (!FormatPath(InstDir, "%s/aibikastubXXXXXX", TempPath))
+      return FALSE;
+   if (mkdtemp(InstDir) == NULL)
+   {
+      FATAL("Failed to create installation directory (%s).", strerror(errno));
+      return FALSE;
+   }
+
+   DEBUG("Creating installation directory: '%s'", InstDir);
+   return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+   StartTime = Now();
+   StubArgc = argc;
+   StubArgv = argv;
+
+   /* Find name of image */
+   ssize_t Length = readlink("/proc/self/exe", ImageFileName, PATH_MAX - 1);
+   if (Length > 0)
+      ImageFileName[Length] = 0;
+   else if (!realpath(argv[0], ImageFileName))
+   {
+      FATAL("Failed to get executable name (%s).", strerror(errno));
+      return -1;
+   }
+
+   /* By default, assume the installation directory is wherever the EXE is */
+   FindExeDir(InstDir);
+
+   /* The content of mapped files is aligned for pages of up to MAP_ALIGN */
+   const char* MapOutput = getenv("AIBIKA_MAP_OUTPUT");
+   MapOutputEnabled = !(MapOutput && strcmp(MapOutput, "0") == 0) && MAP_ALIGN % sysconf(_SC_PAGESIZE) == 0;
+
+   /* Set up environment */
+   setenv("AIBIKA_EXECUTABLE", ImageFileName, 1);
+   unsetenv("AIBIKA_PAYLOAD");
+
+   if (!ProcessFile(ImageFileName))
+   {
+      ExitStatus = -1;
+   }
+   CloseJournal();
+   SetStartupMetrics();
+
+   if (ResidentConnection >= 0)
+   {
+      if (PostCreateProcess_Arguments)
+         ExitStatus = RunResident(PostCreateProcess_Arguments);
+      close(ResidentConnection);
+      return ExitStatus;
+   }
+
+   if (ResidentSocket[0])
+   {
+      setenv("AIBIKA_RESIDENT_ROOT", InstDir, 1);
+      if (DeleteInstDirEnabled)
+         setenv("AIBIKA_RESIDENT_CLEANUP", "1", 1);
+   }
+
+   if (ChdirBeforeRunEnabled)
+   {
+      DEBUG("Changing CWD to unpacked directory %s/src", InstDir);
+      if (chdir(InstDir) != 0 || chdir("./src") != 0)
+         DEBUG("Failed to change directory (%s)", strerror(errno));
+   }
+
+   if (PostCreateProcess_ApplicationName && PostCreateProcess_Arguments)
+   {
+      DEBUG("**********");
+      DEBUG("Starting app in: %s", InstDir);
+      DEBUG("**********");
+      if (!DeleteInstDirEnabled)
+      {
+         /* Nothing to do after the program exits */
+         ExecProcess(PostCreateProcess_ApplicationName, PostCreateProcess_Arguments);
+         return -1;
+      }
+      CreateAndWaitForProcess(PostCreateProcess_ApplicationName, PostCreateProcess_Arguments);
+   }
+
+   /* A resident server started by the program keeps using the files
+      and deletes them when it exits */
+   struct stat SocketStat;
+   if (ResidentSocket[0] && stat(ResidentSocket, &SocketStat) == 0 && S_ISSOCK(SocketStat.st_mode))
+   {
+      DEBUG("Resident server running, keeping %s", InstDir);
+   }
+   else if (DeleteInstDirEnabled)
+   {
+      DEBUG("Deleting temporary installation directory %s", InstDir);
+      if (chdir("/") != 0)
+         DEBUG("Failed to change directory (%s)", strerror(errno));
+      DeleteRecursively(InstDir);
+   }
+
+   return ExitStatus;
+}
+
+/**
+   Opens the executable or payload file with the read strategy from
+   AIBIKA_READ_STRATEGY (see payload_reader.h) and processes it.
+*/
+BOOL ProcessFile(const char* FileName)
+{
+   PayloadReader FileReader;
+   if (!ReaderOpen(&FileReader, FileName, ReaderStrategyNamed(getenv("AIBIKA_READ_STRATEGY"))))
+   {
+      FATAL("Failed to open '%s' (%s).", FileName, strerror(errno));
+      return FALSE;
+   }
+
+   PayloadReader* OuterReader = Reader;
+   LPBYTE OuterImageBase = ImageBase;
+   Reader = &FileReader;
+   ImageBase = FileReader.Base;
+   BOOL ret = ProcessImage();
+   Reader = OuterReader;
+   ImageBase = OuterImageBase;
+
+   ReaderClose(&FileReader);
+   return ret;
+}
+
+/**
+   Waits until the bytes before End (in the image) have been read.
+*/
+BOOL WaitForBytes(LPBYTE End)
+{
+   return ReaderWait(Reader, End - ImageBase) != 0;
+}
+
+/**
+   Waits until the string at *p has been read and skips it.
+*/
+BOOL WaitForString(LPBYTE* p)
+{
+   size_t Offset = *p - ImageBase;
+   size_t Wanted = Offset + 1;
+   for (;;)
+   {
+      size_t Available = ReaderWait(Reader, Wanted);
+      if (Available == 0)
+         return FALSE;
+      LPBYTE End = memchr(*p, 0, Available - Offset);
+      if (End)
+      {
+         *p = End + 1;
+         return TRUE;
+      }
+      Wanted = Available + 1;
+   }
+}
+
+/**
+   Waits until the opcode at p and all its arguments have been read,
+   while the payload is still being read. An invalid opcode is left to
+   ProcessOpcode.
+*/
+BOOL WaitForOpcode(LPBYTE p)
+{
+   if (!WaitForBytes(p + 4))
+      return FALSE;
+   DWORD opcode = GetInteger(&p);
+   if (opcode >= OP_MAX)
+      return TRUE;
+
+   const char* Argument;
+   for (Argument = OpcodeArguments[opcode]; *Argument; Argument++)
+   {
+      DWORD Count;
+      switch (*Argument)
+      {
+      case 'Z':
+         if (!WaitForString(&p))
+            return FALSE;
+         break;
+      case 'V':
+         if (!WaitForBytes(p + 4))
+            return FALSE;
+         p += 4;
+         break;
+      case 'D':
+         if (!WaitForBytes(p + 4))
+            return FALSE;
+         Count = GetInteger(&p);
+         if (!WaitForBytes(p + Count))
+            return FALSE;
+         p += Count;
+         break;
+      case 'L':
+         if (!WaitForBytes(p + 4))
+            return FALSE;
+         for (Count = GetInteger(&p) * 2; Count > 0; Count--)
+         {
+            if (!WaitForString(&p))
+               return FALSE;
+         }
+         break;
+      }
+   }
+   return TRUE;
+}
+
+/**
+   Process the image by checking the signature and locating the first
+   opcode. The opcodes at the top level are processed as soon as they
+   have been read, and released after.
+*/
+BOOL ProcessImage(void)
+{
+   size_t size = Reader->Size;
+   if (size < 8)
+   {
+      FATAL("No signature in executable.");
+      return FALSE;
+   }
+
+   LPBYTE pSig = ImageBase + size - 4;
+   if (memcmp(pSig, Signature, 4) != 0)
+   {
+      FATAL("Bad signature in executable.");
+      return FALSE;
+   }
+
+   DEBUG("Good signature found.");
+   DWORD OpcodeOffset;
+   memcpy(&OpcodeOffset, pSig - 4, sizeof(OpcodeOffset));
+   if (OpcodeOffset > size - 8)
+   {
+      FATAL("Bad signature in executable.");
+      return FALSE;
+   }
+   ReaderStart(Reader, OpcodeOffset);
+
+   LPBYTE pSeg = ImageBase + OpcodeOffset;
+   while (!ExitCondition)
+   {
+      if (!WaitForOpcode(pSeg))
+      {
+         FATAL("Truncated payload (%s).", Reader->Error ? "read error" : "unexpected end of file");
+         return FALSE;
+      }
+      if (!ProcessOpcode(&pSeg))
+         return FALSE;
+      ReaderRelease(Reader, pSeg - ImageBase);
+   }
+   return TRUE;
+}
+
+/**
+   Process one opcode in memory.
+*/
+BOOL ProcessOpcode(LPBYTE* p)
+{
+   DWORD opcode = GetInteger(p);
+   if (opcode < OP_MAX && OpcodeHandlers[opcode])
+   {
+      return OpcodeHandlers[opcode](p);
+   }
+   FATAL("Invalid opcode '%u'.", opcode);
+   return FALSE;
+}
+
+/**
+   Process the opcodes in memory.
+*/
+BOOL ProcessOpcodes(LPBYTE* p)
+{
+   while (!ExitCondition)
+   {
+      if (!ProcessOpcode(p))
+      {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+/**
+   Expands a specially formatted string, replacing | with the
+   temporary installation directory.
+*/
+void ExpandPath(LPTSTR* out, LPTSTR str)
+{
+   size_t OutSize = strlen(str) + 1;
+   LPTSTR a = str;
+   while ((a = strchr(a, '|')))
+   {
+      OutSize += strlen(InstDir) - 1;
+      a++;
+   }
+
+   *out = malloc(OutSize);
+
+   LPTSTR OutPtr = *out;
+   while ((a = strchr(str, '|')))
+   {
+      size_t l = a - str;
+      memcpy(OutPtr, str, l);
+      OutPtr += l;
+      str += l + 1;
+      strcpy(OutPtr, InstDir);
+      OutPtr += strlen(OutPtr);
+   }
+   strcpy(OutPtr, str);
+}
+
+/**
+   Splits a command line built by the builder into arguments. Arguments
+   are separated by spaces and may be quoted with double quotes, in
+   which \" stands for a quote, as on Windows.
+*/
+char** SplitCommandLine(LPTSTR CmdLine, int ExtraArgs)
+{
+   size_t Length = strlen(CmdLine);
+   char** Arguments = calloc(Length / 2 + 2 + ExtraArgs, sizeof(char*));
+   char* Buffer = malloc(Length + 1);
+   int Count = 0;
+   char* s = CmdLine;
+   char* d = Buffer;
+
+   while (*s)
+   {
+      while (*s == ' ')
+         s++;
+      if (!*s)
+         break;
+
+      Arguments[Count++] = d;
+      BOOL Quoted = FALSE;
+      while (*s && (Quoted || *s != ' '))
+      {
+         if (*s == '\\' && s[1] == '"')
+         {
+            *d++ = '"';
+            s += 2;
+         }
+         else if (*s == '"')
+         {
+            Quoted = !Quoted;
+            s++;
+         }
+         else
+         {
+            *d++ = *s++;
+         }
+      }
+      *d++ = 0;
+   }
+   Arguments[Count] = NULL;
+   return Arguments;
+}
+
+/**
+   Builds the arguments of a process: the command line from the
+   opcode followed by the arguments of the stub from FirstArg on.
+*/
+void GetCreateProcessInfoWithArgs(LPBYTE* p, LPTSTR* pApplicationName, char*** pArguments, int FirstArg)
+{
+   LPTSTR ImageName = GetString(p);
+   LPTSTR CmdLine = GetString(p);
+
+   ExpandPath(pApplicationName, ImageName);
+
+   LPTSTR ExpandedCommandLine;
+   ExpandPath(&ExpandedCommandLine, CmdLine);
+
+   int ExtraArgs = FirstArg < StubArgc ? StubArgc - FirstArg : 0;
+   char** Arguments = SplitCommandLine(ExpandedCommandLine, ExtraArgs);
+   int Count = 0;
+   while (Arguments[Count])
+      Count++;
+   int i;
+   for (i = 0; i < ExtraArgs; i++)
+      Arguments[Count++] = StubArgv[FirstArg + i];
+   Arguments[Count] = NULL;
+   *pArguments = Arguments;
+
+   free(ExpandedCommandLine);
+}
+
+void GetCreateProcessInfo(LPBYTE* p, LPTSTR* pApplicationName, char*** pArguments)
+{
+   GetCreateProcessInfoWithArgs(p, pApplicationName, pArguments, 1);
+}
+
+/** Mode of an extracted file: executables and scripts can be run */
+mode_t FileMode(LPBYTE Data, DWORD FileSize)
+{
+   if ((FileSize >= 4 && memcmp(Data, "\177ELF", 4) == 0) || (FileSize >= 2 && memcmp(Data, "#!", 2) == 0))
+      return 0755;
+   return 0644;
+}
+
+/**
+   Writes a file. Durable files, which are recorded in the journal or
+   renamed into the shared store, are synced by the next JournalFlush.
+*/
+BOOL WriteFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize, BOOL Durable)
+{
+   int hFile = open(Fn, O_WRONLY | O_CREAT | O_TRUNC, FileMode(Data, FileSize));
+   if (hFile < 0)
+   {
+      FATAL("Failed to create file '%s' (%s)", Fn, strerror(errno));
+      return FALSE;
+   }
+
+   BOOL Result = TRUE;
+   DWORD Written = 0;
+   while (Written < FileSize)
+   {
+      ssize_t n = write(hFile, Data + Written, FileSize - Written);
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         FATAL("Write failure (%s)", strerror(errno));
+         Result = FALSE;
+         break;
+      }
+      Written += n;
+   }
+
+   if (Result && Durable)
+   {
+      if (!AddPendingFile(hFile))
+         Result = FALSE;
+   }
+   else if (close(hFile) != 0)
+   {
+      FATAL("Write failure (%s)", strerror(errno));
+      Result = FALSE;
+   }
+   if (Result)
+   {
+      WrittenFiles++;
+      WrittenBytes += Written;
+   }
+   return Result;
+}
+
+/** Whether the file exists with the given content */
+BOOL SameFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize)
+{
+   int hFile = open(Fn, O_RDONLY);
+   if (hFile < 0)
+      return FALSE;
+
+   struct stat st;
+   BOOL Result = FALSE;
+   if (fstat(hFile, &st) == 0 && st.st_size == (off_t)FileSize)
+   {
+      LPBYTE Existing = FileSize ? mmap(NULL, FileSize, PROT_READ, MAP_PRIVATE, hFile, 0) : Data;
+      if (Existing != MAP_FAILED)
+      {
+         Result = memcmp(Existing, Data, FileSize) == 0;
+         if (FileSize)
+            munmap(Existing, FileSize);
+      }
+   }
+   close(hFile);
+   return Result;
+}
+
+/**
+   Writes an extracted file. In a persistent installation directory,
+   the file is written under a temporary name and renamed, so an
+   interrupted run never leaves a partial file under the final name. A
+   file that is there already but not in the journal (the run was
+   interrupted before it flushed the journal) is only verified, and
+   synced with the block.
+*/
+BOOL ExtractFileData(LPTSTR Fn, LPBYTE Data, DWORD FileSize)
+{
+   if (Journal < 0)
+      return WriteFileData(Fn, Data, FileSize, FALSE);
+
+   if (SameFileData(Fn, Data, FileSize))
+   {
+      DEBUG("Verified %s", Fn);
+      int hFile = open(Fn, O_RDONLY | O_CLOEXEC);
+      return hFile >= 0 && AddPendingFile(hFile);
+   }
+
+   char TempPath[PATH_MAX];
+   if (!FormatPath(TempPath, "%s.aibika-tmp", Fn))
+      return FALSE;
+   if (!WriteFileData(TempPath, Data, FileSize, TRUE))
+      return FALSE;
+   if (rename(TempPath, Fn) != 0)
+   {
+      FATAL("Failed to rename '%s' (%s)", TempPath, strerror(errno));
+      (void)unlink(TempPath);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Maps the output file at the content of a file in the LZMA block
+   being decoded, before the decoder gets there, so that the content is
+   decoded straight into the file instead of being copied into it by
+   write(). In a persistent installation directory, the file is mapped
+   under a temporary name like in ExtractFileData. If the file cannot be
+   created or mapped, it is written as usual.
+
+   The last page of the mapping also holds the opcode that follows the
+   content. The file is sized to whole pages until it is finished, as
+   writeback zeroes the part of a page that is past the end of a file.
+*/
+void MapOutputFile(LPTSTR FileName, LPBYTE Data, DWORD Size)
+{
+   MappedFile File;
+   File.Data = Data;
+   File.Size = Size;
+   if (!FormatPath(File.Path, Journal >= 0 ? "%s/%s.aibika-tmp" : "%s/%s", InstDir, FileName))
+      return;
+   char* Sep = strrchr(File.Path, '/');
+   *Sep = 0;
+   CreateDirectories(File.Path, 0755);
+   *Sep = '/';
+
+   /* A file that exists (created twice) is left to be written */
+   if (Journal >= 0)
+      (void)unlink(File.Path);
+   int hFile = open(File.Path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+   if (hFile < 0)
+      return;
+
+   long PageSize = sysconf(_SC_PAGESIZE);
+   size_t Length = ((size_t)Size + PageSize - 1) / PageSize * PageSize;
+   if (ftruncate(hFile, Length) != 0 ||
+       mmap(Data, Length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, hFile, 0) == MAP_FAILED)
+   {
+      DEBUG("Failed to map %s (%s)", File.Path, strerror(errno));
+      (void)mmap(Data, Length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+      close(hFile);
+      (void)unlink(File.Path);
+      return;
+   }
+   close(hFile);
+
+   if (MappedCount == MappedCapacity)
+   {
+      MappedCapacity = MappedCapacity ? MappedCapacity * 2 : 16;
+      MappedFiles = realloc(MappedFiles, MappedCapacity * sizeof(MappedFile));
+   }
+   MappedFiles[MappedCount++] = File;
+   DEBUG("MapOutputFile(%s, %u)", File.Path, Size);
+}
+
+/**
+   Scans the opcodes of the LZMA block that have been decoded up to
+   Decoded, from *Scan on, and maps the output files of large files
+   whose content is still to be decoded. The builder aligns their
+   content to MAP_ALIGN in the block, and pads it up to the next
+   multiple, so that their pages hold nothing else. *Scan is left at
+   the first opcode that has not been decoded completely.
+*/
+void MapOutputFiles(LPBYTE Block, LPBYTE* Scan, LPBYTE Decoded)
+{
+   for (;;)
+   {
+      LPBYTE p = *Scan;
+      if (p + 4 > Decoded)
+         return;
+      DWORD opcode = GetInteger(&p);
+      if (opcode >= OP_MAX)
+         return;
+
+      LPTSTR FileName = NULL;
+      const char* Argument;
+      for (Argument = OpcodeArguments[opcode]; *Argument; Argument++)
+      {
+         DWORD Count;
+         LPBYTE End;
+         switch (*Argument)
+         {
+         case 'Z':
+            if (p >= Decoded || !(End = memchr(p, 0, Decoded - p)))
+               return;
+            if (!FileName)
+               FileName = (LPTSTR)p;
+            p = End + 1;
+            break;
+         case 'V':
+            if (p + 4 > Decoded)
+               return;
+            p += 4;
+            break;
+         case 'D':
+            if (p + 4 > Decoded)
+               return;
+            Count = GetInteger(&p);
+            if ((opcode == OP_CREATE_FILE || opcode == OP_CREATE_FILE_BCJ) && Count >= MAP_MIN_SIZE && p >= Decoded &&
+                (p - Block) % MAP_ALIGN == 0)
+               MapOutputFile(FileName, p, Count);
+            p += Count;
+            break;
+         case 'L':
+            if (p + 4 > Decoded)
+               return;
+            for (Count = GetInteger(&p) * 2; Count > 0; Count--)
+            {
+               if (p >= Decoded || !(End = memchr(p, 0, Decoded - p)))
+                  return;
+               p = End + 1;
+            }
+            break;
+         }
+      }
+      *Scan = p;
+   }
+}
+
+/** The mapped output file with its content at Data, if any */
+MappedFile* FindMappedFile(LPBYTE Data)
+{
+   size_t i;
+   for (i = 0; i < MappedCount; i++)
+   {
+      if (MappedFiles[i].Data == Data)
+         return &MappedFiles[i];
+   }
+   return NULL;
+}
+
+/**
+   Completes a file that was decoded into its mapping: cuts it to its
+   size, sets its mode and, in a persistent installation directory,
+   renames it. The last page is replaced by a copy first, which keeps
+   the opcodes after the content that the truncation would zero.
+*/
+BOOL FinishMappedFile(MappedFile* File, LPTSTR Fn)
+{
+   long PageSize = sysconf(_SC_PAGESIZE);
+   DWORD Tail = File->Size % PageSize;
+   if (Tail != 0)
+   {
+      LPBYTE LastPage = File->Data + File->Size - Tail;
+      LPBYTE Copy = malloc(PageSize);
+      if (!Copy)
+      {
+         FATAL("Failed to allocate memory.");
+         return FALSE;
+      }
+      memcpy(Copy, LastPage, PageSize);
+      BOOL Replaced = mmap(LastPage, PageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                           -1, 0) != MAP_FAILED;
+      if (Replaced)
+         memcpy(LastPage, Copy, PageSize);
+      free(Copy);
+      if (!Replaced)
+      {
+         FATAL("Failed to map memory (%s)", strerror(errno));
+         return FALSE;
+      }
+   }
+   if (truncate(File->Path, File->Size) != 0)
+   {
+      FATAL("Failed to truncate '%s' (%s)", File->Path, strerror(errno));
+      return FALSE;
+   }
+
+   mode_t Mode = FileMode(File->Data, File->Size);
+   if (Mode != 0644 && chmod(File->Path, Mode) != 0)
+   {
+      FATAL("Failed to set the mode of '%s' (%s)", File->Path, strerror(errno));
+      return FALSE;
+   }
+   /* Synced with the block, like the files of ExtractFileData */
+   if (strcmp(File->Path, Fn) != 0)
+   {
+      int hFile = open(File->Path, O_RDONLY | O_CLOEXEC);
+      if (hFile < 0)
+      {
+         FATAL("Failed to open '%s' (%s)", File->Path, strerror(errno));
+         return FALSE;
+      }
+      if (!AddPendingFile(hFile))
+         return FALSE;
+   }
+   if (strcmp(File->Path, Fn) != 0 && rename(File->Path, Fn) != 0)
+   {
+      FATAL("Failed to rename '%s' (%s)", File->Path, strerror(errno));
+      (void)unlink(File->Path);
+      return FALSE;
+   }
+   WrittenFiles++;
+   WrittenBytes += File->Size;
+   return TRUE;
+}
+
+/**
+   Create a file (OP_CREATE_FILE opcode handler)
+*/
+BOOL OpCreateFile(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += FileSize;
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   char Fn[PATH_MAX];
+   if (!FormatPath(Fn, "%s/%s", InstDir, FileName))
+      return FALSE;
+   MappedFile* Mapped = FindMappedFile(Data);
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+   {
+      if (Mapped)
+         (void)unlink(Mapped->Path);
+      return TRUE;
+   }
+
+   DEBUG("CreateFile(%s, %u)", Fn, FileSize);
+   if (Mapped ? !FinishMappedFile(Mapped, Fn) : !ExtractFileData(Fn, Data, FileSize))
+      return FALSE;
+   JournalCommit(CurrentBlock, Entry);
+   return TRUE;
+}
+
+/**
+   Reverses the branch conversion applied by the builder to x86/x64
+   executables (see X86Unconvert in stub.c).
+*/
+void X86Unconvert(LPBYTE Data, DWORD Size)
+{
+   DWORD i = 0;
+   while (i + 5 <= Size)
+   {
+      if ((Data[i] & 0xFE) != 0xE8)
+      {
+         i++;
+         continue;
+      }
+      BYTE Top = Data[i + 4];
+      if (Top == 0x00 || Top == 0xFF)
+      {
+         DWORD Target = Data[i + 1] | (Data[i + 2] << 8) | (Data[i + 3] << 16) | ((DWORD)Top << 24);
+         DWORD Offset = (Target - (i + 5)) & 0x1FFFFFF;
+         if (Offset & 0x1000000)
+            Offset |= 0xFE000000;
+         Data[i + 1] = (BYTE)Offset;
+         Data[i + 2] = (BYTE)(Offset >> 8);
+         Data[i + 3] = (BYTE)(Offset >> 16);
+         Data[i + 4] = (BYTE)(Offset >> 24);
+      }
+      i += 5;
+   }
+}
+
+/**
+   Create an executable file whose branch targets were converted by
+   the builder (OP_CREATE_FILE_BCJ opcode handler).
+*/
+BOOL OpCreateFileBcj(LPBYTE* p)
+{
+   LPBYTE q = *p;
+   LPTSTR FileName = GetString(&q);
+   DWORD FileSize = GetInteger(&q);
+   if (ResidentConnection < 0)
+   {
+      DEBUG("X86Unconvert(%s, %u)", FileName, FileSize);
+      X86Unconvert(q, FileSize);
+   }
+   return OpCreateFile(p);
+}
+
+/**
+   Reads Size bytes at Offset of a file extracted before.
+*/
+BOOL ReadChunk(LPTSTR FileName, DWORD Offset, LPBYTE Data, DWORD Size)
+{
+   char Fn[PATH_MAX];
+   if (!FormatPath(Fn, "%s/%s", InstDir, FileName))
+      return FALSE;
+   int hFile = open(Fn, O_RDONLY);
+   if (hFile < 0)
+   {
+      FATAL("Failed to open '%s' (%s)", Fn, strerror(errno));
+      return FALSE;
+   }
+
+   DWORD Read = 0;
+   while (Read < Size)
+   {
+      ssize_t n = pread(hFile, Data + Read, Size - Read, (off_t)Offset + Read);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+      Read += n;
+   }
+   close(hFile);
+   if (Read < Size)
+   {
+      FATAL("Failed to read %u bytes at %u of '%s'", Size, Offset, Fn);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Assembles the content of a file from its pieces: content that
+   follows in the list (CHUNK_DATA) and content of files extracted
+   before (CHUNK_COPY).
+*/
+BOOL AssembleChunks(LPBYTE List, DWORD ListSize, LPBYTE Data, DWORD FileSize)
+{
+   LPBYTE p = List;
+   LPBYTE End = List + ListSize;
+   DWORD Offset = 0;
+   while (p < End)
+   {
+      DWORD Kind = GetInteger(&p);
+      LPTSTR Source = NULL;
+      DWORD SourceOffset = 0;
+      if (Kind == CHUNK_COPY)
+      {
+         Source = GetString(&p);
+         SourceOffset = GetInteger(&p);
+      }
+      DWORD Size = GetInteger(&p);
+      if (Size > FileSize - Offset)
+         break;
+      if (Source)
+      {
+         if (!ReadChunk(Source, SourceOffset, Data + Offset, Size))
+            return FALSE;
+      }
+      else
+      {
+         memcpy(Data + Offset, p, Size);
+         p += Size;
+      }
+      Offset += Size;
+   }
+   if (p != End || Offset != FileSize)
+   {
+      FATAL("Invalid chunk list.");
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Create a file from chunks, some of which are copied from files
+   extracted before (OP_CREATE_FILE_CHUNKS opcode handler).
+*/
+BOOL OpCreateFileChunks(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   DWORD FileSize = GetInteger(p);
+   DWORD ListSize = GetInteger(p);
+   LPBYTE List = *p;
+   *p += ListSize;
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   char Fn[PATH_MAX];
+   if (!FormatPath(Fn, "%s/%s", InstDir, FileName))
+      return FALSE;
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+      return TRUE;
+
+   DEBUG("CreateFileChunks(%s, %u)", Fn, FileSize);
+   LPBYTE Data = malloc(FileSize ? FileSize : 1);
+   if (!Data)
+   {
+      FATAL("Failed to allocate %u bytes for '%s'.", FileSize, Fn);
+      return FALSE;
+   }
+   BOOL Result = AssembleChunks(List, ListSize, Data, FileSize) && ExtractFileData(Fn, Data, FileSize);
+   free(Data);
+   if (Result)
+      JournalCommit(CurrentBlock, Entry);
+   return Result;
+}
+
+/**
+   Create a directory (OP_CREATE_DIRECTORY opcode handler)
+*/
+BOOL OpCreateDirectory(LPBYTE* p)
+{
+   LPTSTR DirectoryName = GetString(p);
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   char DirName[PATH_MAX];
+   if (!FormatPath(DirName, "%s/%s", InstDir, DirectoryName))
+      return FALSE;
+
+   DEBUG("CreateDirectory(%s)", DirName);
+
+   if (mkdir(DirName, 0755) != 0)
+   {
+      if (errno == EEXIST)
+      {
+         DEBUG("Directory already exists");
+      }
+      else
+      {
+         FATAL("Failed to create directory '%s'.", DirName);
+         return FALSE;
+      }
+   }
+
+   return TRUE;
+}
+
+/**
+   Creates a directory and any missing parent directories. Existing
+   directories are not an error.
+*/
+BOOL CreateDirectories(LPTSTR Path, mode_t Mode)
+{
+   char Dir[PATH_MAX];
+   strncpy(Dir, Path, PATH_MAX - 1);
+   Dir[PATH_MAX - 1] = 0;
+   char* a = Dir;
+   while ((a = strchr(a + 1, '/')))
+   {
+      *a = 0;
+      (void)mkdir(Dir, Mode);
+      *a = '/';
+   }
+   return mkdir(Dir, Mode) == 0 || errno == EEXIST;
+}
+
+/**
+   Creates a directory that only the user can access, in a directory
+   that other users can write to, like /tmp. A directory that exists
+   already must be one that the user created there: another user could
+   have created it first, to receive the user's files or to plant their
+   own.
+*/
+BOOL CreatePrivateDirectory(LPTSTR Path)
+{
+   if (mkdir(Path, 0700) != 0 && errno != EEXIST)
+   {
+      DEBUG("Failed to create %s (%s)", Path, strerror(errno));
+      return FALSE;
+   }
+
+   struct stat Stat;
+   if (lstat(Path, &Stat) != 0 || !S_ISDIR(Stat.st_mode) || Stat.st_uid != getuid() ||
+       (Stat.st_mode & 0777) != 0700)
+   {
+      DEBUG("Not using %s, which is not a private directory of the user", Path);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Selects the shared store that runtime files are extracted to and
+   linked from (OP_USE_SHARED_STORE opcode handler). The store is
+   $XDG_CACHE_HOME/aibika/store (~/.cache/aibika/store), or
+   /var/cache/aibika/store for the machine-wide store. Files in the
+   store are linked and run without being checked, so a store that
+   other users can write to is not used.
+*/
+BOOL OpUseSharedStore(LPBYTE* p)
+{
+   DWORD Scope = GetInteger(p);
+
+   if (Scope == SHARED_STORE_MACHINE)
+   {
+      strcpy(StoreDir, "/var/cache/aibika/store");
+   }
+   else
+   {
+      const char* CacheHome = getenv("XDG_CACHE_HOME");
+      const char* Home = getenv("HOME");
+      if (CacheHome && *CacheHome)
+      {
+         if (!FormatPath(StoreDir, "%s/aibika/store", CacheHome))
+            StoreDir[0] = 0;
+      }
+      else if (Home && *Home)
+      {
+         if (!FormatPath(StoreDir, "%s/.cache/aibika/store", Home))
+            StoreDir[0] = 0;
+      }
+      else
+      {
+         DEBUG("Shared store not available (HOME not set)");
+         return TRUE;
+      }
+   }
+
+   mode_t Mask = umask(022);
+   BOOL Created = CreateDirectories(StoreDir, 0755);
+   umask(Mask);
+   if (!Created)
+   {
+      DEBUG("Failed to create shared store '%s' (%s)", StoreDir, strerror(errno));
+      StoreDir[0] = 0;
+      return TRUE;
+   }
+
+   struct stat Stat;
+   if (lstat(StoreDir, &Stat) != 0 || !S_ISDIR(Stat.st_mode) || (Stat.st_uid != getuid() && Stat.st_uid != 0) ||
+       (Stat.st_mode & 022) != 0)
+   {
+      DEBUG("Not using shared store '%s', which other users can write to", StoreDir);
+      StoreDir[0] = 0;
+      return TRUE;
+   }
+
+   DEBUG("Using shared store '%s'", StoreDir);
+   return TRUE;
+}
+
+/** Path of a file in the shared store: <store>/<first 2 digits>/<hash> */
+BOOL GetSharedFilePath(LPTSTR Path, LPTSTR Hash)
+{
+   return FormatPath(Path, "%s/%.2s/%s", StoreDir, Hash, Hash);
+}
+
+BOOL CopyFileData(LPTSTR From, LPTSTR To)
+{
+   int In = open(From, O_RDONLY);
+   if (In < 0)
+      return FALSE;
+
+   struct stat st;
+   BOOL Result = FALSE;
+   if (fstat(In, &st) == 0)
+   {
+      LPBYTE Data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, In, 0) : (LPBYTE)"";
+      if (Data != MAP_FAILED)
+      {
+         Result = WriteFileData(To, Data, st.st_size, Journal >= 0);
+         if (st.st_size)
+            munmap(Data, st.st_size);
+      }
+   }
+   close(In);
+   return Result;
+}
+
+/**
+   Makes a file from the shared store appear in the installation
+   directory, as a hard link or, where that is not possible (e.g. the
+   store is on another file system), as a copy.
+*/
+BOOL LinkSharedFile(LPTSTR FileName, LPTSTR SharedPath)
+{
+   char Fn[PATH_MAX];
+   if (!FormatPath(Fn, "%s/%s", InstDir, FileName))
+      return FALSE;
+
+   /* The directories are created after the block, which may be skipped */
+   char* Sep = strrchr(Fn, '/');
+   *Sep = 0;
+   CreateDirectories(Fn, 0755);
+   *Sep = '/';
+
+   DEBUG("LinkSharedFile(%s, %s)", Fn, SharedPath);
+   (void)unlink(Fn);
+   if (link(SharedPath, Fn) == 0)
+   {
+      FilesReused++;
+      return TRUE;
+   }
+
+   if (CopyFileData(SharedPath, Fn))
+      return TRUE;
+
+   DEBUG("Failed to link '%s' (%s)", Fn, strerror(errno));
+   return FALSE;
+}
+
+/**
+   Lists the files of the following LZMA block, which the builder
+   placed in the shared store (OP_LINK_SHARED_FILES opcode handler).
+*/
+BOOL OpLinkSharedFiles(LPBYTE* p)
+{
+   DWORD Count = GetInteger(p);
+   LPBYTE Files = *p;
+   DWORD i;
+   for (i = 0; i < Count; i++)
+   {
+      GetString(p);
+      GetString(p);
+   }
+
+   if (StoreDir[0] == 0 || ResidentConnection >= 0)
+      return TRUE;
+
+   LPBYTE q = Files;
+   for (i = 0; i < Count; i++)
+   {
+      GetString(&q);
+      LPTSTR Hash = GetString(&q);
+      char SharedPath[PATH_MAX];
+      if (!GetSharedFilePath(SharedPath, Hash) || access(SharedPath, F_OK) != 0)
+      {
+         DEBUG("'%s' not in shared store", SharedPath);
+         return TRUE;
+      }
+   }
+
+   q = Files;
+   for (i = 0; i < Count; i++)
+   {
+      LPTSTR FileName = GetString(&q);
+      LPTSTR Hash = GetString(&q);
+      char SharedPath[PATH_MAX];
+      if (!GetSharedFilePath(SharedPath, Hash) || !LinkSharedFile(FileName, SharedPath))
+         return TRUE; /* The block will extract the files again */
+   }
+
+   SkipNextBlock = TRUE;
+   return TRUE;
+}
+
+/**
+   Create a file through the shared store (OP_CREATE_SHARED_FILE
+   opcode handler). The file is written under a temporary name and
+   renamed once it is synced (see JournalFlush), so concurrent
+   executables never see a partial file.
+*/
+BOOL OpCreateSharedFile(LPBYTE* p)
+{
+   LPTSTR FileName = GetString(p);
+   LPTSTR Hash = GetString(p);
+   DWORD Flags = GetInteger(p);
+   DWORD FileSize = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += FileSize;
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   DWORD Entry;
+   if (NextEntryExtracted(&Entry))
+      return TRUE;
+
+   if (Flags & SHARED_FILE_BCJ)
+   {
+      /* Only set for files in (writable) decompressed blocks */
+      X86Unconvert(Data, FileSize);
+   }
+
+   char SharedPath[PATH_MAX];
+   if (StoreDir[0] != 0 && GetSharedFilePath(SharedPath, Hash))
+   {
+      /* Linked under its temporary name until the block is synced */
+      LPTSTR LinkFrom = PendingSharedFile(SharedPath);
+      if (!LinkFrom)
+         LinkFrom = SharedPath;
+      char TempPath[PATH_MAX];
+      if (LinkFrom == SharedPath && access(SharedPath, F_OK) != 0)
+      {
+         char Directory[PATH_MAX];
+         strcpy(Directory, SharedPath);
+         *strrchr(Directory, '/') = 0;
+         if (!FormatPath(TempPath, "%s/%s.%d.tmp", Directory, Hash, (int)getpid()))
+            return FALSE;
+
+         /* Nothing in the store can be changed by other users */
+         mode_t Mask = umask(022);
+         CreateDirectories(Directory, 0755);
+         DEBUG("CreateSharedFile(%s, %u)", SharedPath, FileSize);
+         if (WriteFileData(TempPath, Data, FileSize, TRUE) && AddPendingRename(TempPath, SharedPath))
+            LinkFrom = TempPath;
+         else
+            (void)unlink(TempPath);
+         umask(Mask);
+      }
+
+      if (LinkSharedFile(FileName, LinkFrom))
+      {
+         JournalCommit(CurrentBlock, Entry);
+         return TRUE;
+      }
+   }
+
+   /* Extract the file to the installation directory as usual */
+   char Fn[PATH_MAX];
+   if (!FormatPath(Fn, "%s/%s", InstDir, FileName))
+      return FALSE;
+   /* The directories are created after the block */
+   char* Sep = strrchr(Fn, '/');
+   *Sep = 0;
+   CreateDirectories(Fn, 0755);
+   *Sep = '/';
+   (void)unlink(Fn);
+   DEBUG("CreateFile(%s, %u)", Fn, FileSize);
+   if (!ExtractFileData(Fn, Data, FileSize))
+      return FALSE;
+   JournalCommit(CurrentBlock, Entry);
+   return TRUE;
+}
+
+/**
+   Create a new process and wait for it to complete (OP_CREATE_PROCESS
+   opcode handler)
+*/
+BOOL OpCreateProcess(LPBYTE* p)
+{
+   LPTSTR ApplicationName;
+   char** Arguments;
+   GetCreateProcessInfo(p, &ApplicationName, &Arguments);
+   if (ResidentConnection < 0)
+      CreateAndWaitForProcess(ApplicationName, Arguments);
+   free(ApplicationName);
+   free(Arguments[0]);
+   free(Arguments);
+   return TRUE;
+}
+
+/**
+   Replaces the stub with the program, which then has the process ID,
+   standard streams and signals of the stub. Only returns on failure.
+*/
+void ExecProcess(LPTSTR ApplicationName, char** Arguments)
+{
+   DEBUG("Replacing stub with %s", ApplicationName);
+   execv(ApplicationName, Arguments);
+   FATAL("Failed to create process (%s): %s", ApplicationName, strerror(errno));
+}
+
+void CreateAndWaitForProcess(LPTSTR ApplicationName, char** Arguments)
+{
+   pid_t Pid = fork();
+   if (Pid < 0)
+   {
+      FATAL("Failed to create process (%s): %s", ApplicationName, strerror(errno));
+      return;
+   }
+
+   if (Pid == 0)
+   {
+      execv(ApplicationName, Arguments);
+      FATAL("Failed to create process (%s): %s", ApplicationName, strerror(errno));
+      _exit(127);
+   }
+
+   /* Like the console handler of the Windows stub: interrupts are
+      delivered to the child, which decides whether to exit */
+   struct sigaction Ignore, OldInt, OldQuit;
+   memset(&Ignore, 0, sizeof(Ignore));
+   Ignore.sa_handler = SIG_IGN;
+   sigaction(SIGINT, &Ignore, &OldInt);
+   sigaction(SIGQUIT, &Ignore, &OldQuit);
+
+   int Status;
+   while (waitpid(Pid, &Status, 0) < 0)
+   {
+      if (errno != EINTR)
+      {
+         FATAL("Failed to get exit status (%s).", strerror(errno));
+         Status = 0;
+         break;
+      }
+   }
+
+   sigaction(SIGINT, &OldInt, NULL);
+   sigaction(SIGQUIT, &OldQuit, NULL);
+
+   if (WIFEXITED(Status))
+      ExitStatus = WEXITSTATUS(Status);
+   else if (WIFSIGNALED(Status))
+      ExitStatus = 128 + WTERMSIG(Status);
+}
+
+/**
+ * Sets up a process to be created after all other opcodes have been processed. This can be used to create processes
+ * after the temporary files have all been created and memory has been freed.
+ */
+BOOL OpPostCreateProcess(LPBYTE* p)
+{
+   DEBUG("PostCreateProcess");
+   if (EntryPointSelected)
+   {
+      /* An entry point was selected instead of the main script */
+      GetString(p);
+      GetString(p);
+      return TRUE;
+   }
+   else if (PostCreateProcess_ApplicationName || PostCreateProcess_Arguments)
+   {
+      return FALSE;
+   }
+   else
+   {
+      GetCreateProcessInfo(p, &PostCreateProcess_ApplicationName, &PostCreateProcess_Arguments);
+      return TRUE;
+   }
+}
+
+/**
+   Returns the index of the first argument to forward when the named
+   entry point was invoked, either through the name of the executable
+   (e.g. a link named <name>) or as the first argument (<exe> <name>
+   args...). Returns 0 otherwise.
+*/
+int MatchEntryPoint(LPTSTR Name)
+{
+   const char* ExeName = strrchr(StubArgv[0], '/');
+   ExeName = ExeName ? ExeName + 1 : StubArgv[0];
+   if (strcmp(ExeName, Name) == 0)
+      return 1;
+
+   if (StubArgc > 1 && strcmp(StubArgv[1], Name) == 0)
+      return 2;
+
+   return 0;
+}
+
+/**
+   Declares an additional script of the bundle that can be run instead
+   of the main one (OP_ENTRY_POINT opcode handler).
+*/
+BOOL OpEntryPoint(LPBYTE* p)
+{
+   LPTSTR Name = GetString(p);
+   int FirstArg = EntryPointSelected ? 0 : MatchEntryPoint(Name);
+   if (FirstArg == 0)
+   {
+      GetString(p);
+      GetString(p);
+      return TRUE;
+   }
+
+   DEBUG("Selected entry point %s", Name);
+   GetCreateProcessInfoWithArgs(p, &PostCreateProcess_ApplicationName, &PostCreateProcess_Arguments, FirstArg);
+   EntryPointSelected = TRUE;
+   return TRUE;
+}
+
+BOOL OpEnableDebugMode(LPBYTE* p)
+{
+   DebugModeEnabled = TRUE;
+   DEBUG("Aibika stub running in debug mode");
+   if (Reader)
+      DEBUG("Read strategy: %s", ReaderStrategyName(Reader->Strategy));
+   DEBUG("Mapped output: %s", MapOutputEnabled ? "on" : "off");
+   return TRUE;
+}
+
+#if WITH_LZMA
+void* SzAlloc(void* p, size_t size) { (void)p; return malloc(size); }
+void SzFree(void* p, void* address) { (void)p; free(address); }
+ISzAlloc alloc = { SzAlloc, SzFree };
+
+#define LZMA_UNPACKSIZE_SIZE 8
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
+
+/* Dictionary that primed LZMA blocks continue (see OpLzmaDictionary):
+   its size, the properties and stream that it was compressed to,
+   copied, as the payload may be released while it is read, and the
+   state of the decoder that decoded it up to DictionaryConsumed bytes
+   of the stream */
+DWORD DictionarySize = 0;
+Byte DictionaryProps[LZMA_PROPS_SIZE];
+LPBYTE DictionaryStream = NULL;
+DWORD DictionaryStreamSize = 0;
+CLzmaDec DictionaryDecoder;
+SizeT DictionaryConsumed = 0;
+/* The stream of a primed block parts from the stream of the dictionary
+   in its last bytes, where the encoder flushed it, so the state is saved
+   that many bytes before its end */
+#define DICTIONARY_TAIL 256
+
+/**
+   Decodes an LZMA block and processes its opcodes. A primed block is
+   the continuation of the stream of the shared dictionary: the
+   compressed block starts with the number of bytes that it has in
+   common with that stream, which are fed to the decoder first, from
+   where the decoding of the dictionary stopped (see OpLzmaDictionary).
+*/
+BOOL DecompressLzma(LPBYTE* p, BOOL Primed)
+{
+   BOOL Success = TRUE;
+
+   DWORD CompressedSize = GetInteger(p);
+   DEBUG("LzmaDecode(%u)%s", CompressedSize, Primed ? " primed" : "");
+
+   Byte* src = (Byte*)*p;
+   *p += CompressedSize;
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   DWORD Block = ++BlockCount;
+   if (SkipNextBlock)
+   {
+      DEBUG("All files of block found in shared store");
+      SkipNextBlock = FALSE;
+      JournalCommit(Block, JOURNAL_BLOCK_DONE);
+      FilesReused++;
+      return TRUE;
+   }
+
+   if (Journal >= 0 && JournalCommitted(Block, JOURNAL_BLOCK_DONE))
+   {
+      DEBUG("Block %u extracted already", Block);
+      FilesReused++;
+      return TRUE;
+   }
+
+   UInt64 unpackSize = 0;
+   int i;
+   for (i = 0; i < 8; i++)
+   {
+      unpackSize += (UInt64)src[LZMA_PROPS_SIZE + i] << (i * 8);
+   }
+
+   const Byte* In = src + LZMA_HEADER_SIZE;
+   SizeT InLeft = CompressedSize - LZMA_HEADER_SIZE;
+   const Byte* Rest = NULL;
+   SizeT RestLeft = 0;
+   DWORD Skip = 0;
+   if (Primed)
+   {
+      LPBYTE Shared = src + LZMA_HEADER_SIZE;
+      DWORD SharedSize = InLeft >= 4 ? GetInteger(&Shared) : 0;
+      if (InLeft < 4 || !DictionaryStream || SharedSize > DictionaryStreamSize || unpackSize < DictionarySize ||
+          memcmp(src, DictionaryProps, LZMA_PROPS_SIZE) != 0)
+      {
+         FATAL("Invalid primed LZMA block.");
+         return FALSE;
+      }
+      Rest = Shared;
+      RestLeft = InLeft - 4;
+      In = DictionaryStream;
+      InLeft = SharedSize;
+      Skip = DictionarySize;
+   }
+
+   /* Mapped, so that output files can be mapped into it */
+   long PageSize = sysconf(_SC_PAGESIZE);
+   size_t DecompressedLength = (unpackSize + PageSize - 1) / PageSize * PageSize;
+   Byte* DecompressedData =
+      mmap(NULL, DecompressedLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (DecompressedData == MAP_FAILED)
+   {
+      FATAL("Failed to allocate %llu bytes for decompression.", (unsigned long long)unpackSize);
+      return FALSE;
+   }
+
+   /* The block is the decoder's dictionary. With mapped output, it is
+      decoded up to each multiple of MAP_ALIGN, and the output files of
+      the opcodes decoded so far are mapped before it goes on. */
+   CLzmaDec Decoder;
+   LzmaDec_Construct(&Decoder);
+   SRes res = LzmaDec_AllocateProbs(&Decoder, src, LZMA_PROPS_SIZE, &alloc);
+   Decoder.dic = DecompressedData;
+   Decoder.dicBufSize = unpackSize;
+   LPBYTE Scan = DecompressedData + Skip;
+   MappedCount = 0;
+   double DecodeStart = Now();
+   if (res == SZ_OK)
+      LzmaDec_Init(&Decoder);
+   /* A primed block starts from the state of the decoder after the
+      dictionary, unless its stream parts from the dictionary's before
+      that */
+   if (res == SZ_OK && Primed && DictionaryConsumed <= InLeft)
+   {
+      CLzmaProb* Probs = Decoder.probs;
+      Decoder = DictionaryDecoder;
+      Decoder.probs = Probs;
+      memcpy(Probs, DictionaryDecoder.probs, Decoder.numProbs * sizeof(CLzmaProb));
+      Decoder.dic = DecompressedData;
+      Decoder.dicBufSize = unpackSize;
+      memcpy(DecompressedData, DictionaryDecoder.dic, DictionaryDecoder.dicPos);
+      In += DictionaryConsumed;
+      InLeft -= DictionaryConsumed;
+   }
+   else if (Primed)
+      DEBUG("Decoding the dictionary again");
+   while (res == SZ_OK && Decoder.dicPos < unpackSize)
+   {
+      SizeT Limit = MapOutputEnabled ? (Decoder.dicPos / MAP_ALIGN + 1) * MAP_ALIGN : unpackSize;
+      if (Limit > unpackSize)
+         Limit = unpackSize;
+      SizeT InSize = InLeft;
+      ELzmaStatus status;
+      res = LzmaDec_DecodeToDic(&Decoder, Limit, In, &InSize, LZMA_FINISH_ANY, &status);
+      In += InSize;
+      InLeft -= InSize;
+      if (res == SZ_OK && InLeft == 0 && RestLeft > 0)
+      {
+         In = Rest;
+         InLeft = RestLeft;
+         RestLeft = 0;
+      }
+      else if (res == SZ_OK && Decoder.dicPos < Limit)
+         res = SZ_ERROR_INPUT_EOF;
+      if (MapOutputEnabled)
+         MapOutputFiles(DecompressedData, &Scan, DecompressedData + Decoder.dicPos);
+   }
+   DecodeTime += Now() - DecodeStart;
+   LzmaDec_FreeProbs(&Decoder, &alloc);
+   if (res != SZ_OK)
+   {
+      FATAL("LZMA decompression failed.");
+      Success = FALSE;
+   }
+   else
+   {
+      /* Each block is terminated by its own OP_END */
+      DWORD TopLevelEntry = CurrentEntry;
+      CurrentBlock = Block;
+      CurrentEntry = 0;
+      LPBYTE decPtr = DecompressedData + Skip;
+      if (!ProcessOpcodes(&decPtr))
+      {
+         Success = FALSE;
+      }
+      else
+      {
+         JournalCommit(Block, JOURNAL_BLOCK_DONE);
+      }
+      /* The files of the block are committed together */
+      if (!JournalFlush())
+         Success = FALSE;
+      ExitCondition = FALSE;
+      CurrentBlock = 0;
+      CurrentEntry = TopLevelEntry;
+   }
+
+   /* Some of the mapped files were not finished */
+   if (!Success)
+   {
+      size_t i;
+      for (i = 0; i < MappedCount; i++)
+         (void)unlink(MappedFiles[i].Path);
+   }
+
+   /* Unmaps the output files too */
+   munmap(DecompressedData, DecompressedLength);
+   MappedCount = 0;
+   return Success;
+}
+
+BOOL OpDecompressLzma(LPBYTE* p)
+{
+   return DecompressLzma(p, FALSE);
+}
+
+BOOL OpDecompressLzmaPrimed(LPBYTE* p)
+{
+   return DecompressLzma(p, TRUE);
+}
+
+/**
+   Keeps the shared dictionary that the following LZMA blocks are
+   primed with (OP_LZMA_DICTIONARY opcode handler), and decodes it
+   once: each primed block starts from a copy of the decoder's state.
+*/
+BOOL OpLzmaDictionary(LPBYTE* p)
+{
+   DictionarySize = GetInteger(p);
+   DWORD Size = GetInteger(p);
+   LPBYTE Stream = *p;
+   *p += Size;
+   DEBUG("LzmaDictionary(%u, %u)", DictionarySize, Size);
+
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   if (Size < LZMA_PROPS_SIZE)
+   {
+      FATAL("Invalid LZMA dictionary.");
+      return FALSE;
+   }
+   memcpy(DictionaryProps, Stream, LZMA_PROPS_SIZE);
+   DictionaryStreamSize = Size - LZMA_PROPS_SIZE;
+   free(DictionaryStream);
+   DictionaryStream = malloc(DictionaryStreamSize ? DictionaryStreamSize : 1);
+   if (DictionaryStream)
+      memcpy(DictionaryStream, Stream + LZMA_PROPS_SIZE, DictionaryStreamSize);
+
+   LzmaDec_FreeProbs(&DictionaryDecoder, &alloc);
+   free(DictionaryDecoder.dic);
+   LzmaDec_Construct(&DictionaryDecoder);
+   SRes res = LzmaDec_AllocateProbs(&DictionaryDecoder, DictionaryProps, LZMA_PROPS_SIZE, &alloc);
+   DictionaryDecoder.dic = malloc(DictionarySize ? DictionarySize : 1);
+   DictionaryDecoder.dicBufSize = DictionarySize;
+   if (!DictionaryStream || !DictionaryDecoder.dic || res == SZ_ERROR_MEM)
+   {
+      FATAL("Failed to allocate memory for the LZMA dictionary.");
+      return FALSE;
+   }
+
+   SizeT InSize = DictionaryStreamSize > DICTIONARY_TAIL ? DictionaryStreamSize - DICTIONARY_TAIL : 0;
+   double DecodeStart = Now();
+   if (res == SZ_OK)
+   {
+      ELzmaStatus status;
+      LzmaDec_Init(&DictionaryDecoder);
+      res = LzmaDec_DecodeToDic(&DictionaryDecoder, DictionarySize, DictionaryStream, &InSize, LZMA_FINISH_ANY,
+                                &status);
+   }
+   DecodeTime += Now() - DecodeStart;
+   if (res != SZ_OK)
+   {
+      FATAL("LZMA decompression failed.");
+      return FALSE;
+   }
+   DictionaryConsumed = InSize;
+   return TRUE;
+}
+#endif
+
+/**
+   Padding that aligns the content of large files in LZMA blocks (see
+   MapOutputFiles) (OP_PADDING opcode handler).
+*/
+BOOL OpPadding(LPBYTE* p)
+{
+   DWORD Size = GetInteger(p);
+   *p += Size;
+   return TRUE;
+}
+
+BOOL OpEnd(LPBYTE* p)
+{
+   (void)p;
+   ExitCondition = TRUE;
+   return TRUE;
+}
+
+BOOL OpSetEnv(LPBYTE* p)
+{
+   LPTSTR Name = GetString(p);
+   LPTSTR Value = GetString(p);
+   LPTSTR ExpandedValue;
+   ExpandPath(&ExpandedValue, Value);
+   DEBUG("SetEnv(%s, %s)", Name, ExpandedValue);
+
+   BOOL Result = TRUE;
+   if (ResidentConnection < 0 && setenv(Name, ExpandedValue, 1) != 0)
+   {
+      FATAL("Failed to set environment variable (%s).", strerror(errno));
+      Result = FALSE;
+   }
+   free(ExpandedValue);
+   return Result;
+}
+
+/** Appends a zero-terminated string to a message buffer */
+void AppendString(char** Buffer, size_t* Size, size_t* Capacity, const char* str)
+{
+   size_t Length = strlen(str) + 1;
+   while (*Size + Length > *Capacity)
+   {
+      *Capacity *= 2;
+      *Buffer = realloc(*Buffer, *Capacity);
+   }
+   memcpy(*Buffer + *Size, str, Length);
+   *Size += Length;
+}
+
+/**
+   Sends the program to run to the resident server: the arguments of
+   the process (with | for the installation directory), the environment
+   and working directory of the stub, followed by its standard input,
+   output and error. Returns the exit status sent back by the server.
+   The message is the length of the strings followed by the argument
+   count, the arguments, the environment count, the environment
+   and the working directory, each as a zero-terminated string.
+*/
+int RunResident(char** Arguments)
+{
+   size_t Capacity = 4096, Size = 4;
+   char* Message = malloc(Capacity);
+   char Number[16];
+   int i, Count;
+
+   for (Count = 0; Arguments[Count]; Count++)
+      ;
+   snprintf(Number, sizeof(Number), "%d", Count);
+   AppendString(&Message, &Size, &Capacity, Number);
+   for (i = 0; i < Count; i++)
+      AppendString(&Message, &Size, &Capacity, Arguments[i]);
+
+   for (Count = 0; environ[Count]; Count++)
+      ;
+   snprintf(Number, sizeof(Number), "%d", Count);
+   AppendString(&Message, &Size, &Capacity, Number);
+   for (i = 0; i < Count; i++)
+      AppendString(&Message, &Size, &Capacity, environ[i]);
+
+   char Cwd[PATH_MAX];
+   if (ChdirBeforeRunEnabled)
+      AppendString(&Message, &Size, &Capacity, "|/src");
+   else
+      AppendString(&Message, &Size, &Capacity, getcwd(Cwd, PATH_MAX) ? Cwd : "/");
+
+   DWORD Length = Size - 4;
+   memcpy(Message, &Length, 4);
+
+   size_t Sent = 0;
+   while (Sent < Size)
+   {
+      ssize_t n = write(ResidentConnection, Message + Sent, Size - Sent);
+      if (n <= 0)
+      {
+         free(Message);
+         FATAL("Failed to send to resident server (%s)", strerror(errno));
+         return -1;
+      }
+      Sent += n;
+   }
+   free(Message);
+
+   int Fds[3] = { 0, 1, 2 };
+   char Control[CMSG_SPACE(sizeof(Fds))];
+   char Byte = 0;
+   struct iovec Iov = { &Byte, 1 };
+   struct msghdr Msg;
+   memset(&Msg, 0, sizeof(Msg));
+   memset(Control, 0, sizeof(Control));
+   Msg.msg_iov = &Iov;
+   Msg.msg_iovlen = 1;
+   Msg.msg_control = Control;
+   Msg.msg_controllen = sizeof(Control);
+   struct cmsghdr* Cmsg = CMSG_FIRSTHDR(&Msg);
+   Cmsg->cmsg_level = SOL_SOCKET;
+   Cmsg->cmsg_type = SCM_RIGHTS;
+   Cmsg->cmsg_len = CMSG_LEN(sizeof(Fds));
+   memcpy(CMSG_DATA(Cmsg), Fds, sizeof(Fds));
+   if (sendmsg(ResidentConnection, &Msg, 0) != 1)
+   {
+      FATAL("Failed to send to resident server (%s)", strerror(errno));
+      return -1;
+   }
+
+   /* If the stub is interrupted, the server interrupts the worker */
+   int32_t Status;
+   size_t Received = 0;
+   while (Received < sizeof(Status))
+   {
+      ssize_t n = read(ResidentConnection, (char*)&Status + Received, sizeof(Status) - Received);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+      {
+         FATAL("Resident server closed the connection");
+         return -1;
+      }
+      Received += n;
+   }
+   return Status;
+}
+
+/**
+   Runs the program in a resident server when one is running for this
+   executable (OP_RESIDENT opcode handler). The server is identified by
+   the digest of the payload, so a rebuilt executable never talks to a
+   server started by an older one. Otherwise, the files are extracted
+   as usual and the program starts the server (see
+   aibika/runtime/resident.rb), which is told the socket, installation
+   directory and idle timeout through the environment.
+*/
+BOOL OpResident(LPBYTE* p)
+{
+   LPTSTR Digest = GetString(p);
+   DWORD IdleTimeout = GetInteger(p);
+
+   char SocketDir[PATH_MAX];
+   const char* RuntimeDir = getenv("XDG_RUNTIME_DIR");
+   if (RuntimeDir && *RuntimeDir)
+   {
+      if (!FormatPath(SocketDir, "%s/aibika", RuntimeDir))
+         return TRUE;
+   }
+   else
+      FormatPath(SocketDir, "/tmp/aibika-%d", (int)getuid());
+   if (!CreatePrivateDirectory(SocketDir))
+      return TRUE;
+
+   struct sockaddr_un Address;
+   memset(&Address, 0, sizeof(Address));
+   Address.sun_family = AF_UNIX;
+   if (snprintf(Address.sun_path, sizeof(Address.sun_path), "%s/%.32s.sock", SocketDir, Digest) >=
+       (int)sizeof(Address.sun_path))
+   {
+      DEBUG("Socket path too long");
+      return TRUE;
+   }
+
+   int Connection = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (Connection >= 0 && connect(Connection, (struct sockaddr*)&Address, sizeof(Address)) == 0)
+   {
+      DEBUG("Connected to resident server %s", Address.sun_path);
+      ResidentConnection = Connection;
+      /* The server replaces | with its installation directory */
+      strcpy(InstDir, "|");
+      return TRUE;
+   }
+   if (Connection >= 0)
+      close(Connection);
+
+   char Timeout[16];
+   snprintf(Timeout, sizeof(Timeout), "%u", IdleTimeout);
+   strcpy(ResidentSocket, Address.sun_path);
+   setenv("AIBIKA_RESIDENT_SOCKET", Address.sun_path, 1);
+   setenv("AIBIKA_RESIDENT_IDLE", Timeout, 1);
+   return TRUE;
+}
+
+/**
+   Virtual file system (OP_VFS_IMAGE opcode handler). The files of the
+   image are not extracted. The interposer preloaded into the program
+   (vfs_posix.c) serves them from the executable instead, at the
+   offset given here.
+*/
+BOOL OpVfsImage(LPBYTE* p)
+{
+   DWORD Size = GetInteger(p);
+   unsigned long Offset = *p - ImageBase;
+   *p += Size;
+   DEBUG("VfsImage(%lu, %u)", Offset, Size);
+   if (ResidentConnection >= 0)
+      return TRUE;
+
+   char Location[32];
+   snprintf(Location, sizeof(Location), "%lu:%u", Offset, Size);
+   if (setenv("AIBIKA_VFS_IMAGE", Location, 1) != 0 || setenv("AIBIKA_VFS_ROOT", InstDir, 1) != 0)
+   {
+      FATAL("Failed to set environment variable (%s).", strerror(errno));
+      return FALSE;
+   }
+   return TRUE;
+}
+
+/**
+   Extracts to a persistent installation directory named after the
+   digest of the executable (OP_EXTRACT_CACHE opcode handler, before
+   OP_CREATE_INST_DIRECTORY). Later runs reuse the files, and a run
+   that was interrupted is resumed from the journal (see OpenJournal).
+*/
+BOOL OpExtractCache(LPBYTE* p)
+{
+   LPTSTR Digest = GetString(p);
+   strncpy(ExtractCacheDigest, Digest, sizeof(ExtractCacheDigest) - 1);
+   return TRUE;
+}
+
+/* Threads that read ahead the files of OP_PREFETCH */
+#define PREFETCH_THREADS 4
+
+typedef struct
+{
+   LPTSTR* Names;
+   DWORD Count;
+   DWORD Next;
+} PrefetchList;
+
+/**
+   Asks the kernel to read the next files of the list into the page
+   cache, until none is left. The reads proceed after the process has
+   exited.
+*/
+void* PrefetchFiles(void* Arg)
+{
+   PrefetchList* List = Arg;
+   DWORD Index;
+   while ((Index = __atomic_fetch_add(&List->Next, 1, __ATOMIC_RELAXED)) < List->Count)
+   {
+      char Path[PATH_MAX];
+      if (!FormatPath(Path, "%s/%s", InstDir, List->Names[Index]))
+         continue;
+      int fd = open(Path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+         continue;
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+      char Buffer[65536];
+      while (read(fd, Buffer, sizeof(Buffer)) > 0)
+         ;
+#endif
+      close(fd);
+   }
+   return NULL;
+}
+
+/**
+   Reads ahead the files that the program reads when it starts, in the
+   order it reads them (OP_PREFETCH opcode handler, after the files).
+   When the persistent installation directory was extracted by an
+   earlier run, the first run after a reboot would otherwise read each
+   file from the disk when Ruby gets to it. The files are read by
+   threads of a detached process, as the stub is replaced by the
+   program, while Ruby starts. Set AIBIKA_PREFETCH=0 to disable it.
+*/
+BOOL OpPrefetch(LPBYTE* p)
+{
+   DWORD Size = GetInteger(p);
+   LPBYTE Data = *p;
+   *p += Size;
+
+   const char* Prefetch = getenv("AIBIKA_PREFETCH");
+   if (!ExtractCacheUsed || ResidentConnection >= 0 || (WrittenFiles > 0 && !FilesReused) ||
+       (Prefetch && strcmp(Prefetch, "0") == 0))
+      return TRUE;
+
+   PrefetchList List = { NULL, 0, 0 };
+   for (LPBYTE Name = Data; Name < Data + Size; Name += strlen((char*)Name) + 1)
+      List.Count++;
+   DEBUG("Prefetch(%lu files)", (unsigned long)List.Count);
+
+   pid_t Pid = fork();
+   if (Pid < 0)
+   {
+      DEBUG("Failed to start prefetching (%s)", strerror(errno));
+      return TRUE;
+   }
+   if (Pid > 0)
+   {
+      while (waitpid(Pid, NULL, 0) < 0 && errno == EINTR)
+         ;
+      return TRUE;
+   }
+
+   /* The intermediate process exits at once, so that the program does
+      not inherit a child, and the prefetching one releases the
+      standard streams */
+   if (fork() != 0)
+      _exit(0);
+   int Null = open("/dev/null", O_RDWR);
+   if (Null >= 0)
+   {
+      dup2(Null, STDIN_FILENO);
+      dup2(Null, STDOUT_FILENO);
+      dup2(Null, STDERR_FILENO);
+      close(Null);
+   }
+
+   List.Names = malloc(List.Count * sizeof(LPTSTR));
+   if (!List.Names)
+      _exit(0);
+   DWORD Index = 0;
+   for (LPBYTE Name = Data; Name < Data + Size; Name += strlen((char*)Name) + 1)
+      List.Names[Index++] = (LPTSTR)Name;
+
+   pthread_t Threads[PREFETCH_THREADS];
+   int Started = 0;
+   while (Started < PREFETCH_THREADS && pthread_create(&Threads[Started], NULL, PrefetchFiles, &List) == 0)
+      Started++;
+   PrefetchFiles(&List);
+   for (int i = 0; i < Started; i++)
+      pthread_join(Threads[i], NULL);
+   _exit(0);
+}
+
+/**
+   Processes the payload written to a file next to the executable
+   (OP_PAYLOAD_FILE opcode handler), which holds the opcodes and the
+   signature like an executable with the payload appended. The file is
+   read like the executable (see ProcessFile); mapped, it is read-only
+   and shared, so concurrent instances share its pages. An update can
+   replace the file alone.
+*/
+BOOL OpPayloadFile(LPBYTE* p)
+{
+   LPTSTR Name = GetString(p);
+
+   char PayloadFileName[PATH_MAX];
+   FindExeDir(PayloadFileName);
+   char Directory[PATH_MAX];
+   strcpy(Directory, PayloadFileName);
+   if (!FormatPath(PayloadFileName, "%s/%s", Directory, Name))
+      return FALSE;
+   DEBUG("PayloadFile(%s)", PayloadFileName);
+
+   setenv("AIBIKA_PAYLOAD", PayloadFileName, 1);
+   return ProcessFile(PayloadFileName);
+}
@@ -0,0 +1,799 @@
+/*
+  Virtual File System Interposer (POSIX)
+
+  Preloaded (LD_PRELOAD) into the Ruby interpreter of executables built
+  with --vfs. Files of the installation directory that were not
+  extracted by the stub are served from the VFS image in the mapped
+  executable (see OP_VFS_IMAGE in stub_posix.c and vfs_image.rb).
+
+  Calls are passed to the C library first. Only when a path is not
+  found there, it is looked up in the image, so files written by the
+  program take precedence. Opened files are copied from the image into
+  memory files (memfd_create), so that reading, seeking, fstat and
+  mmap on the descriptor need no interposition. Files opened for
+  writing are materialized in the installation directory first.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <LzmaDec.h>
+
+typedef uint8_t BYTE;
+typedef BYTE* LPBYTE;
+typedef uint32_t DWORD;
+
+#define VFS_MAGIC "AVFS"
+#define VFS_RAW 0xFFFFFFFF
+#define VFS_CACHE_BLOCKS 4
+
+/* Only the interposed functions are exported (-fvisibility=hidden) */
+#define EXPORT __attribute__((visibility("default")))
+
+#define LZMA_UNPACKSIZE_SIZE 8
+#define LZMA_HEADER_SIZE (LZMA_PROPS_SIZE + LZMA_UNPACKSIZE_SIZE)
+
+typedef struct
+{
+   DWORD Offset;
+   DWORD CompressedSize;
+   DWORD Size;
+} VfsBlock;
+
+typedef struct
+{
+   DWORD Name;
+   DWORD Block;
+   DWORD Offset;
+   DWORD Size;
+   DWORD Mode;
+} VfsFile;
+
+/* The image in the mapped executable */
+LPBYTE Image = NULL;
+DWORD FileCount = 0;
+DWORD BlockCount = 0;
+VfsBlock* Blocks;
+VfsFile* Files;
+const char* Strings;
+struct stat ImageStat;
+
+/* Installation directory that the image is served under */
+char Root[PATH_MAX];
+size_t RootLength = 0;
+
+/* Recently decoded blocks */
+struct
+{
+   DWORD Block;
+   LPBYTE Data;
+} Cache[VFS_CACHE_BLOCKS];
+int NextCacheSlot = 0;
+pthread_mutex_t CacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+int (*Real_open)(const char*, int, ...);
+int (*Real_openat)(int, const char*, int, ...);
+FILE* (*Real_fopen)(const char*, const char*);
+int (*Real_fstatat)(int, const char*, struct stat*, int);
+int (*Real_statx)(int, const char*, int, unsigned int, struct statx*);
+int (*Real_access)(const char*, int);
+int (*Real_faccessat)(int, const char*, int, int);
+int (*Real_eaccess)(const char*, int);
+ssize_t (*Real_readlink)(const char*, char*, size_t);
+char* (*Real_realpath)(const char*, char*);
+DIR* (*Real_opendir)(const char*);
+DIR* (*Real_fdopendir)(int);
+struct dirent* (*Real_readdir)(DIR*);
+struct dirent64* (*Real_readdir64)(DIR*);
+int (*Real_closedir)(DIR*);
+
+/** Looks up the function of the C library on first use */
+void* RealFunction(void** Slot, const char* Name)
+{
+   if (!*Slot)
+      *Slot = dlsym(RTLD_NEXT, Name);
+   return *Slot;
+}
+
+#define REAL(name) ((__typeof__(Real_##name))RealFunction((void**)&Real_##name, #name))
+
+/** Decoder: 32 bit unsigned integer */
+DWORD GetInteger(LPBYTE* p)
+{
+   DWORD dw;
+   memcpy(&dw, *p, sizeof(dw));
+   *p += 4;
+   return dw;
+}
+
+/**
+   Maps the executable, or the payload file next to it
+   (AIBIKA_PAYLOAD), and locates the image, as told by the stub
+   through AIBIKA_VFS_IMAGE (<offset>:<size>) and AIBIKA_VFS_ROOT.
+*/
+__attribute__((constructor)) void VfsInit(void)
+{
+   const char* Executable = getenv("AIBIKA_PAYLOAD");
+   if (!Executable)
+      Executable = getenv("AIBIKA_EXECUTABLE");
+   const char* Location = getenv("AIBIKA_VFS_IMAGE");
+   const char* InstDir = getenv("AIBIKA_VFS_ROOT");
+   if (!Executable || !Location || !InstDir || strlen(InstDir) >= PATH_MAX)
+      return;
+
+   unsigned long Offset, Size;
+   if (sscanf(Location, "%lu:%lu", &Offset, &Size) != 2)
+      return;
+
+   int fd = REAL(open)(Executable, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return;
+   if (fstat(fd, &ImageStat) != 0 || (unsigned long)ImageStat.st_size < Offset + Size)
+   {
+      close(fd);
+      return;
+   }
+   LPBYTE Mapping = mmap(NULL, ImageStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (Mapping == MAP_FAILED)
+      return;
+
+   LPBYTE p = Mapping + Offset;
+   if (memcmp(p, VFS_MAGIC, 4) != 0)
+      return;
+   p += 4;
+   FileCount = GetInteger(&p);
+   BlockCount = GetInteger(&p);
+   GetInteger(&p); /* Size of the strings */
+   Blocks = (VfsBlock*)p;
+   Files = (VfsFile*)(p + BlockCount * sizeof(VfsBlock));
+   Strings = (const char*)(Files + FileCount);
+   Image = Mapping + Offset;
+
+   strcpy(Root, InstDir);
+   RootLength = strlen(Root);
+}
+
+/**
+   Returns the path relative to the installation directory, or NULL
+   if the path is outside of it. Relative paths are resolved against
+   the working directory or dirfd, and . and .. are removed
+   lexically (the installation directory contains no symbolic links).
+*/
+const char* RelativePath(int dirfd, const char* path, char* Buffer)
+{
+   if (!Image || !path)
+      return NULL;
+
+   char Full[PATH_MAX * 2];
+   if (path[0] == '/')
+   {
+      if (strncmp(path, Root, RootLength) != 0)
+         return NULL;
+      strncpy(Full, path, sizeof(Full) - 1);
+      Full[sizeof(Full) - 1] = 0;
+   }
+   else
+   {
+      char Dir[PATH_MAX];
+      if (dirfd == AT_FDCWD)
+      {
+         if (!getcwd(Dir, PATH_MAX))
+            return NULL;
+      }
+      else
+      {
+         char Link[64];
+         snprintf(Link, sizeof(Link), "/proc/self/fd/%d", dirfd);
+         ssize_t n = REAL(readlink)(Link, Dir, PATH_MAX - 1);
+         if (n <= 0)
+            return NULL;
+         Dir[n] = 0;
+      }
+      snprintf(Full, sizeof(Full), "%s/%s", Dir, path);
+   }
+
+   /* Normalize into Buffer */
+   char* d = Buffer;
+   char* s = Full;
+   while (*s)
+   {
+      while (*s == '/')
+         s++;
+      char* End = strchrnul(s, '/');
+      size_t Length = End - s;
+      if (Length == 0 || (Length == 1 && s[0] == '.'))
+      {
+      }
+      else if (Length == 2 && s[0] == '.' && s[1] == '.')
+      {
+         while (d > Buffer && *--d != '/')
+            ;
+      }
+      else
+      {
+         if (d + Length + 2 >= Buffer + PATH_MAX)
+            return NULL;
+         *d++ = '/';
+         memcpy(d, s, Length);
+         d += Length;
+      }
+      s = End;
+   }
+   *d = 0;
+
+   if (strncmp(Buffer, Root, RootLength) != 0 || Buffer[RootLength] != '/')
+      return NULL;
+   return Buffer + RootLength + 1;
+}
+
+/** Finds a file of the image by its relative path */
+VfsFile* FindFile(const char* Name)
+{
+   DWORD Low = 0, High = FileCount;
+   while (Low < High)
+   {
+      DWORD Middle = (Low + High) / 2;
+      int c = strcmp(Name, Strings + Files[Middle].Name);
+      if (c == 0)
+         return &Files[Middle];
+      else if (c < 0)
+         High = Middle;
+      else
+         Low = Middle + 1;
+   }
+   return NULL;
+}
+
+VfsFile* Lookup(int dirfd, const char* path)
+{
+   char Buffer[PATH_MAX];
+   const char* Name = RelativePath(dirfd, path, Buffer);
+   return Name ? FindFile(Name) : NULL;
+}
+
+void* SzAlloc(void* p, size_t size) { (void)p; return malloc(size); }
+void SzFree(void* p, void* address) { (void)p; free(address); }
+ISzAlloc alloc = { SzAlloc, SzFree };
+
+/** Returns a decoded block, from the cache if possible. Called with
+    CacheLock held. */
+LPBYTE DecodeBlock(DWORD Index)
+{
+   int i;
+   for (i = 0; i < VFS_CACHE_BLOCKS; i++)
+   {
+      if (Cache[i].Data && Cache[i].Block == Index)
+         return Cache[i].Data;
+   }
+
+   VfsBlock* Block = &Blocks[Index];
+   LPBYTE Data = malloc(Block->Size ? Block->Size : 1);
+   if (!Data)
+      return NULL;
+
+   SizeT OutSize = Block->Size;
+   SizeT InSize = Block->CompressedSize - LZMA_HEADER_SIZE;
+   LPBYTE Src = Image + Block->Offset;
+   ELzmaStatus Status;
+   if (LzmaDecode(Data, &OutSize, Src + LZMA_HEADER_SIZE, &InSize, Src, LZMA_PROPS_SIZE, LZMA_FINISH_ANY,
+                  &Status, &alloc) != SZ_OK)
+   {
+      free(Data);
+      return NULL;
+   }
+
+   free(Cache[NextCacheSlot].Data);
+   Cache[NextCacheSlot].Block = Index;
+   Cache[NextCacheSlot].Data = Data;
+   NextCacheSlot = (NextCacheSlot + 1) % VFS_CACHE_BLOCKS;
+   return Data;
+}
+
+/** Writes the content of a file of the image to a descriptor */
+int WriteContent(int fd, VfsFile* File)
+{
+   int Result = 0;
+   pthread_mutex_lock(&CacheLock);
+   LPBYTE Data;
+   if (File->Block == VFS_RAW)
+      Data = Image + File->Offset;
+   else
+   {
+      Data = DecodeBlock(File->Block);
+      if (Data)
+         Data += File->Offset;
+   }
+
+   if (!Data)
+   {
+      errno = EIO;
+      Result = -1;
+   }
+   else
+   {
+      DWORD Written = 0;
+      while (Written < File->Size)
+      {
+         ssize_t n = write(fd, Data + Written, File->Size - Written);
+         if (n < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            Result = -1;
+            break;
+         }
+         Written += n;
+      }
+   }
+   pthread_mutex_unlock(&CacheLock);
+   return Result;
+}
+
+/** Opens a file of the image for reading, as a memory file */
+int OpenVirtual(VfsFile* File, int flags)
+{
+   const char* Name = strrchr(Strings + File->Name, '/');
+   int fd = memfd_create(Name ? Name + 1 : Strings + File->Name, (flags & O_CLOEXEC) ? MFD_CLOEXEC : 0);
+   if (fd < 0)
+      return -1;
+   if (WriteContent(fd, File) != 0 || lseek(fd, 0, SEEK_SET) != 0)
+   {
+      int Error = errno;
+      close(fd);
+      errno = Error;
+      return -1;
+   }
+   return fd;
+}
+
+/** Writes a file of the image to the installation directory, before
+    it is opened for writing */
+void Materialize(int dirfd, const char* path, VfsFile* File)
+{
+   int fd = REAL(openat)(dirfd, path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, File->Mode & 07777);
+   if (fd < 0)
+      return;
+   WriteContent(fd, File);
+   close(fd);
+}
+
+int OpenAt(int dirfd, const char* path, int flags, mode_t mode)
+{
+   VfsFile* File;
+   if ((flags & O_ACCMODE) != O_RDONLY && (File = Lookup(dirfd, path)))
+      Materialize(dirfd, path, File);
+
+   int fd = REAL(openat)(dirfd, path, flags, mode);
+   if (fd >= 0 || errno != ENOENT || (flags & O_ACCMODE) != O_RDONLY || (flags & O_DIRECTORY))
+      return fd;
+
+   File = Lookup(dirfd, path);
+   if (!File)
+   {
+      errno = ENOENT;
+      return -1;
+   }
+   return OpenVirtual(File, flags);
+}
+
+#define MODE_ARG(flags) \
+   mode_t mode = 0; \
+   if ((flags) & (O_CREAT | O_TMPFILE)) \
+   { \
+      va_list ap; \
+      va_start(ap, flags); \
+      mode = va_arg(ap, mode_t); \
+      va_end(ap); \
+   }
+
+EXPORT int open(const char* path, int flags, ...)
+{
+   MODE_ARG(flags);
+   return OpenAt(AT_FDCWD, path, flags, mode);
+}
+
+EXPORT int open64(const char* path, int flags, ...)
+{
+   MODE_ARG(flags);
+   return OpenAt(AT_FDCWD, path, flags, mode);
+}
+
+EXPORT int openat(int dirfd, const char* path, int flags, ...)
+{
+   MODE_ARG(flags);
+   return OpenAt(dirfd, path, flags, mode);
+}
+
+EXPORT int openat64(int dirfd, const char* path, int flags, ...)
+{
+   MODE_ARG(flags);
+   return OpenAt(dirfd, path, flags, mode);
+}
+
+EXPORT int __open_2(const char* path, int flags)
+{
+   return OpenAt(AT_FDCWD, path, flags, 0);
+}
+
+EXPORT int __open64_2(const char* path, int flags)
+{
+   return OpenAt(AT_FDCWD, path, flags, 0);
+}
+
+EXPORT FILE* fopen(const char* path, const char* mode)
+{
+   VfsFile* File;
+   if (strpbrk(mode, "wa+") && (File = Lookup(AT_FDCWD, path)))
+      Materialize(AT_FDCWD, path, File);
+
+   FILE* f = REAL(fopen)(path, mode);
+   if (f || errno != ENOENT || strpbrk(mode, "wa+") || !(File = Lookup(AT_FDCWD, path)))
+      return f;
+
+   int fd = OpenVirtual(File, strchr(mode, 'e') ? O_CLOEXEC : 0);
+   if (fd < 0)
+      return NULL;
+   f = fdopen(fd, "r");
+   if (!f)
+      close(fd);
+   return f;
+}
+
+EXPORT FILE* fopen64(const char* path, const char* mode)
+{
+   return fopen(path, mode);
+}
+
+/** Status of a file of the image */
+void FillStat(VfsFile* File, struct stat* st)
+{
+   memset(st, 0, sizeof(*st));
+   st->st_dev = ImageStat.st_dev;
+   st->st_ino = 0x80000000u + (File - Files);
+   st->st_mode = S_IFREG | (File->Mode & 07777);
+   st->st_nlink = 1;
+   st->st_uid = getuid();
+   st->st_gid = getgid();
+   st->st_size = File->Size;
+   st->st_blksize = 4096;
+   st->st_blocks = (File->Size + 511) / 512;
+   st->st_atim = ImageStat.st_mtim;
+   st->st_mtim = ImageStat.st_mtim;
+   st->st_ctim = ImageStat.st_mtim;
+}
+
+int StatAt(int dirfd, const char* path, struct stat* st, int flags)
+{
+   int Result = REAL(fstatat)(dirfd, path, st, flags);
+   if (Result == 0 || errno != ENOENT)
+      return Result;
+
+   VfsFile* File = Lookup(dirfd, path);
+   if (!File)
+   {
+      errno = ENOENT;
+      return -1;
+   }
+   FillStat(File, st);
+   return 0;
+}
+
+EXPORT int stat(const char* path, struct stat* st)
+{
+   return StatAt(AT_FDCWD, path, st, 0);
+}
+
+EXPORT int stat64(const char* path, struct stat64* st)
+{
+   return StatAt(AT_FDCWD, path, (struct stat*)st, 0);
+}
+
+EXPORT int lstat(const char* path, struct stat* st)
+{
+   return StatAt(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+EXPORT int lstat64(const char* path, struct stat64* st)
+{
+   return StatAt(AT_FDCWD, path, (struct stat*)st, AT_SYMLINK_NOFOLLOW);
+}
+
+EXPORT int fstatat(int dirfd, const char* path, struct stat* st, int flags)
+{
+   return StatAt(dirfd, path, st, flags);
+}
+
+EXPORT int fstatat64(int dirfd, const char* path, struct stat64* st, int flags)
+{
+   return StatAt(dirfd, path, (struct stat*)st, flags);
+}
+
+/* Entry points of glibc before 2.33 */
+EXPORT int __xstat(int ver, const char* path, struct stat* st)
+{
+   (void)ver;
+   return StatAt(AT_FDCWD, path, st, 0);
+}
+
+EXPORT int __xstat64(int ver, const char* path, struct stat64* st)
+{
+   (void)ver;
+   return StatAt(AT_FDCWD, path, (struct stat*)st, 0);
+}
+
+EXPORT int __lxstat(int ver, const char* path, struct stat* st)
+{
+   (void)ver;
+   return StatAt(AT_FDCWD, path, st, AT_SYMLINK_NOFOLLOW);
+}
+
+EXPORT int __lxstat64(int ver, const char* path, struct stat64* st)
+{
+   (void)ver;
+   return StatAt(AT_FDCWD, path, (struct stat*)st, AT_SYMLINK_NOFOLLOW);
+}
+
+EXPORT int __fxstatat(int ver, int dirfd, const char* path, struct stat* st, int flags)
+{
+   (void)ver;
+   return StatAt(dirfd, path, st, flags);
+}
+
+EXPORT int __fxstatat64(int ver, int dirfd, const char* path, struct stat64* st, int flags)
+{
+   (void)ver;
+   return StatAt(dirfd, path, (struct stat*)st, flags);
+}
+
+EXPORT int statx(int dirfd, const char* path, int flags, unsigned int mask, struct statx* stx)
+{
+   int Result = REAL(statx)(dirfd, path, flags, mask, stx);
+   if (Result == 0 || errno != ENOENT)
+      return Result;
+
+   VfsFile* File = Lookup(dirfd, path);
+   if (!File)
+   {
+      errno = ENOENT;
+      return -1;
+   }
+
+   struct stat st;
+   FillStat(File, &st);
+   memset(stx, 0, sizeof(*stx));
+   stx->stx_mask = STATX_BASIC_STATS;
+   stx->stx_blksize = st.st_blksize;
+   stx->stx_nlink = st.st_nlink;
+   stx->stx_uid = st.st_uid;
+   stx->stx_gid = st.st_gid;
+   stx->stx_mode = st.st_mode;
+   stx->stx_ino = st.st_ino;
+   stx->stx_size = st.st_size;
+   stx->stx_blocks = st.st_blocks;
+   stx->stx_atime.tv_sec = stx->stx_mtime.tv_sec = stx->stx_ctime.tv_sec = st.st_mtim.tv_sec;
+   stx->stx_atime.tv_nsec = stx->stx_mtime.tv_nsec = stx->stx_ctime.tv_nsec = st.st_mtim.tv_nsec;
+   stx->stx_dev_major = major(st.st_dev);
+   stx->stx_dev_minor = minor(st.st_dev);
+   return 0;
+}
+
+int AccessAt(int dirfd, const char* path, int mode, int Result)
+{
+   if (Result == 0 || errno != ENOENT)
+      return Result;
+
+   VfsFile* File = Lookup(dirfd, path);
+   if (!File)
+   {
+      errno = ENOENT;
+      return -1;
+   }
+   if ((mode & X_OK) && !(File->Mode & 0111))
+   {
+      errno = EACCES;
+      return -1;
+   }
+   return 0;
+}
+
+EXPORT int access(const char* path, int mode)
+{
+   return AccessAt(AT_FDCWD, path, mode, REAL(access)(path, mode));
+}
+
+EXPORT int faccessat(int dirfd, const char* path, int mode, int flags)
+{
+   return AccessAt(dirfd, path, mode, REAL(faccessat)(dirfd, path, mode, flags));
+}
+
+EXPORT int eaccess(const char* path, int mode)
+{
+   return AccessAt(AT_FDCWD, path, mode, REAL(eaccess)(path, mode));
+}
+
+EXPORT int euidaccess(const char* path, int mode)
+{
+   return eaccess(path, mode);
+}
+
+EXPORT ssize_t readlink(const char* path, char* buf, size_t size)
+{
+   ssize_t Result = REAL(readlink)(path, buf, size);
+   if (Result < 0 && errno == ENOENT && Lookup(AT_FDCWD, path))
+      errno = EINVAL; /* Not a symbolic link */
+   return Result;
+}
+
+EXPORT char* realpath(const char* path, char* resolved)
+{
+   char* Result = REAL(realpath)(path, resolved);
+   if (Result || errno != ENOENT)
+      return Result;
+
+   char Buffer[PATH_MAX];
+   const char* Name = RelativePath(AT_FDCWD, path, Buffer);
+   if (!Name || !FindFile(Name))
+   {
+      errno = ENOENT;
+      return NULL;
+   }
+   if (!resolved && !(resolved = malloc(PATH_MAX)))
+      return NULL;
+   strcpy(resolved, Buffer);
+   return resolved;
+}
+
+/**
+   Directories are created by the stub, so only their listings need
+   the files of the image, which are returned after the real entries.
+*/
+typedef struct OpenDir
+{
+   DIR* Dir;
+   char* Name; /* Relative to the installation directory */
+   DWORD Next; /* Next file of the image to consider */
+   struct dirent Entry;
+   struct dirent64 Entry64;
+   struct OpenDir* Link;
+} OpenDir;
+
+OpenDir* OpenDirs = NULL;
+pthread_mutex_t DirLock = PTHREAD_MUTEX_INITIALIZER;
+
+void TrackDir(DIR* Dir, int dirfd, const char* path)
+{
+   char Buffer[PATH_MAX];
+   const char* Name = Dir ? RelativePath(dirfd, path, Buffer) : NULL;
+   if (!Name)
+      return;
+
+   OpenDir* d = calloc(1, sizeof(OpenDir));
+   d->Dir = Dir;
+   d->Name = strdup(Name);
+   pthread_mutex_lock(&DirLock);
+   d->Link = OpenDirs;
+   OpenDirs = d;
+   pthread_mutex_unlock(&DirLock);
+}
+
+EXPORT DIR* opendir(const char* path)
+{
+   DIR* Dir = REAL(opendir)(path);
+   TrackDir(Dir, AT_FDCWD, path);
+   return Dir;
+}
+
+EXPORT DIR* fdopendir(int fd)
+{
+   DIR* Dir = REAL(fdopendir)(fd);
+   char Link[64];
+   snprintf(Link, sizeof(Link), "/proc/self/fd/%d", fd);
+   char Path[PATH_MAX];
+   ssize_t n = REAL(readlink)(Link, Path, PATH_MAX - 1);
+   if (n > 0)
+   {
+      Path[n] = 0;
+      TrackDir(Dir, AT_FDCWD, Path);
+   }
+   return Dir;
+}
+
+/** Returns the next file of the image in the directory that is not
+    on disk, or NULL */
+const char* NextVirtualEntry(OpenDir* d)
+{
+   size_t Length = strlen(d->Name);
+   while (d->Next < FileCount)
+   {
+      const char* Name = Strings + Files[d->Next++].Name;
+      const char* Base = Name;
+      if (Length > 0)
+      {
+         if (strncmp(Name, d->Name, Length) != 0 || Name[Length] != '/')
+            continue;
+         Base = Name + Length + 1;
+      }
+      struct stat st;
+      if (!strchr(Base, '/') && REAL(fstatat)(dirfd(d->Dir), Base, &st, AT_SYMLINK_NOFOLLOW) != 0)
+         return Base;
+   }
+   return NULL;
+}
+
+OpenDir* FindDir(DIR* Dir)
+{
+   pthread_mutex_lock(&DirLock);
+   OpenDir* d = OpenDirs;
+   while (d && d->Dir != Dir)
+      d = d->Link;
+   pthread_mutex_unlock(&DirLock);
+   return d;
+}
+
+EXPORT struct dirent* readdir(DIR* Dir)
+{
+   struct dirent* Entry = REAL(readdir)(Dir);
+   OpenDir* d;
+   if (Entry || !(d = FindDir(Dir)))
+      return Entry;
+
+   const char* Base = NextVirtualEntry(d);
+   if (!Base)
+      return NULL;
+   memset(&d->Entry, 0, sizeof(d->Entry));
+   d->Entry.d_ino = 0x80000000u + d->Next - 1;
+   d->Entry.d_type = DT_REG;
+   strncpy(d->Entry.d_name, Base, sizeof(d->Entry.d_name) - 1);
+   return &d->Entry;
+}
+
+EXPORT struct dirent64* readdir64(DIR* Dir)
+{
+   struct dirent64* Entry = REAL(readdir64)(Dir);
+   OpenDir* d;
+   if (Entry || !(d = FindDir(Dir)))
+      return Entry;
+
+   const char* Base = NextVirtualEntry(d);
+   if (!Base)
+      return NULL;
+   memset(&d->Entry64, 0, sizeof(d->Entry64));
+   d->Entry64.d_ino = 0x80000000u + d->Next - 1;
+   d->Entry64.d_type = DT_REG;
+   strncpy(d->Entry64.d_name, Base, sizeof(d->Entry64.d_name) - 1);
+   return &d->Entry64;
+}
+
+EXPORT int closedir(DIR* Dir)
+{
+   pthread_mutex_lock(&DirLock);
+   OpenDir** Link = &OpenDirs;
+   while (*Link && (*Link)->Dir != Dir)
+      Link = &(*Link)->Link;
+   OpenDir* d = *Link;
+   if (d)
+      *Link = d->Link;
+   pthread_mutex_unlock(&DirLock);
+   if (d)
+   {
+      free(d->Name);
+      free(d);
+   }
+   return REAL(closedir)(Dir);
+}
@@ -0,0 +1,47 @@
+# frozen_string_literal: true
+
+# Benchmark of the classification of features by the builder: finding
+# the load path and the gem directory of each feature, with nested
+# Pathname#subpath? scans and with Aibika::PathIndex, on a synthetic
+# layout of 10000 features in 300 gems (rake bench_classify).
+
+require 'benchmark'
+require_relative '../lib/aibika'
+
+GEMS = 300
+FEATURES = 10_000
+
+prefix = Aibika::Pathname.new('/opt/ruby')
+gem_home = prefix / 'lib/ruby/gems/3.3.0'
+stdlib = prefix / 'lib/ruby/3.3.0'
+gem_dirs = Array.new(GEMS) { |i| gem_home / "gems/gem#{i}-1.#{i % 7}.0" }
+load_paths = gem_dirs.map { |dir| dir / 'lib' } + [stdlib, stdlib / 'x86_64-linux', prefix / 'lib/ruby/site_ruby/3.3.0']
+features = Array.new(FEATURES) do |i|
+  root = i % 10 == 9 ? stdlib : gem_dirs[i % GEMS] / 'lib'
+  root / "part#{i % 13}/feature#{i}.rb"
+end
+
+scan = nil
+index = nil
+scan_time = Benchmark.realtime do
+  scan = features.map do |feature|
+    loadpath = load_paths.select { |path| feature.subpath?(path.expand) }
+                         .min_by { |path| feature.relative_path_from(path.expand).path.size }
+    gem_dir = gem_dirs.find { |dir| feature.subpath?(dir) }
+    [loadpath, gem_dir, !feature.subpath?(prefix).nil?]
+  end
+end
+index_time = Benchmark.realtime do
+  loadpath_index = Aibika.load_path_index(load_paths)
+  gem_index = Aibika::PathIndex.new(gem_dirs.to_h { |dir| [dir, dir] })
+  roots = Aibika::PathIndex.new(prefix => :exec_prefix)
+  index = features.map do |feature|
+    [Aibika.find_load_path(load_paths, feature, loadpath_index), gem_index.lookup(feature)&.last,
+     roots.include?(feature)]
+  end
+end
+
+abort 'Classifications differ' unless scan == index
+puts "#{FEATURES} features, #{GEMS} gems, #{load_paths.size} load paths"
+puts format('nested scans: %<time>8.3f s', time: scan_time)
+puts format('path index:   %<time>8.3f s', time: index_time)
@@ -0,0 +1,3 @@
+# frozen_string_literal: true
+
+exit 1 unless ARGV.empty?
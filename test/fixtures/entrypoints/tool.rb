@@ -0,0 +1,3 @@
+# frozen_string_literal: true
+
+exit(ARGV == ['arg'] ? 5 : 6)
@@ -1,3 +1,3 @@
 # frozen_string_literal: true
 
-File.binwrite('environment', Marshal.dump(ENV.to_hash)) if $PROGRAM_NAME == __FILE__
+File.binwrite('environment.dat', Marshal.dump(ENV.to_hash)) if $PROGRAM_NAME == __FILE__
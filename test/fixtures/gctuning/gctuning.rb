@@ -0,0 +1,10 @@
+# frozen_string_literal: true
+
+# Objects kept alive while loading, like the constants and methods of
+# libraries, which the heap of the packaged Ruby should start with room for
+RETAINED = Array.new(200_000) { |i| "object #{i}" }.freeze
+
+# Only packaged executables set the variable
+if ENV.key?('AIBIKA_STARTUP_METRICS')
+  File.binwrite('gcenv', Marshal.dump(ENV.select { |name, _| name.start_with?('RUBY_GC_') }))
+end
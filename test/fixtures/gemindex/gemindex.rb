@@ -0,0 +1,9 @@
+# frozen_string_literal: true
+
+require 'rake'
+
+# Nothing to check while Aibika is detecting dependencies
+exit if defined?(Aibika)
+
+raise 'Specification index was not loaded' unless AibikaRuntime::GemIndex.loaded?
+raise 'Gem was not activated from the index' unless AibikaRuntime::GemIndex.specs.include?(Gem.loaded_specs['rake'])
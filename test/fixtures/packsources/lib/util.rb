@@ -0,0 +1,9 @@
+module Util
+  def self.value
+    42
+  end
+
+  def self.file
+    __FILE__
+  end
+end
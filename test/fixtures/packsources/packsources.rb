@@ -0,0 +1,9 @@
+require 'set'
+require_relative 'lib/util'
+
+exit 1 unless Util.value == 42
+exit 2 unless Set.new([1]).include?(1)
+exit 3 unless File.file?(File.join(__dir__, 'lib/util.rb'))
+exit 4 unless File.read(File.join(__dir__, 'data.txt')) == "data\n"
+exit 5 unless Util.file == File.join(__dir__, 'lib/util.rb')
+exit 6 unless system(RbConfig.ruby, '-e', 'require "set"')
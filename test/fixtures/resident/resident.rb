@@ -0,0 +1,6 @@
+# frozen_string_literal: true
+
+# The runs forked by the resident server share its process as parent
+puts Process.ppid
+puts $stdin.read
+exit ARGV.size
@@ -0,0 +1,7 @@
+# frozen_string_literal: true
+
+# Only packaged executables set the variable and have the helper
+if ENV.key?('AIBIKA_STARTUP_METRICS')
+  require 'aibika/runtime/startup_metrics'
+  File.binwrite('metrics', Marshal.dump(AibikaRuntime::StartupMetrics.parse))
+end
@@ -0,0 +1,5 @@
+# frozen_string_literal: true
+
+Dir.chdir(File.dirname(__FILE__))
+exit 1 if File.binread('random.bin') != Random.new(1).bytes(256 * 1024)
+exit 2 if File.read('storedfile.rb').empty?
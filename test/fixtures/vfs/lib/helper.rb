@@ -0,0 +1,5 @@
+module Helper
+  def self.ok?
+    true
+  end
+end
@@ -0,0 +1,11 @@
+require 'json'
+require_relative 'lib/helper'
+
+exit 1 unless Helper.ok?
+exit 2 unless JSON.parse(File.read(File.join(__dir__, 'data.json'))) == { 'vfs' => true }
+exit 3 unless File.file?(File.join(__dir__, 'data.json'))
+exit 4 unless Dir.children(__dir__).include?('data.json')
+exit 5 unless Dir.glob('lib/*.rb', base: __dir__) == ['lib/helper.rb']
+exit 0 unless ENV['AIBIKA_EXECUTABLE']
+File.write(File.join(__dir__, 'data.json'), '{}', mode: 'a')
+exit 6 unless File.read(File.join(__dir__, 'data.json')).end_with?('true}{}')
@@ -7,6 +7,7 @@ require 'tmpdir'
 require 'fileutils'
 require 'rbconfig'
 require 'pathname'
+require 'json'
 require 'open3'
 
 begin
@@ -39,10 +40,22 @@ class TestAibika < Minitest::Test
   # the block, then cleans up.
   def pristine_env(*files, &block)
     with_tmpdir files do
-      with_env 'PATH' => "#{ENV.fetch('SystemRoot', nil)};#{ENV.fetch('SystemRoot', nil)}\\SYSTEM32", &block
+      path = if Gem.win_platform?
+               "#{ENV.fetch('SystemRoot', nil)};#{ENV.fetch('SystemRoot', nil)}\\SYSTEM32"
+             else
+               # Like Windows, find the executables in the current directory
+               '.:/usr/bin:/bin'
+             end
+      with_env 'PATH' => path, &block
     end
   end
 
+  # Name of the executable built from a script: name.exe on Windows,
+  # and name on other systems
+  def exe_name(name)
+    Gem.win_platform? ? "#{name}.exe" : name
+  end
+
   def system(*args)
     puts args.join(' ') if ENV['AIBIKA_VERBOSE_TEST']
     Kernel.system(*args)
@@ -100,7 +113,8 @@ class TestAibika < Minitest::Test
   end
 
   def with_tmpdir(files = [], path = nil, &block)
-    tempdirname = path || File.join(ENV.fetch('TEMP', nil), ".aibikatest-#{$PROCESS_ID}-#{rand 2**32}").tr('\\', '/')
+    tempdirname = path || File.join(ENV.fetch('TEMP', Dir.tmpdir),
+                                    ".aibikatest-#{$PROCESS_ID}-#{rand 2**32}").tr('\\', '/')
     mkdir_p tempdirname
     begin
       cp files, tempdirname
@@ -136,10 +150,17 @@ class TestAibika < Minitest::Test
   def test_helloworld
     with_fixture 'helloworld' do
       each_path_combo 'helloworld.rb' do |script|
+        # Outside Windows, the executable would have the name of the
+        # fixture directory when built from its parent
+        if File.directory?(exe_name('helloworld'))
+          refute system('ruby', aibika, script, *DefaultArgs)
+          next
+        end
+
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('helloworld.exe')
-        pristine_env 'helloworld.exe' do
-          assert system('helloworld.exe')
+        assert File.exist?(exe_name('helloworld'))
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
         end
       end
     end
@@ -149,9 +170,375 @@ class TestAibika < Minitest::Test
   def test_lzma
     with_fixture 'helloworld' do
       assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma')
-      assert File.exist?('helloworld.exe')
-      pristine_env 'helloworld.exe' do
-        assert system('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
+      end
+    end
+  end
+
+  # Should be able to build executables with blocks compressed in parallel
+  def test_lzma_threads
+    with_fixture 'helloworld' do
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma', '--lzma-threads', '4')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
+      end
+    end
+  end
+
+  # Executables and DLLs should run whether or not their branch targets
+  # were converted for compression
+  def test_bcj
+    with_fixture 'helloworld' do
+      ['--bcj', '--no-bcj'].each do |option|
+        assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma', option)
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
+        end
+      end
+    end
+  end
+
+  # Incompressible files should be stored uncompressed and extracted
+  # along with the compressed ones
+  def test_store_incompressible
+    with_fixture 'storedfile' do
+      File.binwrite('random.bin', Random.new(1).bytes(256 * 1024))
+      assert system('ruby', aibika, 'storedfile.rb', 'random.bin', '--quiet', '--lzma')
+      assert File.size(exe_name('storedfile')) > 256 * 1024
+      pristine_env exe_name('storedfile') do
+        assert system(exe_name('storedfile'))
+      end
+    end
+  end
+
+  # Executables built with a shared store should extract the runtime
+  # into it once and run from links to it
+  def test_shared_store
+    with_fixture 'helloworld' do
+      store = File.expand_path('appdata')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma', '--shared-store')
+      with_env 'LOCALAPPDATA' => store, 'XDG_CACHE_HOME' => store do
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
+          files = Dir[File.join(store, 'aibika', 'store', '*', '*')]
+          assert !files.empty?
+          assert system(exe_name('helloworld'))
+          assert_equal files, Dir[File.join(store, 'aibika', 'store', '*', '*')]
+        end
+      end
+    end
+  end
+
+  # Generated files and directories of the gems are in the block that a
+  # run skips when the gems are in the store already, and have to be
+  # created all the same
+  def test_shared_store_generated_files
+    with_fixture 'gemindex' do
+      exe = File.expand_path(exe_name('gemindex'))
+      store = File.expand_path('store')
+      assert system('ruby', aibika, 'gemindex.rb', '--quiet', '--lzma', '--gemfile', 'Gemfile', '--shared-store',
+                    '--debug-extract')
+      with_env 'LOCALAPPDATA' => store, 'XDG_CACHE_HOME' => store do
+        2.times { assert system(exe) }
+      end
+      runs = Dir['aib*'].map { |dir| Dir.chdir(dir) { Dir['**/*'].sort } }
+      assert_equal 2, runs.size
+      assert(runs.all? { |paths| paths.any? { |path| path.end_with?('/gem_index.dat') } })
+      assert_equal runs.first, runs.last
+      next if Gem.win_platform?
+
+      # A store that other users can write to is not used
+      shared = File.join(store, 'aibika', 'store')
+      refute_empty Dir[File.join(shared, '*')]
+      rm_rf Dir[File.join(shared, '*')]
+      File.chmod(0o777, shared)
+      with_env 'XDG_CACHE_HOME' => store do
+        assert system(exe)
+      end
+      assert_empty Dir[File.join(shared, '*')]
+    end
+  end
+
+  # A delta between two builds should carry only the changed blocks and
+  # reconstruct the new executable exactly
+  def test_delta
+    with_fixture 'helloworld' do
+      exe = exe_name('helloworld')
+      args = ['helloworld.rb', '--quiet', '--lzma', '--build-cache', 'cache']
+      assert system('ruby', aibika, *args)
+      mv exe, exe_name('old')
+      File.write('helloworld.rb', "puts 'Version 2'\n", mode: 'a')
+      assert system('ruby', aibika, *args, '--delta-from', exe_name('old'))
+      assert File.size("#{exe}.delta") < File.size(exe) / 100
+      assert system('ruby', aibika, '--quiet', '--apply-delta', exe_name('old'), "#{exe}.delta", exe_name('new'))
+      assert_equal File.binread(exe), File.binread(exe_name('new'))
+      refute system('ruby', aibika, '--quiet', '--apply-delta', "#{exe}.delta", "#{exe}.delta", exe_name('bad'))
+    end
+  end
+
+  # With --extract-cache, later runs should reuse the extracted files,
+  # and a run after an interrupted extraction should restore the files
+  # that were not recorded in the journal
+  def test_extract_cache
+    with_fixture 'helloworld' do
+      exe = File.expand_path(exe_name('helloworld'))
+      cache = File.expand_path('cache')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma', '--extract-cache')
+      with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache do
+        assert system(exe)
+        dirs = Dir[File.join(cache, 'aibika', 'extract', '*')]
+        assert_equal 1, dirs.size
+        journal = File.join(dirs.first, '.aibika-journal')
+        records = File.size(journal)
+        assert records.positive?
+        script = File.join(dirs.first, 'src', 'helloworld.rb')
+        mtime = File.mtime(script)
+
+        assert system(exe)
+        assert_equal mtime, File.mtime(script)
+
+        File.write(script, 'raise')
+        File.write(journal, 'abc')
+        assert system(exe)
+        assert_equal File.read('helloworld.rb'), File.read(script)
+        assert_equal records, File.size(journal)
+      end
+    end
+  end
+
+  # With --extract-cache, runs that find the files extracted should read
+  # the files that the script loaded ahead of Ruby
+  def test_prefetch
+    with_fixture 'helloworld' do
+      exe = File.expand_path(exe_name('helloworld'))
+      cache = File.expand_path('cache')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--extract-cache', '--debug', '--output', exe)
+      with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache do
+        refute_match(/Prefetch\(/, IO.popen([exe], err: %i[child out], &:read))
+        output = IO.popen([exe], err: %i[child out], &:read)
+        assert $CHILD_STATUS.success?
+        assert output[/Prefetch\((\d+) files\)/, 1].to_i.positive?
+        with_env 'AIBIKA_PREFETCH' => '0' do
+          refute_match(/Prefetch\(/, IO.popen([exe], err: %i[child out], &:read))
+        end
+      end
+    end
+  end
+
+  # The stub should pass its startup metrics to the program, and the
+  # packaged helper should parse them
+  def test_startup_metrics
+    with_fixture 'startupmetrics' do
+      exe = File.expand_path(exe_name('startupmetrics'))
+      cache = File.expand_path('cache')
+      assert system('ruby', aibika, 'startupmetrics.rb', '--quiet', '--lzma', '--extract-cache')
+      with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache do
+        assert system(exe)
+        metrics = Marshal.load(File.binread('metrics'))
+        assert_equal 'miss', metrics[:cache]
+        assert metrics[:files].positive?
+        assert metrics[:bytes].positive?
+        assert metrics[:extract_ms] >= metrics[:decode_ms]
+        assert metrics[:peak_kb].positive?
+
+        assert system(exe)
+        metrics = Marshal.load(File.binread('metrics'))
+        assert_equal 'hit', metrics[:cache]
+        assert_equal 0, metrics[:files]
+      end
+    end
+  end
+
+  # --analyze should write a breakdown of the payload next to the
+  # executable, accounting for every file
+  def test_analyze
+    with_fixture 'helloworld' do
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--analyze')
+      report = JSON.parse(File.read('helloworld.analysis.json'))
+      assert_equal report['totals']['files'], report['files'].size
+      assert_equal report['totals']['bytes'], report['file_types'].sum { |row| row['bytes'] }
+      script = report['files'].find { |file| file['path'].end_with?('helloworld.rb') }
+      assert_equal File.size('helloworld.rb'), script['bytes']
+      assert report['extraction_estimate']['seconds'].positive?
+      assert File.read('helloworld.analysis.txt').include?('Largest files:')
+    end
+  end
+
+  # The executable should run with each read strategy of the stub
+  def test_read_strategies
+    with_fixture 'helloworld' do
+      exe = exe_name('helloworld')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma')
+      pristine_env exe do
+        %w[auto mmap stream direct].each do |strategy|
+          with_env 'AIBIKA_READ_STRATEGY' => strategy do
+            assert system(File.expand_path(exe)), strategy
+          end
+        end
+      end
+    end
+  end
+
+  # Large files should be decoded into a mapping of the output file, in
+  # a temporary and in a persistent installation directory, with the
+  # same content as when they are written, and the files after them too
+  def test_mapped_output
+    with_fixture 'helloworld' do
+      exe = File.expand_path(exe_name('helloworld'))
+      cache = File.expand_path('cache')
+      File.binwrite('data.bin', (0...200_000).map { |i| "#{i} #{i * i}\n" }.join)
+      File.binwrite('data2.bin', (0...150_000).map { |i| "#{i * 3} #{i}\n" }.join)
+      assert system('ruby', aibika, 'helloworld.rb', 'data.bin', 'data2.bin', '--quiet', '--lzma', '--extract-cache')
+      %w[1 0].each do |map|
+        rm_rf cache
+        with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache, 'AIBIKA_MAP_OUTPUT' => map do
+          assert system(exe)
+          %w[data.bin data2.bin].each do |name|
+            extracted = Dir[File.join(cache, 'aibika', 'extract', '*', 'src', name)]
+            assert_equal 1, extracted.size
+            assert_equal File.binread(name), File.binread(extracted.first)
+          end
+          assert_empty Dir[File.join(cache, '**', '*.aibika-tmp')]
+          assert system(exe)
+        end
+      end
+      pristine_env exe do
+        assert system(exe)
+      end
+    end
+  end
+
+  # With --shared-dictionary, the blocks should be primed with the
+  # dictionary and still decode to the same files, with and without
+  # mapped output
+  def test_shared_dictionary
+    with_fixture 'helloworld' do
+      exe = File.expand_path(exe_name('helloworld'))
+      cache = File.expand_path('cache')
+
+      # Lines that recur in every 4 MB block
+      random = Random.new(1)
+      line = -> { Array.new(150) { random.rand(97..122) }.pack('C*') }
+      lines = Array.new(1600) { line.call }
+      files = Array.new(16) do |i|
+        content = Array.new(6500) { random.rand(5).zero? ? line.call : lines.sample(random: random) }
+        File.binwrite("data#{i}.txt", content.join("\n"))
+        "data#{i}.txt"
+      end
+      output = IO.popen(['ruby', aibika, 'helloworld.rb', *files, '--extract-cache', '--shared-dictionary',
+                         '--compression-profile', 'fast-start'], &:read)
+      assert $CHILD_STATUS.success?
+      assert_match(/^=== Priming blocks with a shared dictionary/, output)
+      %w[1 0].each do |map|
+        rm_rf cache
+        with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache, 'AIBIKA_MAP_OUTPUT' => map do
+          assert system(exe)
+          files.each do |file|
+            extracted = Dir[File.join(cache, 'aibika', 'extract', '*', 'src', file)]
+            assert_equal 1, extracted.size
+            assert_equal File.binread(file), File.binread(extracted.first)
+          end
+        end
+      end
+      pristine_env exe do
+        assert system(exe)
+      end
+    end
+  end
+
+  # With --dedup, a file that differs from an earlier one by an
+  # insertion should be stored as copies from it and extracted intact
+  def test_dedup
+    with_fixture 'helloworld' do
+      exe = File.expand_path(exe_name('helloworld'))
+      cache = File.expand_path('cache')
+      lines = (0...40_000).map { |i| "#{i} #{i * i}\n" }
+      File.binwrite('data1.bin', lines.join)
+      File.binwrite('data2.bin', lines.insert(20_000, "inserted\n").join)
+      output = IO.popen(['ruby', aibika, 'helloworld.rb', 'data1.bin', 'data2.bin', '--extract-cache', '--dedup'],
+                        &:read)
+      assert $CHILD_STATUS.success?
+      shared = output[/Deduplicated (\d+) bytes/, 1].to_i
+      assert shared > File.size('data1.bin') / 2
+      with_env 'LOCALAPPDATA' => cache, 'XDG_CACHE_HOME' => cache do
+        assert system(exe)
+        %w[data1.bin data2.bin].each do |name|
+          extracted = Dir[File.join(cache, 'aibika', 'extract', '*', 'src', name)]
+          assert_equal 1, extracted.size
+          assert_equal File.binread(name), File.binread(extracted.first)
+        end
+      end
+      pristine_env exe do
+        assert system(exe)
+      end
+    end
+  end
+
+  # --gc-tuning should start the packaged Ruby with the heap that the
+  # dependency run needed, and --gc-env should set other variables
+  def test_gc_tuning
+    with_fixture 'gctuning' do
+      exe = File.expand_path(exe_name('gctuning'))
+      assert system('ruby', aibika, 'gctuning.rb', '--quiet', '--gc-tuning',
+                    '--gc-env', 'RUBY_GC_HEAP_GROWTH_FACTOR=1.5')
+      assert system(exe)
+      env = Marshal.load(File.binread('gcenv'))
+      assert_equal '1.5', env['RUBY_GC_HEAP_GROWTH_FACTOR']
+      slots = env.select { |name, _| name.match?(/\ARUBY_GC_HEAP_(\d+_)?INIT_SLOTS\z/) }
+      refute_empty slots
+      assert slots.values.sum(&:to_i) > 200_000
+      refute system('ruby', aibika, 'gctuning.rb', '--quiet', '--gc-env', 'PATH=/tmp')
+    end
+  end
+
+  # With --payload-file, the executable should run the payload from the
+  # .pak file next to it, and a rebuild should only change that file
+  def test_payload_file
+    with_fixture 'helloworld' do
+      exe = exe_name('helloworld')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--payload-file')
+      assert File.size('helloworld.pak') > File.size(exe)
+      pristine_env exe, 'helloworld.pak' do
+        assert system(File.expand_path(exe))
+      end
+      stub = File.binread(exe)
+
+      File.write('helloworld.rb', "exit 3\n", mode: 'a')
+      assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--payload-file')
+      assert_equal stub, File.binread(exe)
+      pristine_env exe, 'helloworld.pak' do
+        system(File.expand_path(exe))
+        assert_equal 3, $CHILD_STATUS.exitstatus
+      end
+    end
+  end
+
+  # Should be able to build executables with each compression profile
+  def test_compression_profiles
+    with_fixture 'helloworld' do
+      %w[fast-start balanced smallest auto].each do |profile|
+        assert system('ruby', aibika, 'helloworld.rb', '--quiet', '--lzma', '--compression-profile', profile)
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
+        end
+      end
+    end
+  end
+
+  # Rebuilding with a build cache should reuse the compressed blocks
+  def test_build_cache
+    with_fixture 'helloworld' do
+      args = ['helloworld.rb', '--quiet', '--lzma', '--build-cache', 'cache']
+      assert system('ruby', aibika, *args)
+      first = File.binread(exe_name('helloworld'))
+      assert Dir['cache/lzma/*/*'].size.positive?
+      assert system('ruby', aibika, *args)
+      assert_equal first, File.binread(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
       end
     end
   end
@@ -162,9 +549,9 @@ class TestAibika < Minitest::Test
     with_fixture 'writefile' do
       assert system('ruby', aibika, 'writefile.rb', *DefaultArgs)
       assert File.exist?('output.txt') # Make sure aibika ran the script during build
-      pristine_env 'writefile.exe' do
-        assert File.exist?('writefile.exe')
-        assert system('writefile.exe')
+      pristine_env exe_name('writefile') do
+        assert File.exist?(exe_name('writefile'))
+        assert system(exe_name('writefile'))
         assert File.exist?('output.txt')
         assert_equal 'output', File.read('output.txt')
       end
@@ -177,23 +564,61 @@ class TestAibika < Minitest::Test
       File.delete('output.txt') if File.exist?('output.txt')
       assert system('ruby', aibika, 'writefile.rb', *(DefaultArgs + ['--no-dep-run']))
       assert !File.exist?('output.txt')
-      pristine_env 'writefile.exe' do
-        assert File.exist?('writefile.exe')
-        assert system('writefile.exe')
+      pristine_env exe_name('writefile') do
+        assert File.exist?(exe_name('writefile'))
+        assert system(exe_name('writefile'))
         assert File.exist?('output.txt')
         assert_equal 'output', File.read('output.txt')
       end
     end
   end
 
+  # With a build cache, the script should not be run again until it changes
+  def test_dep_cache
+    with_fixture 'writefile' do
+      File.delete('output.txt') if File.exist?('output.txt')
+      args = ['writefile.rb', *DefaultArgs, '--build-cache', 'cache']
+      assert system('ruby', aibika, *args)
+      assert File.exist?('output.txt')
+      File.delete('output.txt')
+      assert system('ruby', aibika, *args)
+      assert !File.exist?('output.txt')
+      assert system('ruby', aibika, *args, '--refresh-dep-cache')
+      assert File.exist?('output.txt')
+      pristine_env exe_name('writefile') do
+        assert system(exe_name('writefile'))
+      end
+    end
+  end
+
+  # A change to a source that the script loaded, but that was not given
+  # on the command line, should make the script run again
+  def test_dep_cache_loaded_sources
+    with_fixture 'writefile' do
+      File.write('helper.rb', "# frozen_string_literal: true\n")
+      File.write('main.rb', "require_relative 'helper'\nFile.write('output.txt', 'output')\n")
+      args = ['main.rb', *DefaultArgs, '--build-cache', 'cache']
+      assert system('ruby', aibika, *args)
+      File.delete('output.txt')
+      assert system('ruby', aibika, *args)
+      assert !File.exist?('output.txt')
+      File.write('helper.rb', "require 'set'\n")
+      assert system('ruby', aibika, *args)
+      assert File.exist?('output.txt')
+      pristine_env exe_name('main') do
+        assert system(exe_name('main'))
+      end
+    end
+  end
+
   # With dep run disabled but including all core libs, should be able
   # to use ruby standard libraries (i.e. cgi)
   def test_rubycoreincl
     with_fixture 'rubycoreincl' do
       assert system('ruby', aibika, 'rubycoreincl.rb', *(DefaultArgs + ['--no-dep-run', '--add-all-core']))
-      pristine_env 'rubycoreincl.exe' do
-        assert File.exist?('rubycoreincl.exe')
-        assert system('rubycoreincl.exe')
+      pristine_env exe_name('rubycoreincl') do
+        assert File.exist?(exe_name('rubycoreincl'))
+        assert system(exe_name('rubycoreincl'))
         assert File.exist?('output.txt')
         assert_equal '3 &lt; 5', File.read('output.txt')
       end
@@ -206,8 +631,18 @@ class TestAibika < Minitest::Test
     with_fixture 'bundlerusage' do
       assert system('ruby', aibika, 'bundlerusage.rb', 'Gemfile',
                     *(DefaultArgs + ['--no-dep-run', '--add-all-core', '--gemfile', 'Gemfile', '--gem-all']))
-      pristine_env 'bundlerusage.exe' do
-        assert system('bundlerusage.exe')
+      pristine_env exe_name('bundlerusage') do
+        assert system(exe_name('bundlerusage'))
+      end
+    end
+  end
+
+  # Gems should be looked up through the prebuilt specification index
+  def test_gem_index
+    with_fixture 'gemindex' do
+      assert system('ruby', aibika, 'gemindex.rb', *(DefaultArgs + ['--gemfile', 'Gemfile']))
+      pristine_env exe_name('gemindex') do
+        assert system(exe_name('gemindex'))
       end
     end
   end
@@ -216,9 +651,9 @@ class TestAibika < Minitest::Test
   def test_debug_extract
     with_fixture 'helloworld' do
       assert system('ruby', aibika, 'helloworld.rb', *(DefaultArgs + ['--debug-extract']))
-      pristine_env 'helloworld.exe' do
+      pristine_env exe_name('helloworld') do
         assert_equal 0, Dir['aib*'].size
-        assert system('helloworld.exe')
+        assert system(exe_name('helloworld'))
         assert_equal 1, Dir['aib*'].size
       end
     end
@@ -227,10 +662,10 @@ class TestAibika < Minitest::Test
   # Test that the --output option allows us to specify a different exe name
   def test_output_option
     with_fixture 'helloworld' do
-      File.delete('helloworld.exe') if File.exist?('helloworld.exe')
-      assert system('ruby', aibika, 'helloworld.rb', *(DefaultArgs + ['--output', 'goodbyeworld.exe']))
-      assert !File.exist?('helloworld.exe')
-      assert File.exist?('goodbyeworld.exe')
+      File.delete(exe_name('helloworld')) if File.exist?(exe_name('helloworld'))
+      assert system('ruby', aibika, 'helloworld.rb', *(DefaultArgs + ['--output', exe_name('goodbyeworld')]))
+      assert !File.exist?(exe_name('helloworld'))
+      assert File.exist?(exe_name('goodbyeworld'))
     end
   end
 
@@ -238,8 +673,8 @@ class TestAibika < Minitest::Test
   def test_directory_on_cmd_line
     with_fixture 'subdir' do
       assert system('ruby', aibika, 'subdir.rb', 'a', *DefaultArgs)
-      pristine_env 'subdir.exe' do
-        assert system('subdir.exe')
+      pristine_env exe_name('subdir') do
+        assert system(exe_name('subdir'))
       end
     end
   end
@@ -248,8 +683,8 @@ class TestAibika < Minitest::Test
   def test_exitstatus
     with_fixture 'exitstatus' do
       assert system('ruby', aibika, 'exitstatus.rb', *DefaultArgs)
-      pristine_env 'exitstatus.exe' do
-        system('exitstatus.exe')
+      pristine_env exe_name('exitstatus') do
+        system(exe_name('exitstatus'))
         assert_equal 167, $CHILD_STATUS.exitstatus
       end
     end
@@ -259,9 +694,9 @@ class TestAibika < Minitest::Test
   def test_arguments1
     with_fixture 'arguments' do
       assert system('ruby', aibika, 'arguments.rb', *DefaultArgs)
-      assert File.exist?('arguments.exe')
-      pristine_env 'arguments.exe' do
-        system('arguments.exe foo "bar baz \"quote\""')
+      assert File.exist?(exe_name('arguments'))
+      pristine_env exe_name('arguments') do
+        system(%(#{exe_name('arguments')} foo "bar baz \\"quote\\""))
         assert_equal 5, $CHILD_STATUS.exitstatus
       end
     end
@@ -273,9 +708,9 @@ class TestAibika < Minitest::Test
     with_fixture 'arguments' do
       args = DefaultArgs + ['--', 'foo', 'bar baz "quote"']
       assert system('ruby', aibika, 'arguments.rb', *args)
-      assert File.exist?('arguments.exe')
-      pristine_env 'arguments.exe' do
-        system('arguments.exe')
+      assert File.exist?(exe_name('arguments'))
+      pristine_env exe_name('arguments') do
+        system(exe_name('arguments'))
         assert_equal 5, $CHILD_STATUS.exitstatus
       end
     end
@@ -287,9 +722,9 @@ class TestAibika < Minitest::Test
     with_fixture 'arguments' do
       args = DefaultArgs + ['--', 'foo']
       assert system('ruby', aibika, 'arguments.rb', *args)
-      assert File.exist?('arguments.exe')
-      pristine_env 'arguments.exe' do
-        system('arguments.exe "bar baz \"quote\""')
+      assert File.exist?(exe_name('arguments'))
+      pristine_env exe_name('arguments') do
+        system(%(#{exe_name('arguments')} "bar baz \\"quote\\""))
         assert_equal 5, $CHILD_STATUS.exitstatus
       end
     end
@@ -300,9 +735,9 @@ class TestAibika < Minitest::Test
     with_fixture 'buildarg' do
       args = DefaultArgs + ['--', '--some-option']
       assert system('ruby', aibika, 'buildarg.rb', *args)
-      assert File.exist?('buildarg.exe')
-      pristine_env 'buildarg.exe' do
-        assert system('buildarg.exe')
+      assert File.exist?(exe_name('buildarg'))
+      pristine_env exe_name('buildarg') do
+        assert system(exe_name('buildarg'))
       end
     end
   end
@@ -312,9 +747,9 @@ class TestAibika < Minitest::Test
   def test_stdout_redir
     with_fixture 'stdoutredir' do
       assert system('ruby', aibika, 'stdoutredir.rb', *DefaultArgs)
-      assert File.exist?('stdoutredir.exe')
-      pristine_env 'stdoutredir.exe' do
-        system('stdoutredir.exe > output.txt')
+      assert File.exist?(exe_name('stdoutredir'))
+      pristine_env exe_name('stdoutredir') do
+        system("#{exe_name('stdoutredir')} > output.txt")
         assert File.exist?('output.txt')
         assert_equal "Hello, World!\n", File.read('output.txt')
       end
@@ -326,10 +761,10 @@ class TestAibika < Minitest::Test
   def test_stdin_redir
     with_fixture 'stdinredir' do
       assert system('ruby', aibika, 'stdinredir.rb', *DefaultArgs)
-      assert File.exist?('stdinredir.exe')
+      assert File.exist?(exe_name('stdinredir'))
       # Kernel.system("ruby -e \"system 'stdinredir.exe<input.txt';p $?\"")
-      pristine_env 'stdinredir.exe', 'input.txt' do
-        system('stdinredir.exe < input.txt')
+      pristine_env exe_name('stdinredir'), 'input.txt' do
+        system("#{exe_name('stdinredir')} < input.txt")
       end
       assert_equal 104, $CHILD_STATUS.exitstatus
     end
@@ -350,8 +785,8 @@ class TestAibika < Minitest::Test
     with_fixture 'gdbmdll' do
       assert system('ruby', aibika, 'gdbmdll.rb', *args)
       with_env 'PATH' => '.' do
-        pristine_env 'gdbmdll.exe' do
-          system('gdbmdll.exe')
+        pristine_env exe_name('gdbmdll') do
+          system(exe_name('gdbmdll'))
           assert_equal 104, $CHILD_STATUS.exitstatus
         end
       end
@@ -362,11 +797,14 @@ class TestAibika < Minitest::Test
   # the script and that such files are correctly added to the
   # executable.
   def test_relative_require
+    # The fixture requires somedir/ as SomeDir/ too
+    skip 'File names are case-sensitive' unless Gem.win_platform?
+
     with_fixture 'relativerequire' do
       assert system('ruby', aibika, 'relativerequire.rb', *DefaultArgs)
-      assert File.exist?('relativerequire.exe')
-      pristine_env 'relativerequire.exe' do
-        system('relativerequire.exe')
+      assert File.exist?(exe_name('relativerequire'))
+      pristine_env exe_name('relativerequire') do
+        system(exe_name('relativerequire'))
         assert_equal 160, $CHILD_STATUS.exitstatus
       end
     end
@@ -378,9 +816,9 @@ class TestAibika < Minitest::Test
   def test_autoload
     with_fixture 'autoload' do
       assert system('ruby', aibika, 'autoload.rb', *DefaultArgs)
-      assert File.exist?('autoload.exe')
-      pristine_env 'autoload.exe' do
-        assert system('autoload.exe')
+      assert File.exist?(exe_name('autoload'))
+      pristine_env exe_name('autoload') do
+        assert system(exe_name('autoload'))
       end
     end
   end
@@ -392,9 +830,9 @@ class TestAibika < Minitest::Test
       args = DefaultArgs.dup
       args.push '--no-warnings'
       assert system('ruby', aibika, 'autoloadmissing.rb', *args)
-      assert File.exist?('autoloadmissing.exe')
-      pristine_env 'autoloadmissing.exe' do
-        assert system('autoloadmissing.exe')
+      assert File.exist?(exe_name('autoloadmissing'))
+      pristine_env exe_name('autoloadmissing') do
+        assert system(exe_name('autoloadmissing'))
       end
     end
   end
@@ -403,9 +841,9 @@ class TestAibika < Minitest::Test
   def test_autoload_nested
     with_fixture 'autoloadnested' do
       assert system('ruby', aibika, 'autoloadnested.rb', *DefaultArgs)
-      assert File.exist?('autoloadnested.exe')
-      pristine_env 'autoloadnested.exe' do
-        assert system('autoloadnested.exe')
+      assert File.exist?(exe_name('autoloadnested'))
+      pristine_env exe_name('autoloadnested') do
+        assert system(exe_name('autoloadnested'))
       end
     end
   end
@@ -416,9 +854,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/chdir1.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('chdir1.exe')
-        pristine_env 'chdir1.exe' do
-          assert system('chdir1.exe')
+        assert File.exist?(exe_name('chdir1'))
+        pristine_env exe_name('chdir1') do
+          assert system(exe_name('chdir1'))
         end
       end
     end
@@ -430,9 +868,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/chdir2.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('chdir2.exe')
-        pristine_env 'chdir2.exe' do
-          assert system('chdir2.exe')
+        assert File.exist?(exe_name('chdir2'))
+        pristine_env exe_name('chdir2') do
+          assert system(exe_name('chdir2'))
         end
       end
     end
@@ -445,9 +883,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/external.rb', 'lib', 'bin/sub' do |script, *loadpaths|
         assert system('ruby', '-I', loadpaths[0], '-I', loadpaths[1], aibika, script, *DefaultArgs)
-        assert File.exist?('external.exe')
-        pristine_env 'external.exe' do
-          assert system('external.exe')
+        assert File.exist?(exe_name('external'))
+        pristine_env exe_name('external') do
+          assert system(exe_name('external'))
         end
       end
     end
@@ -458,12 +896,12 @@ class TestAibika < Minitest::Test
   def test_relative_require_rubylib
     with_fixture 'relloadpath' do
       each_path_combo 'bin/external.rb', 'lib', 'bin/sub' do |script, *loadpaths|
-        with_env 'RUBYLIB' => loadpaths.join(';') do
+        with_env 'RUBYLIB' => loadpaths.join(File::PATH_SEPARATOR) do
           assert system('ruby', aibika, script, *DefaultArgs)
         end
-        assert File.exist?('external.exe')
-        pristine_env 'external.exe' do
-          assert system('external.exe')
+        assert File.exist?(exe_name('external'))
+        pristine_env exe_name('external') do
+          assert system(exe_name('external'))
         end
       end
     end
@@ -475,9 +913,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/loadpath0.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('loadpath0.exe')
-        pristine_env 'loadpath0.exe' do
-          assert system('loadpath0.exe')
+        assert File.exist?(exe_name('loadpath0'))
+        pristine_env exe_name('loadpath0') do
+          assert system(exe_name('loadpath0'))
         end
       end
     end
@@ -489,9 +927,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/loadpath1.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('loadpath1.exe')
-        pristine_env 'loadpath1.exe' do
-          assert system('loadpath1.exe')
+        assert File.exist?(exe_name('loadpath1'))
+        pristine_env exe_name('loadpath1') do
+          assert system(exe_name('loadpath1'))
         end
       end
     end
@@ -503,9 +941,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/loadpath2.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('loadpath2.exe')
-        pristine_env 'loadpath2.exe' do
-          assert system('loadpath2.exe')
+        assert File.exist?(exe_name('loadpath2'))
+        pristine_env exe_name('loadpath2') do
+          assert system(exe_name('loadpath2'))
         end
       end
     end
@@ -517,9 +955,9 @@ class TestAibika < Minitest::Test
     with_fixture 'relloadpath' do
       each_path_combo 'bin/loadpath3.rb' do |script|
         assert system('ruby', aibika, script, *DefaultArgs)
-        assert File.exist?('loadpath3.exe')
-        pristine_env 'loadpath3.exe' do
-          assert system('loadpath3.exe')
+        assert File.exist?(exe_name('loadpath3'))
+        pristine_env exe_name('loadpath3') do
+          assert system(exe_name('loadpath3'))
         end
       end
     end
@@ -530,14 +968,17 @@ class TestAibika < Minitest::Test
     assert_match(/^Aibika \d+(\.\d)+(.(:?[a-z]+)?\d+)?\n$/, `ruby \"#{aibika}\" --version`)
   end
 
-  # Test that aibika.rb accepts --icon.
+  # Test that aibika.rb accepts --icon, which only Windows executables
+  # have.
   def test_icon
     with_fixture 'helloworld' do
       icofile = File.join(AibikaRoot, 'src', 'vit-ruby.ico')
+      next refute system('ruby', aibika, '--icon', icofile, 'helloworld.rb', *DefaultArgs) unless Gem.win_platform?
+
       assert system('ruby', aibika, '--icon', icofile, 'helloworld.rb', *DefaultArgs)
-      assert File.exist?('helloworld.exe')
-      pristine_env 'helloworld.exe' do
-        assert system('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
       end
     end
   end
@@ -547,19 +988,110 @@ class TestAibika < Minitest::Test
   def test_resource
     with_fixture 'resource' do
       assert system('ruby', aibika, 'resource.rb', 'resource.txt', 'res/resource.txt', *DefaultArgs)
-      assert File.exist?('resource.exe')
-      pristine_env 'resource.exe' do
-        assert system('resource.exe')
+      assert File.exist?(exe_name('resource'))
+      pristine_env exe_name('resource') do
+        assert system(exe_name('resource'))
+      end
+    end
+  end
+
+  # Additional entry points should be selected by the name of the
+  # executable or by the first argument
+  def test_entrypoints
+    with_fixture 'entrypoints' do
+      assert system('ruby', aibika, 'entrypoints.rb', '--entry', 'tool.rb', *DefaultArgs)
+      pristine_env exe_name('entrypoints') do
+        assert system(exe_name('entrypoints'))
+        system("#{exe_name('entrypoints')} tool arg")
+        assert_equal 5, $CHILD_STATUS.exitstatus
+        cp exe_name('entrypoints'), exe_name('tool')
+        system("#{exe_name('tool')} arg")
+        assert_equal 5, $CHILD_STATUS.exitstatus
+      end
+    end
+  end
+
+  # Runs after the first one of a resident executable should be forked
+  # by the server that the first one started, with their own
+  # arguments, standard streams and exit status
+  def test_resident
+    skip 'Resident mode is not supported on Windows' if Gem.win_platform?
+
+    with_fixture 'resident' do
+      assert system('ruby', aibika, 'resident.rb', '--resident=2', *DefaultArgs)
+      runs = (1..3).map do |count|
+        output, status = Open3.capture2('./resident', *(['arg'] * count), stdin_data: "input #{count}")
+        assert_equal count, status.exitstatus
+        ppid, input = output.lines.map(&:chomp)
+        assert_equal "input #{count}", input
+        ppid
+      end
+      refute_equal runs[0], runs[1]
+      assert_equal runs[1], runs[2]
+
+      # A socket directory that other users can write to is not used
+      runtime = File.expand_path('runtime')
+      FileUtils.mkdir_p(File.join(runtime, 'aibika'), mode: 0o777)
+      File.chmod(0o777, File.join(runtime, 'aibika'))
+      with_env 'XDG_RUNTIME_DIR' => runtime do
+        output, status = Open3.capture2('./resident', 'arg', stdin_data: 'input')
+        assert_equal 1, status.exitstatus
+        assert_equal 'input', output.lines[1].chomp
+      end
+      assert_empty Dir.children(File.join(runtime, 'aibika'))
+    end
+  end
+
+  # Executables that keep their files should replace the stub with
+  # Ruby instead of waiting for it
+  def test_exec_replace
+    skip 'The Windows stub always waits for Ruby' if Gem.win_platform?
+
+    with_fixture 'execpid' do
+      assert system('ruby', aibika, 'execpid.rb', '--debug-extract', *DefaultArgs)
+      Open3.popen2('./execpid') do |_stdin, stdout, thread|
+        assert_equal thread.pid, stdout.read.to_i
+        assert thread.value.success?
       end
     end
   end
 
+  # With --vfs, only native code should be extracted, and the scripts
+  # and data should be served from the executable
+  def test_vfs
+    skip 'The virtual file system is not supported on Windows' if Gem.win_platform?
+
+    with_fixture 'vfs' do
+      assert system('ruby', aibika, 'vfs.rb', 'data.json', 'lib/helper.rb', '--vfs', '--debug-extract', *DefaultArgs)
+      FileUtils.rm_rf('lib')
+      assert system('./vfs')
+      assert_equal 1, Dir['aib*'].size
+      assert_empty Dir['aib*/**/*.rb']
+      refute_empty Dir['aib*/**/*.so']
+      assert File.exist?(File.join(Dir['aib*'].first, 'src/data.json')), 'written files are materialized'
+    end
+  end
+
+  # With --pack-sources, Ruby files should be loaded from the archive
+  # rather than extracted
+  def test_pack_sources
+    with_fixture 'packsources' do
+      assert system('ruby', aibika, 'packsources.rb', 'data.txt', '--pack-sources', '--debug-extract', *DefaultArgs)
+      FileUtils.rm_rf('lib')
+      exe = Dir['packsources*'].find { |file| !file.end_with?('.rb') }
+      assert system(File.expand_path(exe))
+      assert_equal 1, Dir['aib*/**/sources.pak'].size
+      assert_empty Dir['aib*/src/lib/util.rb']
+      assert_empty Dir['aib*/**/set.rb']
+    end
+  end
+
   # Test that when exceptions are thrown, no executable will be built.
   def test_exception
     with_fixture 'exception' do
       system("ruby \"#{aibika}\" exception.rb #{DefaultArgs.join(' ')} 2>NUL")
       assert $CHILD_STATUS.exitstatus != 0
-      assert !File.exist?('exception.exe')
+      assert !File.exist?(exe_name('exception'))
     end
   end
 
@@ -568,9 +1100,9 @@ class TestAibika < Minitest::Test
     with_fixture 'environment' do
       with_env 'RUBYOPT' => '-rtime' do
         assert system('ruby', aibika, 'environment.rb', *DefaultArgs)
-        pristine_env 'environment.exe' do
-          assert system('environment.exe')
-          env = Marshal.load(File.binread('environment'))
+        pristine_env exe_name('environment') do
+          assert system(exe_name('environment'))
+          env = Marshal.load(File.binread('environment.dat'))
           assert_equal '-rtime', env['RUBYOPT']
         end
       end
@@ -580,9 +1112,9 @@ class TestAibika < Minitest::Test
   def test_exit
     with_fixture 'exit' do
       assert system('ruby', aibika, 'exit.rb', *DefaultArgs)
-      pristine_env 'exit.exe' do
-        assert File.exist?('exit.exe')
-        assert system('exit.exe')
+      pristine_env exe_name('exit') do
+        assert File.exist?(exe_name('exit'))
+        assert system(exe_name('exit'))
       end
     end
   end
@@ -590,10 +1122,11 @@ class TestAibika < Minitest::Test
   def test_aibika_executable_env
     with_fixture 'environment' do
       assert system('ruby', aibika, 'environment.rb', *DefaultArgs)
-      pristine_env 'environment.exe' do
-        assert system('environment.exe')
-        env = Marshal.load(File.binread('environment'))
-        expected_path = File.expand_path('environment.exe').tr('/', '\\')
+      pristine_env exe_name('environment') do
+        assert system(exe_name('environment'))
+        env = Marshal.load(File.binread('environment.dat'))
+        expected_path = File.expand_path(exe_name('environment'))
+        expected_path = expected_path.tr('/', '\\') if Gem.win_platform?
         assert_equal expected_path, env['AIBIKA_EXECUTABLE']
       end
     end
@@ -602,8 +1135,8 @@ class TestAibika < Minitest::Test
   def test_hierarchy
     with_fixture 'hierarchy' do
       assert system('ruby', aibika, 'hierarchy.rb', 'assets/**/*', *DefaultArgs)
-      pristine_env 'hierarchy.exe' do
-        assert system('hierarchy.exe')
+      pristine_env exe_name('hierarchy') do
+        assert system(exe_name('hierarchy'))
       end
     end
   end
@@ -613,9 +1146,9 @@ class TestAibika < Minitest::Test
       assert system('ruby', aibika, 'helloworld.rb', *DefaultArgs)
       tempdir = File.expand_path('temporary directory')
       mkdir_p tempdir
-      pristine_env 'helloworld.exe' do
+      pristine_env exe_name('helloworld') do
         with_env 'TMP' => tempdir.tr('/', '\\') do
-          assert system('helloworld.exe')
+          assert system(exe_name('helloworld'))
         end
       end
     end
@@ -628,9 +1161,9 @@ class TestAibika < Minitest::Test
       script_path = File.expand_path('helloworld.rb')
       with_tmpdir do
         assert system('ruby', aibika, script_path, *DefaultArgs)
-        assert File.exist?('helloworld.exe')
-        pristine_env 'helloworld.exe' do
-          assert system('helloworld.exe')
+        assert File.exist?(exe_name('helloworld'))
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
         end
       end
     end
@@ -641,9 +1174,9 @@ class TestAibika < Minitest::Test
       mkdir 'build'
       cd 'build' do
         assert system('ruby', aibika, File.expand_path('../helloworld.rb'), *DefaultArgs)
-        assert File.exist?('helloworld.exe')
-        pristine_env 'helloworld.exe' do
-          assert system('helloworld.exe')
+        assert File.exist?(exe_name('helloworld'))
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
         end
       end
     end
@@ -652,9 +1185,9 @@ class TestAibika < Minitest::Test
   def test_relpath
     with_fixture 'helloworld' do
       assert system('ruby', aibika, './helloworld.rb', *DefaultArgs)
-      assert File.exist?('helloworld.exe')
-      pristine_env 'helloworld.exe' do
-        assert system('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
       end
     end
   end
@@ -664,9 +1197,9 @@ class TestAibika < Minitest::Test
       mkdir 'build'
       cd 'build' do
         assert system('ruby', aibika, '../helloworld.rb', *DefaultArgs)
-        assert File.exist?('helloworld.exe')
-        pristine_env 'helloworld.exe' do
-          assert system('helloworld.exe')
+        assert File.exist?(exe_name('helloworld'))
+        pristine_env exe_name('helloworld') do
+          assert system(exe_name('helloworld'))
         end
       end
     end
@@ -676,10 +1209,10 @@ class TestAibika < Minitest::Test
   def test_srcroot
     with_fixture 'srcroot' do
       assert system('ruby', aibika, 'bin/srcroot.rb', 'share/data.txt', *DefaultArgs)
-      assert File.exist?('srcroot.exe')
-      pristine_env 'srcroot.exe' do
-        exe = File.expand_path('srcroot.exe')
-        cd ENV.fetch('SystemRoot', nil) do
+      assert File.exist?(exe_name('srcroot'))
+      pristine_env exe_name('srcroot') do
+        exe = File.expand_path(exe_name('srcroot'))
+        cd ENV.fetch('SystemRoot', '/') do
           assert system(exe)
         end
       end
@@ -690,10 +1223,10 @@ class TestAibika < Minitest::Test
   def test_chdir
     with_fixture 'chdir' do
       assert system('ruby', aibika, 'chdir.rb', *DefaultArgs)
-      assert File.exist?('chdir.exe')
-      pristine_env 'chdir.exe' do
-        exe = File.expand_path('chdir.exe')
-        cd ENV.fetch('SystemRoot', nil) do
+      assert File.exist?(exe_name('chdir'))
+      pristine_env exe_name('chdir') do
+        exe = File.expand_path(exe_name('chdir'))
+        cd ENV.fetch('SystemRoot', '/') do
           assert system(exe)
         end
       end
@@ -705,16 +1238,16 @@ class TestAibika < Minitest::Test
     with_fixture 'writefile' do
       # Control test; make sure the writefile script works as expected under default options
       assert system('ruby', aibika, 'writefile.rb', *DefaultArgs)
-      pristine_env 'writefile.exe' do
+      pristine_env exe_name('writefile') do
         assert !File.exist?('output.txt')
-        assert system('writefile.exe')
+        assert system(exe_name('writefile'))
         assert File.exist?('output.txt')
       end
 
       assert system('ruby', aibika, 'writefile.rb', *(DefaultArgs + ['--chdir-first']))
-      pristine_env 'writefile.exe' do
+      pristine_env exe_name('writefile') do
         assert !File.exist?('output.txt')
-        assert system('writefile.exe')
+        assert system(exe_name('writefile'))
         # If the script ran in its inst directory, then our working dir still shouldn't have any output.txt
         assert !File.exist?('output.txt')
       end
@@ -727,9 +1260,9 @@ class TestAibika < Minitest::Test
     path = File.join(RbConfig::CONFIG['exec_prefix'], 'aibikatempsrc')
     with_fixture 'helloworld', path do
       assert system('ruby', aibika, 'helloworld.rb', *DefaultArgs)
-      assert File.exist?('helloworld.exe')
-      pristine_env 'helloworld.exe' do
-        assert system('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
       end
     end
   end
@@ -742,9 +1275,9 @@ class TestAibika < Minitest::Test
     assert number_of_files > 3
     with_fixture 'check_includes' do
       assert system('ruby', aibika, 'check_includes.rb', path, *DefaultArgs)
-      assert File.exist?('check_includes.exe')
-      pristine_env 'check_includes.exe' do
-        assert system('check_includes.exe', number_of_files.to_s)
+      assert File.exist?(exe_name('check_includes'))
+      pristine_env exe_name('check_includes') do
+        assert system(exe_name('check_includes'), number_of_files.to_s)
       end
     end
   end
@@ -753,12 +1286,13 @@ class TestAibika < Minitest::Test
   def test_nonexistent_temp
     with_fixture 'helloworld' do
       assert system('ruby', aibika, 'helloworld.rb', *DefaultArgs)
-      assert File.exist?('helloworld.exe')
-      pristine_env 'helloworld.exe' do
-        with_env 'TEMP' => 'c:\\thispathdoesnotexist12345', 'TMP' => 'c:\\thispathdoesnotexist12345' do
-          assert File.exist?('helloworld.exe')
-          system('helloworld.exe 2>NUL')
-          assert File.exist?('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
+      pristine_env exe_name('helloworld') do
+        with_env 'TEMP' => 'c:\\thispathdoesnotexist12345', 'TMP' => 'c:\\thispathdoesnotexist12345',
+                 'TMPDIR' => '/thispathdoesnotexist12345' do
+          assert File.exist?(exe_name('helloworld'))
+          system(exe_name('helloworld'), err: File::NULL)
+          assert File.exist?(exe_name('helloworld'))
         end
       end
     end
@@ -766,16 +1300,17 @@ class TestAibika < Minitest::Test
 
   # Test that code-signed executables still work
   def test_codesigning_support
+    skip 'Code signing is only tested on Windows' unless Gem.win_platform?
     signtool = which('signtool')
     assert !signtool.nil?, "signtool not found in PATH, cannot test code signing compatibility"
 
     with_fixture 'helloworld' do
       assert system('ruby', aibika, 'helloworld.rb', *DefaultArgs)
-      assert File.exist?('helloworld.exe')
+      assert File.exist?(exe_name('helloworld'))
       assert system("signtool sign /f #{File.join(__dir__, 'selfsign', 'selfsigncert.pfx')} /p password helloworld.exe")
-      pristine_env 'helloworld.exe' do
-        assert system('helloworld.exe')
-        out, _st = Open3.capture2e(signtool, 'verify', '/v', 'helloworld.exe')
+      pristine_env exe_name('helloworld') do
+        assert system(exe_name('helloworld'))
+        out, _st = Open3.capture2e(signtool, 'verify', '/v', exe_name('helloworld'))
         assert_match(/SHA1 hash: 900E46CB0D18D314778F7156FBBC74B1484B4EDB/, out)
       end
     end